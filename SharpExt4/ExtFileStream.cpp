@@ -158,4 +158,25 @@ void SharpExt4::ExtFileStream::SetLength(int64_t value)
     file->fsize = 0;
 }
 
+void SharpExt4::ExtFileStream::Preallocate(int64_t offset, int64_t length)
+{
+    Preallocate(offset, length, PreallocateMode::Default);
+}
+
+void SharpExt4::ExtFileStream::Preallocate(int64_t offset, int64_t length, PreallocateMode mode)
+{
+    if (offset < 0)
+    {
+        throw gcnew ArgumentOutOfRangeException("offset");
+    }
+    if (length <= 0)
+    {
+        throw gcnew ArgumentOutOfRangeException("length");
+    }
+    if (ext4_fallocate(file, offset, length, (uint32_t)mode) != EOK)
+    {
+        throw gcnew IOException("Could not preallocate file '" + path + "'.");
+    }
+}
+
 
@@ -34,6 +34,15 @@ using namespace System;
 using namespace System::IO;
 
 namespace SharpExt4 {
+	[Flags]
+	public enum class PreallocateMode
+	{
+		Default = 0,
+		KeepSize = EXT4_FALLOC_FL_KEEP_SIZE,
+		PunchHole = EXT4_FALLOC_FL_PUNCH_HOLE,
+		ZeroRange = EXT4_FALLOC_FL_ZERO_RANGE,
+	};
+
 	public ref class ExtFileStream : Stream
 	{
 	private:
@@ -58,6 +67,8 @@ namespace SharpExt4 {
 		int64_t Seek(int64_t offset, SeekOrigin origin) override;
 		void Flush() override;
 		void SetLength(int64_t value) override;
+		void Preallocate(int64_t offset, int64_t length);
+		void Preallocate(int64_t offset, int64_t length, PreallocateMode mode);
 	};
 }
 
@@ -75,6 +75,42 @@ bool SharpExt4::ExtFileSystem::CanWrite::get()
     return !disk->GetBlockDev()->fs->read_only;
 }
 
+uint64_t SharpExt4::ExtFileSystem::CacheSize::get()
+{
+    auto input_name = (char*)Marshal::StringToHGlobalAnsi(mountPoint).ToPointer();
+    struct ext4_cache_stats stats = { 0 };
+    int r = ext4_cache_stats(input_name, &stats);
+    Marshal::FreeHGlobal(IntPtr(input_name));
+    return r == EOK ? stats.capacity : 0;
+}
+
+void SharpExt4::ExtFileSystem::CacheSize::set(uint64_t value)
+{
+    auto input_name = (char*)Marshal::StringToHGlobalAnsi(mountPoint).ToPointer();
+    int r = ext4_cache_resize(input_name, value);
+    Marshal::FreeHGlobal(IntPtr(input_name));
+    if (r != EOK)
+        throw gcnew IOException("Could not resize block cache.");
+}
+
+uint64_t SharpExt4::ExtFileSystem::CacheHits::get()
+{
+    auto input_name = (char*)Marshal::StringToHGlobalAnsi(mountPoint).ToPointer();
+    struct ext4_cache_stats stats = { 0 };
+    int r = ext4_cache_stats(input_name, &stats);
+    Marshal::FreeHGlobal(IntPtr(input_name));
+    return r == EOK ? stats.hits : 0;
+}
+
+uint64_t SharpExt4::ExtFileSystem::CacheMisses::get()
+{
+    auto input_name = (char*)Marshal::StringToHGlobalAnsi(mountPoint).ToPointer();
+    struct ext4_cache_stats stats = { 0 };
+    int r = ext4_cache_stats(input_name, &stats);
+    Marshal::FreeHGlobal(IntPtr(input_name));
+    return r == EOK ? stats.misses : 0;
+}
+
 /// <summary>
 /// Get specific file length
 /// </summary>
@@ -232,6 +268,16 @@ void SharpExt4::ExtFileSystem::Truncate(String^ path, uint64_t size)
 /// </summary>
 /// <param name="path">Partition to open</param>
 SharpExt4::ExtFileSystem^ SharpExt4::ExtFileSystem::Open(ExtDisk^ disk, Partition^ partition)
+{
+    return Open(disk, partition, 0);
+}
+
+/// <summary>
+/// Open a given Linux partition with a block cache of the given capacity
+/// </summary>
+/// <param name="path">Partition to open</param>
+/// <param name="cacheSize">Block cache capacity in bytes (0 - default)</param>
+SharpExt4::ExtFileSystem^ SharpExt4::ExtFileSystem::Open(ExtDisk^ disk, Partition^ partition, uint64_t cacheSize)
 {
     if (disk == nullptr || partition == nullptr)
         return nullptr;
@@ -259,7 +305,9 @@ SharpExt4::ExtFileSystem^ SharpExt4::ExtFileSystem::Open(ExtDisk^ disk, Partitio
         {
             // Convert mount point to native string
             auto input_name = (char*)Marshal::StringToHGlobalAnsi(fs->mountPoint).ToPointer();
-            r = ext4_mount(fs->devName, input_name, false);
+            struct ext4_mount_opts opts = { 0 };
+            opts.cache_size = cacheSize;
+            r = ext4_mount_ex(fs->devName, input_name, false, &opts);
             Marshal::FreeHGlobal(IntPtr(input_name));
 
             if (r == EOK)
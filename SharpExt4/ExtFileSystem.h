@@ -138,6 +138,7 @@ namespace SharpExt4 {
 		void SetOwner(String^ path, uint32_t uid, uint32_t gid);
 		void Truncate(String^ path, uint64_t size);
 		static ExtFileSystem^ Open(ExtDisk^ disk, Partition^ partition);
+		static ExtFileSystem^ Open(ExtDisk^ disk, Partition^ partition, uint64_t cacheSize);
 
 		// Properties
 		property String^ Name { String^ get(); }
@@ -145,6 +146,9 @@ namespace SharpExt4 {
 		property String^ VolumeLabel { String^ get(); }
 		property bool CanWrite { bool get(); }
 		property String^ MountPoint { String^ get(); }
+		property uint64_t CacheSize { uint64_t get(); void set(uint64_t value); }
+		property uint64_t CacheHits { uint64_t get(); }
+		property uint64_t CacheMisses { uint64_t get(); }
 
 		String^ ToString() override;
 		~ExtFileSystem();
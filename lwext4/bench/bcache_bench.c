@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Block cache lookup and eviction benchmark.
+ *
+ * Fills a cache with cnt unreferenced blocks, then times:
+ * - random ext4_bcache_find_get / ext4_bcache_free pairs over it (a
+ *   warm cache hit of ext4_block_get),
+ * - misses on new blocks past the capacity: each one evicts the block
+ *   the replacement policy picks, as ext4_block_cache_shake does, and
+ *   inserts the new one.
+ * Build from the lwext4 directory (src/<all>.c stands for every source
+ * in src):
+ *
+ *   cc -O2 -Iinclude -o bcache_bench bench/bcache_bench.c src/<all>.c
+ *   ./bcache_bench [cnt...]
+ */
+
+#include <ext4_config.h>
+#include <ext4_bcache.h>
+#include <ext4_errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define LOOKUPS (4u << 20)
+#define EVICTIONS (2u << 20)
+#define ITEM_SIZE 512
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_rand(uint64_t *s)
+{
+	*s ^= *s << 13;
+	*s ^= *s >> 7;
+	*s ^= *s << 17;
+	return *s;
+}
+
+static int bench_run(uint32_t cnt)
+{
+	struct ext4_bcache bc;
+	struct ext4_block b;
+	uint64_t seed = 88172645463325252ull;
+	struct ext4_buf *buf;
+	uint64_t t, t_evict;
+	uint32_t i;
+	bool is_new;
+	int r;
+
+	r = ext4_bcache_init_dynamic(&bc, cnt, ITEM_SIZE);
+	if (r != EOK)
+		return r;
+
+	/*Warm up: every block cached and unreferenced*/
+	for (i = 0; i < cnt; i++) {
+		b.lb_id = i + 1;
+		r = ext4_bcache_alloc(&bc, &b, &is_new);
+		if (r != EOK)
+			goto Finish;
+
+		ext4_bcache_set_flag(b.buf, BC_UPTODATE);
+		ext4_bcache_free(&bc, &b);
+	}
+
+	t = bench_ns();
+	for (i = 0; i < LOOKUPS; i++) {
+		uint64_t lba = bench_rand(&seed) % cnt + 1;
+
+		if (!ext4_bcache_find_get(&bc, &b, lba)) {
+			r = ENOENT;
+			goto Finish;
+		}
+		ext4_bcache_free(&bc, &b);
+	}
+	t = bench_ns() - t;
+
+	/*Every miss drops the victim of the policy first*/
+	t_evict = bench_ns();
+	for (i = 0; i < EVICTIONS; i++) {
+		while (ext4_bcache_is_full(&bc)) {
+			buf = ext4_buf_lowest_lru(&bc);
+			if (!buf) {
+				r = ENOMEM;
+				goto Finish;
+			}
+			ext4_bcache_drop_buf(&bc, buf);
+		}
+
+		b.lb_id = (uint64_t)cnt + i + 1;
+		r = ext4_bcache_alloc(&bc, &b, &is_new);
+		if (r != EOK)
+			goto Finish;
+
+		ext4_bcache_set_flag(b.buf, BC_UPTODATE);
+		ext4_bcache_free(&bc, &b);
+	}
+	t_evict = bench_ns() - t_evict;
+
+	printf("%8u blocks: %6.1f ns per lookup, %6.1f ns per eviction\n",
+	       cnt, (double)t / LOOKUPS, (double)t_evict / EVICTIONS);
+
+Finish:
+	ext4_bcache_cleanup(&bc);
+	ext4_bcache_fini_dynamic(&bc);
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	static const uint32_t def[] = {1u << 10, 1u << 16, 1u << 20};
+	int i, r;
+
+	if (argc < 2) {
+		for (i = 0; i < 3; i++) {
+			r = bench_run(def[i]);
+			if (r != EOK)
+				return r;
+		}
+		return 0;
+	}
+
+	for (i = 1; i < argc; i++) {
+		r = bench_run((uint32_t)strtoul(argv[i], NULL, 0));
+		if (r != EOK)
+			return r;
+	}
+
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Bitmap search benchmark.
+ *
+ * Times ext4_bmap_bit_find_clr over a 32768 bit bitmap (one block group
+ * of 4 KiB blocks) with all bits set except one near the end: the worst
+ * case of a full group. Build from the lwext4 directory (src/<all>.c
+ * stands for every source in src):
+ *
+ *   cc -O2 -Iinclude -o bitmap_bench bench/bitmap_bench.c src/<all>.c
+ *
+ * Add -DCONFIG_BITMAP_AVX2=0 to time the portable kernel on x86-64.
+ */
+
+#include <ext4_config.h>
+#include <ext4_bitmap.h>
+#include <ext4_errno.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define BITS 32768
+#define FREE_BIT (BITS - 77)
+#define LOOPS 200000
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int main(void)
+{
+	static uint8_t bmap[BITS / 8];
+	uint32_t bit = 0, i;
+	uint64_t t;
+
+	memset(bmap, 0xff, sizeof(bmap));
+	ext4_bmap_bit_clr(bmap, FREE_BIT);
+
+	t = bench_ns();
+	for (i = 0; i < LOOPS; i++) {
+		if (ext4_bmap_bit_find_clr(bmap, i % 8, BITS, &bit) != EOK ||
+		    bit != FREE_BIT) {
+			printf("wrong result %u\n", bit);
+			return 1;
+		}
+	}
+	t = bench_ns() - t;
+
+	printf("find_clr: %.3f us per scan\n", (double)t / LOOPS / 1000);
+	return 0;
+}
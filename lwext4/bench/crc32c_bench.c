@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * CRC32C throughput benchmark.
+ *
+ * Times every CRC32C kernel over 4 KiB blocks in one run: the byte-wise
+ * table loop, slicing-by-8, SSE4.2 (x86-64 CPUs which have it) and the
+ * kernel ext4_crc32c picks. The kernels are static, so the source is
+ * included here. Build from the lwext4 directory:
+ *
+ *   cc -O2 -Iinclude -o crc32c_bench bench/crc32c_bench.c
+ */
+
+#include "../src/ext4_crc32.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BLOCK_SIZE 4096
+#define BLOCKS 256
+#define BYTES (1ull << 30)
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	timespec_get(&ts, TIME_UTC);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t crc32c_bytewise(uint32_t crc, const void *buf, uint32_t size)
+{
+	return crc32(crc, buf, size, crc32c_tab);
+}
+
+static void bench_run(const char *name, const uint8_t *data,
+		      uint32_t (*crc_fn)(uint32_t, const void *, uint32_t))
+{
+	uint32_t crc = 0;
+	uint64_t t, done;
+	uint32_t i = 0;
+
+	t = bench_ns();
+	for (done = 0; done < BYTES; done += BLOCK_SIZE) {
+		crc = crc_fn(crc, data + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		i = (i + 1) % BLOCKS;
+	}
+	t = bench_ns() - t;
+
+	printf("%-12s %8.0f MB/s (crc %08x)\n", name, BYTES * 1e3 / t,
+	       (unsigned)crc);
+}
+
+int main(void)
+{
+	uint8_t *data = malloc((size_t)BLOCKS * BLOCK_SIZE);
+	uint32_t i;
+
+	if (!data)
+		return 1;
+
+	for (i = 0; i < BLOCKS * BLOCK_SIZE; i++)
+		data[i] = (uint8_t)(i * 2654435761u >> 24);
+
+	/*Resolves the ext4_crc32c kernel and builds all tables*/
+	ext4_crc32c(0, data, 1);
+
+	bench_run("byte-wise", data, crc32c_bytewise);
+	bench_run("slicing-by-8", data, crc32c_sb8);
+#ifdef CRC32C_SSE42_FN
+	if (crc32c_have_sse42()) {
+		crc32c_zeros(crc32c_long_tab, CRC32C_LONG);
+		crc32c_zeros(crc32c_short_tab, CRC32C_SHORT);
+		bench_run("sse4.2", data, crc32c_sse42);
+	}
+#endif
+	bench_run("ext4_crc32c", data, ext4_crc32c);
+
+	free(data);
+	return 0;
+}
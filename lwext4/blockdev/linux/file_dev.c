@@ -0,0 +1,585 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "../../include/ext4_config.h"
+#include "../../include/ext4_blockdev.h"
+#include "../../include/ext4_errno.h"
+
+#include "file_dev.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+/**@brief   Default physical block size of image files.*/
+#define FILE_DEV_BSIZE 512
+
+/**@brief   Number of aligned bounce buffers.*/
+#define FILE_DEV_BOUNCE_CNT 4
+
+/**@brief   Single bounce buffer size.*/
+#define FILE_DEV_BOUNCE_SIZE (256 * 1024)
+
+/**@brief   Bounce buffer alignment (O_DIRECT memory alignment).*/
+#define FILE_DEV_ALIGN 4096
+
+/**@brief   Maximum I/O vector length passed to a single pwritev.*/
+#define FILE_DEV_IOV_MAX 64
+
+/**@brief   Linux file device private data.*/
+struct file_dev {
+	/**@brief   Block device handed out to lwext4.*/
+	struct ext4_blockdev bdev;
+
+	/**@brief   Block device interface.*/
+	struct ext4_blockdev_iface bdif;
+
+	/**@brief   File descriptor (-1 when closed).*/
+	int fd;
+
+	/**@brief   O_DIRECT requested by the user.*/
+	bool direct;
+
+	/**@brief   O_DIRECT currently in effect on fd.*/
+	bool o_direct;
+
+	/**@brief   fd is a block device (not an image file).*/
+	bool blkdev;
+
+	/**@brief   Bounce buffer pool lock.*/
+	pthread_mutex_t pool_lock;
+
+	/**@brief   Bitmap of free bounce buffers.*/
+	uint32_t pool_free;
+
+	/**@brief   Aligned bounce buffers.*/
+	void *pool[FILE_DEV_BOUNCE_CNT];
+};
+
+/**********************BLOCKDEV INTERFACE**************************************/
+static int file_dev_open(struct ext4_blockdev *bdev);
+static int file_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt);
+static int file_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt);
+static int file_dev_close(struct ext4_blockdev *bdev);
+static int file_dev_bwritev(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov,
+			    uint32_t iov_cnt, uint64_t blk_id);
+static int file_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			    uint64_t blk_cnt);
+static bool file_dev_reads_zero(struct ext4_blockdev *bdev, uint64_t blk_id,
+				uint64_t blk_cnt);
+
+/******************************************************************************/
+static void file_dev_pool_fini(struct file_dev *fdev)
+{
+	for (int i = 0; i < FILE_DEV_BOUNCE_CNT; ++i) {
+		free(fdev->pool[i]);
+		fdev->pool[i] = NULL;
+	}
+	fdev->pool_free = 0;
+}
+
+static int file_dev_pool_init(struct file_dev *fdev)
+{
+	for (int i = 0; i < FILE_DEV_BOUNCE_CNT; ++i) {
+		if (posix_memalign(&fdev->pool[i], FILE_DEV_ALIGN,
+				   FILE_DEV_BOUNCE_SIZE)) {
+			fdev->pool[i] = NULL;
+			file_dev_pool_fini(fdev);
+			return ENOMEM;
+		}
+		fdev->pool_free |= 1u << i;
+	}
+	return EOK;
+}
+
+/**@brief   Take a bounce buffer from the pool. A one-shot buffer is
+ *          allocated if the pool is exhausted (idx is set to -1).*/
+static void *file_dev_bounce_get(struct file_dev *fdev, int *idx)
+{
+	void *p = NULL;
+
+	pthread_mutex_lock(&fdev->pool_lock);
+	for (int i = 0; i < FILE_DEV_BOUNCE_CNT; ++i) {
+		if (fdev->pool_free & (1u << i)) {
+			fdev->pool_free &= ~(1u << i);
+			*idx = i;
+			p = fdev->pool[i];
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fdev->pool_lock);
+
+	if (p)
+		return p;
+
+	*idx = -1;
+	if (posix_memalign(&p, FILE_DEV_ALIGN, FILE_DEV_BOUNCE_SIZE))
+		return NULL;
+
+	return p;
+}
+
+static void file_dev_bounce_put(struct file_dev *fdev, void *p, int idx)
+{
+	if (idx < 0) {
+		free(p);
+		return;
+	}
+
+	pthread_mutex_lock(&fdev->pool_lock);
+	fdev->pool_free |= 1u << idx;
+	pthread_mutex_unlock(&fdev->pool_lock);
+}
+
+/**@brief   Some filesystems reject O_DIRECT transfers which are not
+ *          aligned to their own sector size. Drop O_DIRECT in that case
+ *          and keep going with buffered I/O.*/
+static bool file_dev_direct_fallback(struct file_dev *fdev)
+{
+	int fl;
+
+	if (!fdev->o_direct || errno != EINVAL)
+		return false;
+
+	fl = fcntl(fdev->fd, F_GETFL);
+	if (fl < 0 || fcntl(fdev->fd, F_SETFL, fl & ~O_DIRECT) < 0)
+		return false;
+
+	fdev->o_direct = false;
+	return true;
+}
+
+static int file_dev_pread(struct file_dev *fdev, void *buf, size_t len,
+			  uint64_t off)
+{
+	uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = pread(fdev->fd, p, len, (off_t)off);
+		if (n < 0) {
+			if (errno == EINTR || file_dev_direct_fallback(fdev))
+				continue;
+			return EIO;
+		}
+
+		/*Read beyond the end of device*/
+		if (n == 0)
+			return EIO;
+
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return EOK;
+}
+
+static int file_dev_pwrite(struct file_dev *fdev, const void *buf, size_t len,
+			   uint64_t off)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t n = pwrite(fdev->fd, p, len, (off_t)off);
+		if (n < 0) {
+			if (errno == EINTR || file_dev_direct_fallback(fdev))
+				continue;
+			return errno == ENOSPC ? ENOSPC : EIO;
+		}
+
+		p += n;
+		len -= n;
+		off += n;
+	}
+	return EOK;
+}
+
+static int file_dev_pwritev(struct file_dev *fdev, struct iovec *v, int cnt,
+			    uint64_t off)
+{
+	while (cnt) {
+		ssize_t n = pwritev(fdev->fd, v, cnt, (off_t)off);
+		if (n < 0) {
+			if (errno == EINTR || file_dev_direct_fallback(fdev))
+				continue;
+			return errno == ENOSPC ? ENOSPC : EIO;
+		}
+
+		/*Skip what was written, resume a partial write*/
+		off += n;
+		while (cnt && (size_t)n >= v->iov_len) {
+			n -= v->iov_len;
+			v++;
+			cnt--;
+		}
+		if (cnt) {
+			v->iov_base = (uint8_t *)v->iov_base + n;
+			v->iov_len -= n;
+		}
+	}
+	return EOK;
+}
+
+static bool file_dev_is_aligned(const void *buf)
+{
+	return !((uintptr_t)buf & (FILE_DEV_ALIGN - 1));
+}
+
+/******************************************************************************/
+static int file_dev_open(struct ext4_blockdev *bdev)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	struct stat st;
+	uint64_t size;
+	uint32_t bsize = FILE_DEV_BSIZE;
+	int oflags = O_CLOEXEC;
+	int r;
+
+	if (fdev->direct)
+		oflags |= O_DIRECT;
+
+	/*Try read-write first, then read-only*/
+	fdev->fd = open(bdev->bdif->fname, oflags | O_RDWR);
+	if (fdev->fd < 0 && (errno == EACCES || errno == EROFS))
+		fdev->fd = open(bdev->bdif->fname, oflags | O_RDONLY);
+
+	/*O_DIRECT is not supported by every filesystem (tmpfs...)*/
+	if (fdev->fd < 0 && fdev->direct && errno == EINVAL) {
+		oflags &= ~O_DIRECT;
+		fdev->fd = open(bdev->bdif->fname, oflags | O_RDWR);
+		if (fdev->fd < 0 && (errno == EACCES || errno == EROFS))
+			fdev->fd = open(bdev->bdif->fname, oflags | O_RDONLY);
+	}
+
+	if (fdev->fd < 0)
+		return errno == ENOENT ? ENOENT : EIO;
+
+	fdev->o_direct = !!(oflags & O_DIRECT);
+
+	if (fstat(fdev->fd, &st)) {
+		r = EIO;
+		goto Fail;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		int ssz;
+		if (ioctl(fdev->fd, BLKSSZGET, &ssz) ||
+		    ioctl(fdev->fd, BLKGETSIZE64, &size)) {
+			r = EIO;
+			goto Fail;
+		}
+		bsize = (uint32_t)ssz;
+		fdev->blkdev = true;
+	} else if (S_ISREG(st.st_mode)) {
+		/* Image files are addressed in 512 byte sectors, the same
+		 * way partition tables inside of them are.*/
+		size = (uint64_t)st.st_size;
+		fdev->blkdev = false;
+	} else {
+		r = ENOTSUP;
+		goto Fail;
+	}
+
+	if (bsize > sizeof(bdev->bdif->ph_bbuf) || (bsize & (bsize - 1))) {
+		r = ENOTSUP;
+		goto Fail;
+	}
+
+	if (fdev->o_direct) {
+		r = file_dev_pool_init(fdev);
+		if (r != EOK)
+			goto Fail;
+	}
+
+	bdev->bdif->ph_bsize = bsize;
+	bdev->bdif->ph_bcnt = size / bsize;
+	bdev->bdif->ph_scnt = 1;
+	bdev->bdif->ph_tcnt = 1;
+
+	bdev->part_offset = 0;
+	bdev->part_size = bdev->bdif->ph_bcnt * bsize;
+
+	return EOK;
+
+Fail:
+	close(fdev->fd);
+	fdev->fd = -1;
+	return r;
+}
+
+/******************************************************************************/
+static int file_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	size_t len = (size_t)blk_cnt * bdev->bdif->ph_bsize;
+	uint8_t *p = buf;
+	void *bounce;
+	int idx;
+	int r = EOK;
+
+	if (!fdev->o_direct || file_dev_is_aligned(buf))
+		return file_dev_pread(fdev, buf, len, off);
+
+	/*Caller buffer can't be used with O_DIRECT, bounce it*/
+	bounce = file_dev_bounce_get(fdev, &idx);
+	if (!bounce)
+		return ENOMEM;
+
+	while (len) {
+		size_t n = len > FILE_DEV_BOUNCE_SIZE ? FILE_DEV_BOUNCE_SIZE : len;
+		r = file_dev_pread(fdev, bounce, n, off);
+		if (r != EOK)
+			break;
+
+		memcpy(p, bounce, n);
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	file_dev_bounce_put(fdev, bounce, idx);
+	return r;
+}
+
+/******************************************************************************/
+static int file_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	size_t len = (size_t)blk_cnt * bdev->bdif->ph_bsize;
+	const uint8_t *p = buf;
+	void *bounce;
+	int idx;
+	int r = EOK;
+
+	if (!fdev->o_direct || file_dev_is_aligned(buf))
+		return file_dev_pwrite(fdev, buf, len, off);
+
+	/*Caller buffer can't be used with O_DIRECT, bounce it*/
+	bounce = file_dev_bounce_get(fdev, &idx);
+	if (!bounce)
+		return ENOMEM;
+
+	while (len) {
+		size_t n = len > FILE_DEV_BOUNCE_SIZE ? FILE_DEV_BOUNCE_SIZE : len;
+		memcpy(bounce, p, n);
+		r = file_dev_pwrite(fdev, bounce, n, off);
+		if (r != EOK)
+			break;
+
+		p += n;
+		len -= n;
+		off += n;
+	}
+
+	file_dev_bounce_put(fdev, bounce, idx);
+	return r;
+}
+
+/******************************************************************************/
+static int file_dev_bwritev(struct ext4_blockdev *bdev,
+			    const struct ext4_blockdev_iovec *iov,
+			    uint32_t iov_cnt, uint64_t blk_id)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	struct iovec v[FILE_DEV_IOV_MAX];
+	uint32_t i, j, n;
+	int r = EOK;
+
+	for (i = 0; i < iov_cnt && r == EOK; i += n) {
+		bool aligned = true;
+
+		n = iov_cnt - i;
+		if (n > FILE_DEV_IOV_MAX)
+			n = FILE_DEV_IOV_MAX;
+
+		for (j = 0; j < n; j++) {
+			v[j].iov_base = (void *)iov[i + j].buf;
+			v[j].iov_len = (size_t)iov[i + j].blk_cnt *
+				       bdev->bdif->ph_bsize;
+			aligned = aligned && file_dev_is_aligned(v[j].iov_base);
+		}
+
+		if (!fdev->o_direct || aligned) {
+			r = file_dev_pwritev(fdev, v, n,
+					     blk_id * bdev->bdif->ph_bsize);
+			for (j = 0; j < n; j++)
+				blk_id += iov[i + j].blk_cnt;
+			continue;
+		}
+
+		/*Misaligned for O_DIRECT, bounce buffer by buffer*/
+		for (j = 0; j < n && r == EOK; j++) {
+			r = file_dev_bwrite(bdev, iov[i + j].buf, blk_id,
+					    iov[i + j].blk_cnt);
+			blk_id += iov[i + j].blk_cnt;
+		}
+	}
+
+	return r;
+}
+
+/******************************************************************************/
+static int file_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			    uint64_t blk_cnt)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	uint64_t len = blk_cnt * bdev->bdif->ph_bsize;
+	int r;
+
+	if (fdev->blkdev) {
+		uint64_t range[2] = {off, len};
+		r = ioctl(fdev->fd, BLKDISCARD, range);
+	} else {
+		/*Image files get sparse again*/
+		r = fallocate(fdev->fd, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, (off_t)off, (off_t)len);
+	}
+
+	if (r)
+		return errno == EOPNOTSUPP ? ENOTSUP : EIO;
+
+	return EOK;
+}
+
+/******************************************************************************/
+static bool file_dev_reads_zero(struct ext4_blockdev *bdev, uint64_t blk_id,
+				uint64_t blk_cnt)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	uint64_t off = blk_id * bdev->bdif->ph_bsize;
+	uint64_t len = blk_cnt * bdev->bdif->ph_bsize;
+	off_t data;
+
+	if (fdev->blkdev)
+		return false;
+
+	/* A range without data is a hole of the image file (e.g. grown by
+	 * ftruncate). Filesystems without SEEK_DATA report all as data.*/
+	data = lseek(fdev->fd, (off_t)off, SEEK_DATA);
+	if (data < 0)
+		return errno == ENXIO;
+
+	return (uint64_t)data >= off + len;
+}
+
+/******************************************************************************/
+static int file_dev_close(struct ext4_blockdev *bdev)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+	int r = EOK;
+
+	if (fdev->fd < 0)
+		return EOK;
+
+	if (fsync(fdev->fd) && errno != EINVAL && errno != EROFS)
+		r = EIO;
+
+	close(fdev->fd);
+	fdev->fd = -1;
+	file_dev_pool_fini(fdev);
+	return r;
+}
+
+/******************************************************************************/
+struct ext4_blockdev *ext4_file_dev_get(const char *fname, bool direct)
+{
+	struct file_dev *fdev;
+
+	if (strlen(fname) >= sizeof(fdev->bdif.fname))
+		return NULL;
+
+	fdev = calloc(1, sizeof(struct file_dev));
+	if (!fdev)
+		return NULL;
+
+	fdev->bdif.open = file_dev_open;
+	fdev->bdif.bread = file_dev_bread;
+	fdev->bdif.bwrite = file_dev_bwrite;
+	fdev->bdif.close = file_dev_close;
+	fdev->bdif.bwritev = file_dev_bwritev;
+	fdev->bdif.discard = file_dev_discard;
+	fdev->bdif.reads_zero = file_dev_reads_zero;
+	fdev->bdif.ph_bsize = FILE_DEV_BSIZE;
+	fdev->bdif.p_user = fdev;
+	strcpy(fdev->bdif.fname, fname);
+
+	fdev->bdev.bdif = &fdev->bdif;
+	fdev->fd = -1;
+	fdev->direct = direct;
+	pthread_mutex_init(&fdev->pool_lock, NULL);
+
+	return &fdev->bdev;
+}
+
+/******************************************************************************/
+int ext4_file_dev_fd(struct ext4_blockdev *bdev, uint32_t *align)
+{
+	struct file_dev *fdev = bdev->bdif->p_user;
+
+	if (align)
+		*align = fdev->o_direct ? FILE_DEV_ALIGN : 1;
+
+	return fdev->fd;
+}
+
+/******************************************************************************/
+void ext4_file_dev_put(struct ext4_blockdev *bdev)
+{
+	struct file_dev *fdev;
+
+	if (!bdev)
+		return;
+
+	fdev = bdev->bdif->p_user;
+	if (fdev->fd >= 0) {
+		close(fdev->fd);
+		file_dev_pool_fini(fdev);
+	}
+
+	pthread_mutex_destroy(&fdev->pool_lock);
+	free(fdev);
+}
+/******************************************************************************/
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FILE_DEV_H_
+#define FILE_DEV_H_
+
+#include "../../include/ext4_config.h"
+#include "../../include/ext4_blockdev.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**@brief   Linux file/block device blockdev get.
+ * @param   fname image file or block device path
+ * @param   direct open with O_DIRECT (falls back to buffered I/O
+ *          if the underlying filesystem does not support it)
+ * @return  block device or NULL on allocation failure*/
+struct ext4_blockdev *ext4_file_dev_get(const char *fname, bool direct);
+
+/**@brief   File descriptor of an opened file device.
+ * @param   bdev block device
+ * @param   align buffer alignment required by the descriptor
+ *          (1 when O_DIRECT is not in effect)
+ * @return  file descriptor (-1 when closed)*/
+int ext4_file_dev_fd(struct ext4_blockdev *bdev, uint32_t *align);
+
+/**@brief   Release block device returned by @ref ext4_file_dev_get.
+ * @param   bdev block device (must be closed)*/
+void ext4_file_dev_put(struct ext4_blockdev *bdev);
+
+#endif /* FILE_DEV_H_ */
@@ -0,0 +1,451 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include "../../include/ext4_config.h"
+#include "../../include/ext4_blockdev.h"
+#include "../../include/ext4_errno.h"
+
+#include "file_dev.h"
+#include "uring_dev.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**@brief   Linux io_uring device private data.*/
+struct uring_dev {
+	/**@brief   Block device handed out to lwext4.*/
+	struct ext4_blockdev bdev;
+
+	/**@brief   Block device interface.*/
+	struct ext4_blockdev_iface bdif;
+
+	/**@brief   pread/pwrite device used for synchronous I/O.*/
+	struct ext4_blockdev *file;
+
+	/**@brief   Requested submission queue depth.*/
+	uint32_t depth;
+
+	/**@brief   Ring file descriptor (-1 - synchronous mode).*/
+	int ring_fd;
+
+	/**@brief   Filled, not yet submitted entries.*/
+	uint32_t queued;
+
+	/**@brief   Submitted, not yet reaped entries.*/
+	uint32_t inflight;
+
+	/**@brief   Submission queue entries count.*/
+	uint32_t sq_entries;
+
+	void *sq_ptr;
+	size_t sq_sz;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	size_t sqes_sz;
+
+	void *cq_ptr;
+	size_t cq_sz;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+};
+
+/**********************BLOCKDEV INTERFACE**************************************/
+static int uring_dev_open(struct ext4_blockdev *bdev);
+static int uring_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt);
+static int uring_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			    uint64_t blk_id, uint32_t blk_cnt);
+static int uring_dev_close(struct ext4_blockdev *bdev);
+static int uring_dev_submit(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_req *req);
+static int uring_dev_wait(struct ext4_blockdev *bdev);
+static int uring_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			     uint64_t blk_cnt);
+static bool uring_dev_reads_zero(struct ext4_blockdev *bdev, uint64_t blk_id,
+				 uint64_t blk_cnt);
+
+/******************************************************************************/
+static void uring_dev_unmap(struct uring_dev *u)
+{
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_sz);
+	if (u->cq_ptr && u->cq_ptr != u->sq_ptr)
+		munmap(u->cq_ptr, u->cq_sz);
+	if (u->sq_ptr)
+		munmap(u->sq_ptr, u->sq_sz);
+
+	u->sqes = NULL;
+	u->cq_ptr = NULL;
+	u->sq_ptr = NULL;
+
+	if (u->ring_fd >= 0)
+		close(u->ring_fd);
+	u->ring_fd = -1;
+}
+
+static int uring_dev_setup(struct uring_dev *u)
+{
+	struct io_uring_params p;
+	uint8_t *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	u->ring_fd = (int)syscall(__NR_io_uring_setup, u->depth, &p);
+	if (u->ring_fd < 0)
+		return EIO;
+
+	u->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cq_sz > u->sq_sz)
+			u->sq_sz = u->cq_sz;
+		u->cq_sz = u->sq_sz;
+	}
+
+	u->sq_ptr = mmap(NULL, u->sq_sz, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, u->ring_fd,
+			 IORING_OFF_SQ_RING);
+	if (u->sq_ptr == MAP_FAILED) {
+		u->sq_ptr = NULL;
+		goto Fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		u->cq_ptr = u->sq_ptr;
+	else {
+		u->cq_ptr = mmap(NULL, u->cq_sz, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, u->ring_fd,
+				 IORING_OFF_CQ_RING);
+		if (u->cq_ptr == MAP_FAILED) {
+			u->cq_ptr = NULL;
+			goto Fail;
+		}
+	}
+
+	u->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_sz, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, u->ring_fd,
+		       IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto Fail;
+	}
+
+	sq = u->sq_ptr;
+	cq = u->cq_ptr;
+	u->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned *)(sq + p.sq_off.array);
+	u->cq_head = (unsigned *)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	u->sq_entries = p.sq_entries;
+	u->queued = 0;
+	u->inflight = 0;
+	return EOK;
+
+Fail:
+	uring_dev_unmap(u);
+	return EIO;
+}
+
+/******************************************************************************/
+static int uring_dev_sync(struct uring_dev *u, struct ext4_blockdev_req *req)
+{
+	if (req->write)
+		return u->file->bdif->bwrite(u->file, req->buf, req->blk_id,
+					     req->blk_cnt);
+
+	return u->file->bdif->bread(u->file, req->buf, req->blk_id,
+				    req->blk_cnt);
+}
+
+static void uring_dev_complete(struct uring_dev *u,
+			       struct ext4_blockdev_req *req, int res)
+{
+	uint64_t len = (uint64_t)req->blk_cnt * u->bdif.ph_bsize;
+
+	/*Error or short transfer: redo whole request synchronously*/
+	if (res < 0 || (uint64_t)res != len)
+		req->res = uring_dev_sync(u, req);
+	else
+		req->res = EOK;
+
+	if (req->end_io)
+		req->end_io(&u->bdev, req);
+}
+
+static void uring_dev_reap(struct uring_dev *u)
+{
+	unsigned head = *u->cq_head;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+		struct ext4_blockdev_req *req = (void *)(uintptr_t)cqe->user_data;
+		int res = cqe->res;
+
+		head++;
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+		u->inflight--;
+		uring_dev_complete(u, req, res);
+	}
+}
+
+/**@brief   Submit queued entries and wait for at least min_complete
+ *          completions.*/
+static int uring_dev_enter(struct uring_dev *u, uint32_t min_complete)
+{
+	while (u->queued || min_complete) {
+		unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+		int n = (int)syscall(__NR_io_uring_enter, u->ring_fd,
+				     u->queued, min_complete, flags, NULL, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY) {
+				uring_dev_reap(u);
+				continue;
+			}
+			return EIO;
+		}
+
+		u->queued -= (uint32_t)n;
+		u->inflight += (uint32_t)n;
+		uring_dev_reap(u);
+		min_complete = 0;
+	}
+	return EOK;
+}
+
+/******************************************************************************/
+static int uring_dev_open(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	int r;
+
+	r = u->file->bdif->open(u->file);
+	if (r != EOK)
+		return r;
+
+	bdev->bdif->ph_bsize = u->file->bdif->ph_bsize;
+	bdev->bdif->ph_bcnt = u->file->bdif->ph_bcnt;
+	bdev->bdif->ph_scnt = u->file->bdif->ph_scnt;
+	bdev->bdif->ph_tcnt = u->file->bdif->ph_tcnt;
+
+	bdev->part_offset = 0;
+	bdev->part_size = u->file->part_size;
+
+	/*No io_uring (old kernel, seccomp...) - stay synchronous*/
+	uring_dev_setup(u);
+	return EOK;
+}
+
+/******************************************************************************/
+static int uring_dev_bread(struct ext4_blockdev *bdev, void *buf,
+			   uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	return u->file->bdif->bread(u->file, buf, blk_id, blk_cnt);
+}
+
+/******************************************************************************/
+static int uring_dev_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			    uint64_t blk_id, uint32_t blk_cnt)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	return u->file->bdif->bwrite(u->file, buf, blk_id, blk_cnt);
+}
+
+/******************************************************************************/
+static int uring_dev_submit(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_req *req)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	struct io_uring_sqe *sqe;
+	uint32_t align;
+	unsigned tail, idx;
+	int fd;
+	int r;
+
+	fd = ext4_file_dev_fd(u->file, &align);
+	if (u->ring_fd < 0 || ((uintptr_t)req->buf & (align - 1))) {
+		/*Can't go through the ring, complete it in place*/
+		req->res = uring_dev_sync(u, req);
+		if (req->end_io)
+			req->end_io(bdev, req);
+		return EOK;
+	}
+
+	/*Never queue more than the completion ring can take*/
+	if (u->queued + u->inflight >= u->sq_entries) {
+		r = uring_dev_enter(u, 1);
+		if (r != EOK)
+			return r;
+	}
+
+	tail = *u->sq_tail;
+	idx = tail & *u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = req->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)req->buf;
+	sqe->len = req->blk_cnt * u->bdif.ph_bsize;
+	sqe->off = req->blk_id * u->bdif.ph_bsize;
+	sqe->user_data = (uintptr_t)req;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	u->queued++;
+
+	/*Batch is full, hand it to the kernel*/
+	if (u->queued >= u->sq_entries / 2)
+		return uring_dev_enter(u, 0);
+
+	return EOK;
+}
+
+/******************************************************************************/
+static int uring_dev_wait(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	int r;
+
+	if (u->ring_fd < 0)
+		return EOK;
+
+	while (u->queued || u->inflight) {
+		r = uring_dev_enter(u, u->queued + u->inflight);
+		if (r != EOK)
+			return r;
+	}
+	return EOK;
+}
+
+/******************************************************************************/
+static int uring_dev_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			     uint64_t blk_cnt)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+	int r;
+
+	/*Writes in flight must not land after the discard*/
+	r = uring_dev_wait(bdev);
+	if (r != EOK)
+		return r;
+
+	return u->file->bdif->discard(u->file, blk_id, blk_cnt);
+}
+
+/******************************************************************************/
+static bool uring_dev_reads_zero(struct ext4_blockdev *bdev, uint64_t blk_id,
+				 uint64_t blk_cnt)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+
+	/*Writes in flight are not visible in the file yet*/
+	if (uring_dev_wait(bdev) != EOK)
+		return false;
+
+	return u->file->bdif->reads_zero(u->file, blk_id, blk_cnt);
+}
+
+/******************************************************************************/
+static int uring_dev_close(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u = bdev->bdif->p_user;
+
+	uring_dev_wait(bdev);
+	uring_dev_unmap(u);
+	return u->file->bdif->close(u->file);
+}
+
+/******************************************************************************/
+struct ext4_blockdev *ext4_uring_dev_get(const char *fname, bool direct,
+					 uint32_t depth)
+{
+	struct uring_dev *u;
+
+	if (strlen(fname) >= sizeof(u->bdif.fname))
+		return NULL;
+
+	u = calloc(1, sizeof(struct uring_dev));
+	if (!u)
+		return NULL;
+
+	u->file = ext4_file_dev_get(fname, direct);
+	if (!u->file) {
+		free(u);
+		return NULL;
+	}
+
+	u->bdif.open = uring_dev_open;
+	u->bdif.bread = uring_dev_bread;
+	u->bdif.bwrite = uring_dev_bwrite;
+	u->bdif.close = uring_dev_close;
+	u->bdif.submit = uring_dev_submit;
+	u->bdif.wait = uring_dev_wait;
+	u->bdif.discard = uring_dev_discard;
+	u->bdif.reads_zero = uring_dev_reads_zero;
+	u->bdif.ph_bsize = u->file->bdif->ph_bsize;
+	u->bdif.p_user = u;
+	strcpy(u->bdif.fname, fname);
+
+	u->bdev.bdif = &u->bdif;
+	u->depth = depth ? depth : URING_DEV_DEPTH;
+	u->ring_fd = -1;
+
+	return &u->bdev;
+}
+
+/******************************************************************************/
+void ext4_uring_dev_put(struct ext4_blockdev *bdev)
+{
+	struct uring_dev *u;
+
+	if (!bdev)
+		return;
+
+	u = bdev->bdif->p_user;
+	uring_dev_unmap(u);
+	ext4_file_dev_put(u->file);
+	free(u);
+}
+/******************************************************************************/
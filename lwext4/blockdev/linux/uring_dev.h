@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef URING_DEV_H_
+#define URING_DEV_H_
+
+#include "../../include/ext4_config.h"
+#include "../../include/ext4_blockdev.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**@brief   Default io_uring submission queue depth.*/
+#define URING_DEV_DEPTH 64
+
+/**@brief   Linux io_uring blockdev get. Synchronous bread/bwrite are
+ *          served with pread/pwrite (see file_dev.h), requests queued
+ *          through ext4_blocks_submit are batched into the ring.
+ *          If io_uring is not available all requests complete
+ *          synchronously.
+ * @param   fname image file or block device path
+ * @param   direct open with O_DIRECT
+ * @param   depth submission queue depth (0 - @ref URING_DEV_DEPTH)
+ * @return  block device or NULL on allocation failure*/
+struct ext4_blockdev *ext4_uring_dev_get(const char *fname, bool direct,
+					 uint32_t depth);
+
+/**@brief   Release block device returned by @ref ext4_uring_dev_get.
+ * @param   bdev block device (must be closed)*/
+void ext4_uring_dev_put(struct ext4_blockdev *bdev);
+
+#endif /* URING_DEV_H_ */
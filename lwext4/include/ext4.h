@@ -84,6 +84,18 @@ typedef struct ext4_file {
 
 	/**@brief   Actual file position.*/
 	uint64_t fpos;
+
+	/**@brief   Delayed allocation buffer (NULL - none).*/
+	uint8_t *da_buf;
+
+	/**@brief   File offset of the first buffered byte.*/
+	uint64_t da_off;
+
+	/**@brief   Number of buffered bytes.*/
+	uint32_t da_len;
+
+	/**@brief   Next file with a delayed allocation buffer.*/
+	struct ext4_file *da_next;
 } ext4_file;
 
 /*****************************DIRECTORY DESCRIPTOR***************************/
@@ -144,6 +156,73 @@ int ext4_mount(const char *dev_name,
 	       const char *mount_point,
 	       bool read_only);
 
+/**@brief   Mount options (@ref ext4_mount_ex).*/
+struct ext4_mount_opts {
+	/**@brief   Block cache capacity in bytes. Buffers are allocated on
+	 *          demand, so this is an upper memory limit rather than an
+	 *          up-front allocation. 0 - CONFIG_BLOCK_DEV_CACHE_SIZE
+	 *          blocks.*/
+	uint64_t cache_size;
+
+	/**@brief   Block cache replacement policy: BC_POLICY_LRU,
+	 *          BC_POLICY_2Q (BC_POLICY_DEFAULT -
+	 *          CONFIG_BLOCK_DEV_CACHE_POLICY).*/
+	uint32_t cache_policy;
+
+	/**@brief   Reserve the whole cache capacity at mount time. The cache
+	 *          arena grows on demand otherwise.*/
+	bool cache_reserve;
+
+	/**@brief   Delayed allocation buffer per file in bytes (0 - disabled).
+	 *          Small appends are kept in memory and get blocks allocated
+	 *          as one contiguous run when the buffer fills up, on
+	 *          @ref ext4_fclose or on @ref ext4_cache_flush. Reads
+	 *          and opens of the file write out the delayed data of all
+	 *          its handles first.*/
+	uint32_t delalloc_size;
+
+	/**@brief   Discard freed blocks on the block device once the
+	 *          transaction releasing them is committed (needs
+	 *          ext4_blockdev_iface::discard). See also @ref ext4_fstrim.*/
+	bool discard;
+
+	/**@brief   Group commit. Operations join the running journal
+	 *          transaction, which is committed once it holds this many
+	 *          blocks, is older than commit_interval, or on
+	 *          @ref ext4_sync. The limit is capped to a quarter of the
+	 *          journal and of the block cache. 0 - every operation
+	 *          commits its own transaction.*/
+	uint32_t commit_blocks;
+
+	/**@brief   Group commit age limit in milliseconds (0 - none). It is
+	 *          checked when an operation ends, an idle transaction
+	 *          waits for the next operation or @ref ext4_sync.*/
+	uint32_t commit_interval;
+
+	/**@brief   Monotonic millisecond clock for commit_interval.*/
+	uint64_t (*clock)(void);
+
+	/**@brief   Checkpoint low-water mark in journal blocks (0 - none).
+	 *          When a commit leaves fewer free journal blocks, the
+	 *          oldest transactions are checkpointed until twice as
+	 *          many are free. See also @ref ext4_journal_checkpoint.*/
+	uint32_t checkpoint_low;
+};
+
+/**@brief   Mount a block device with EXT4 partition to the mount point,
+ *          using custom mount options.
+ *
+ * @param   dev_name Block device name (@ref ext4_device_register).
+ * @param   mount_point Mount point.
+ * @param   read_only mount as read-only mode.
+ * @param   opts mount options (NULL - defaults, same as @ref ext4_mount).
+ *
+ * @return Standard error code */
+int ext4_mount_ex(const char *dev_name,
+		  const char *mount_point,
+		  bool read_only,
+		  const struct ext4_mount_opts *opts);
+
 /**@brief   Umount operation.
  *
  * @param   mount_pount Mount point.
@@ -174,6 +253,21 @@ int ext4_journal_start(const char *mount_point);
  * @return  Standard error code. */
 int ext4_journal_stop(const char *mount_point);
 
+/**@brief   Checkpoint committed journal transactions: write their blocks
+ *          back in block number order and move the journal tail past
+ *          them. Meant to be polled from an idle loop or a housekeeping
+ *          thread, so that commits find free journal space instead of
+ *          checkpointing on their own. Does nothing when journaling is
+ *          not started.
+ *
+ * @param   mount_pount Mount point name.
+ * @param   free_blocks Journal blocks which should be free afterwards,
+ *          only the oldest transactions needed for that are written
+ *          back (0 - all committed transactions).
+ *
+ * @return  Standard error code. */
+int ext4_journal_checkpoint(const char *mount_point, uint32_t free_blocks);
+
 /**@brief   Journal recovery.
  * @warning Must be called after @ref ext4_mount.
  *
@@ -182,6 +276,20 @@ int ext4_journal_stop(const char *mount_point);
  * @return Standard error code. */
 int ext4_recover(const char *mount_point);
 
+/**@brief   Discard free blocks of a mounted filesystem (like fstrim).
+ *          The running transaction is committed first.
+ *
+ * @param   mount_pount Mount point.
+ * @param   start First byte of the range to trim.
+ * @param   len Range length in bytes (UINT64_MAX - up to the end).
+ * @param   minlen Free runs shorter than this (in bytes) are skipped.
+ * @param   trimmed Discarded bytes (may be NULL).
+ *
+ * @return  Standard error code, ENOTSUP if the block device can't
+ *          discard. */
+int ext4_fstrim(const char *mount_point, uint64_t start, uint64_t len,
+		uint64_t minlen, uint64_t *trimmed);
+
 /**@brief   Some of the filesystem stats. */
 struct ext4_mount_stats {
 	uint32_t inodes_count;
@@ -261,13 +369,63 @@ int ext4_get_sblock(const char *mount_point, struct ext4_sblock **sb);
 int ext4_cache_write_back(const char *path, bool on);
 
 
-/**@brief   Force cache flush.
+/**@brief   Force cache flush. The running group commit transaction is
+ *          committed first (@ref ext4_sync).
  *
  * @param   mount_pount Mount point.
  *
  * @return  Standard error code. */
 int ext4_cache_flush(const char *path);
 
+/**@brief   Write everything out: delayed allocation buffers, the running
+ *          group commit transaction (@ref ext4_mount_opts::commit_blocks)
+ *          and dirty cache blocks.
+ *
+ * @param   mount_pount Mount point.
+ *
+ * @return  Standard error code. */
+int ext4_sync(const char *path);
+
+/**@brief   Block cache stats. */
+struct ext4_cache_stats {
+	/**@brief   Cache capacity (bytes).*/
+	uint64_t capacity;
+
+	/**@brief   Memory currently held by cached blocks (bytes).*/
+	uint64_t used;
+
+	/**@brief   Block memory reserved by the cache arena (bytes).*/
+	uint64_t reserved;
+
+	/**@brief   Cached block size (bytes).*/
+	uint32_t block_size;
+
+	/**@brief   Block lookups served from cache.*/
+	uint64_t hits;
+
+	/**@brief   Block lookups which needed a new cache buffer.*/
+	uint64_t misses;
+};
+
+/**@brief   Get block cache stats.
+ *
+ * @param   mount_pount Mount point.
+ * @param   stats Block cache stats.
+ *
+ * @return  Standard error code. */
+int ext4_cache_stats(const char *path, struct ext4_cache_stats *stats);
+
+/**@brief   Change block cache capacity of a mounted filesystem. Shrinking
+ *          writes back and releases least recently used blocks until the
+ *          cache fits the new capacity (referenced blocks are kept).
+ *
+ * @param   mount_pount Mount point.
+ * @param   size New capacity in bytes (0 - CONFIG_BLOCK_DEV_CACHE_SIZE
+ *          blocks). Arena memory which is no longer used is released.
+ *
+ * @return  Standard error code. */
+int ext4_cache_resize(const char *path, uint64_t size);
+
 /********************************FILE OPERATIONS*****************************/
 
 /**@brief   Remove file by path.
@@ -338,6 +496,30 @@ int ext4_fclose(ext4_file *file);
  * @return  Standard error code.*/
 int ext4_ftruncate(ext4_file *file, uint64_t size);
 
+/**@brief   Do not change the file size (@ref ext4_fallocate).*/
+#define EXT4_FALLOC_FL_KEEP_SIZE 0x01
+/**@brief   Deallocate the range, requires KEEP_SIZE (@ref ext4_fallocate).*/
+#define EXT4_FALLOC_FL_PUNCH_HOLE 0x02
+/**@brief   Replace the range with zeroes (@ref ext4_fallocate).*/
+#define EXT4_FALLOC_FL_ZERO_RANGE 0x10
+
+/**@brief   Manipulate the space allocated for a file.
+ *
+ * With mode 0 blocks of the range which are not mapped yet are reserved
+ * as large unwritten extents: they read back as zeroes and are written
+ * later without being zero-filled first. The file size is extended
+ * to offset + len unless @ref EXT4_FALLOC_FL_KEEP_SIZE is set.
+ * Only extent based files are supported.
+ *
+ * @param   file   File handle.
+ * @param   offset Start of the range.
+ * @param   len    Length of the range.
+ * @param   mode   EXT4_FALLOC_FL_* flags.
+ *
+ * @return  Standard error code.*/
+int ext4_fallocate(ext4_file *file, uint64_t offset, uint64_t len,
+		   uint32_t mode);
+
 /**@brief   Read data from file.
  *
  * @param   file File handle.
@@ -78,6 +78,55 @@ void ext4_balloc_set_bitmap_csum(struct ext4_sblock *sb,
 				 struct ext4_bgroup *bg,
 				 void *bitmap);
 
+/**@brief   Drop the in-memory free space index of all block groups.
+ *          It is rebuilt from the bitmaps on demand.
+ * @param   fs filesystem*/
+void ext4_balloc_index_drop(struct ext4_fs *fs);
+
+/**@brief   Start collecting blocks freed by @ref ext4_balloc_free_block
+ *          and @ref ext4_balloc_free_blocks instead of releasing them one
+ *          by one. Batches nest, the outermost end releases the blocks.
+ * @param   fs filesystem*/
+void ext4_balloc_free_batch_begin(struct ext4_fs *fs);
+
+/**@brief   End a batch: release collected blocks group by group, with
+ *          one bitmap and descriptor update per group.
+ * @param   fs filesystem
+ * @return  standard error code*/
+int ext4_balloc_free_batch_end(struct ext4_fs *fs);
+
+/**@brief   Return blocks freed by the running transaction to the
+ *          bitmaps. Called right before it is committed, so the blocks
+ *          can't be reused by the transaction which released them.
+ * @param   fs filesystem
+ * @return  standard error code*/
+int ext4_balloc_pending_flush(struct ext4_fs *fs);
+
+/**@brief   Forget blocks freed by an aborted transaction.
+ * @param   fs filesystem*/
+void ext4_balloc_pending_drop(struct ext4_fs *fs);
+
+/**@brief   Issue discards for blocks freed since the last call. Called
+ *          once the transaction releasing them is committed. Discard is
+ *          advisory: device errors are not reported.
+ * @param   fs filesystem*/
+void ext4_balloc_discard_flush(struct ext4_fs *fs);
+
+/**@brief   Forget freed blocks queued for discard (aborted transaction).
+ * @param   fs filesystem*/
+void ext4_balloc_discard_drop(struct ext4_fs *fs);
+
+/**@brief   Discard free blocks of a block range (fstrim).
+ * @param   fs filesystem
+ * @param   start first block
+ * @param   cnt block count
+ * @param   minlen shorter free runs are skipped
+ * @param   trimmed number of discarded blocks
+ * @return  standard error code, ENOTSUP if the block device can't
+ *          discard*/
+int ext4_balloc_trim(struct ext4_fs *fs, ext4_fsblk_t start, uint64_t cnt,
+		     uint32_t minlen, uint64_t *trimmed);
+
 /**@brief   Free block from inode.
  * @param   inode_ref inode reference
  * @param   baddr block address
@@ -102,6 +151,16 @@ int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
 			    ext4_fsblk_t goal,
 			    ext4_fsblk_t *baddr);
 
+/**@brief   Allocate a run of contiguous blocks.
+ * @param   inode_ref inode reference
+ * @param   goal preferred first block
+ * @param   fblock first allocated block address
+ * @param   blk_cnt in: wanted blocks, out: allocated blocks (at least 1)
+ * @return  standard error code*/
+int ext4_balloc_alloc_blocks(struct ext4_inode_ref *inode_ref,
+			     ext4_fsblk_t goal,
+			     ext4_fsblk_t *fblock, uint32_t *blk_cnt);
+
 /**@brief   Try allocate selected block.
  * @param   inode_ref inode reference
  * @param   baddr block address to allocate
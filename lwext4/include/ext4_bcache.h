@@ -65,6 +65,19 @@ struct ext4_block {
 
 struct ext4_bcache;
 
+/**@brief   Arena slab: descriptors and data of up to
+ *          CONFIG_BLOCK_DEV_CACHE_SLAB buffers in one allocation*/
+struct ext4_bcache_slab {
+	/**@brief   Slab list node*/
+	SLIST_ENTRY(ext4_bcache_slab) node;
+
+	/**@brief   Buffers in this slab*/
+	uint32_t cnt;
+
+	/**@brief   Buffers of this slab in use*/
+	uint32_t used;
+};
+
 /**@brief   Single block descriptor*/
 struct ext4_buf {
 	/**@brief   Flags*/
@@ -76,26 +89,28 @@ struct ext4_buf {
 	/**@brief   Data buffer.*/
 	uint8_t *data;
 
-	/**@brief   LRU priority. (unused) */
+	/**@brief   LRU priority: 0 - probation queue (2Q policy),
+	 *          1 - main LRU queue.*/
 	uint32_t lru_prio;
 
-	/**@brief   LRU id.*/
-	uint32_t lru_id;
-
 	/**@brief   Reference count table*/
 	uint32_t refctr;
 
 	/**@brief   The block cache this buffer belongs to. */
 	struct ext4_bcache *bc;
 
+	/**@brief   The arena slab this buffer was carved from. */
+	struct ext4_bcache_slab *slab;
+
 	/**@brief   Whether or not buffer is on dirty list.*/
 	bool on_dirty_list;
 
-	/**@brief   LBA tree node*/
-	RB_ENTRY(ext4_buf) lba_node;
+	/**@brief   Operation which saved the buffer for rollback
+	 *          (see ext4_trans_undo).*/
+	uint32_t undo_seq;
 
-	/**@brief   LRU tree node*/
-	RB_ENTRY(ext4_buf) lru_node;
+	/**@brief   LRU list node*/
+	TAILQ_ENTRY(ext4_buf) lru_node;
 
 	/**@brief   Dirty list node*/
 	SLIST_ENTRY(ext4_buf) dirty_node;
@@ -123,9 +138,6 @@ struct ext4_bcache {
 	/**@brief   Item size in block cache*/
 	uint32_t itemsize;
 
-	/**@brief   Last recently used counter*/
-	uint32_t lru_ctr;
-
 	/**@brief   Currently referenced datablocks*/
 	uint32_t ref_blocks;
 
@@ -138,14 +150,43 @@ struct ext4_bcache {
 	/**@brief   The cache should not be shaked */
 	bool dont_shake;
 
-	/**@brief   A tree holding all bufs*/
-	RB_HEAD(ext4_buf_lba, ext4_buf) lba_root;
+	/**@brief   Lookups served from cache*/
+	uint64_t hit_ctr;
+
+	/**@brief   Lookups which allocated a new buffer*/
+	uint64_t miss_ctr;
+
+	/**@brief   Open addressing hash table holding all bufs (by LBA)*/
+	struct ext4_buf **lba_tab;
+
+	/**@brief   Hash table size (power of 2)*/
+	uint32_t lba_tab_size;
+
+	/**@brief   A list holding unreferenced bufs, least recently used
+	 *          first*/
+	TAILQ_HEAD(ext4_buf_lru, ext4_buf) lru_list;
 
-	/**@brief   A tree holding unreferenced bufs*/
-	RB_HEAD(ext4_buf_lru, ext4_buf) lru_root;
+	/**@brief   Replacement policy (BC_POLICY_LRU/BC_POLICY_2Q)*/
+	uint32_t policy;
+
+	/**@brief   2Q probation FIFO holding unreferenced bufs which were
+	 *          referenced only once*/
+	struct ext4_buf_lru a1_list;
+
+	/**@brief   Number of bufs in probation (referenced or not)*/
+	uint32_t a1_cnt;
 
 	/**@brief   A singly-linked list holding dirty buffers*/
 	SLIST_HEAD(ext4_buf_dirty, ext4_buf) dirty_list;
+
+	/**@brief   Arena slabs*/
+	SLIST_HEAD(ext4_bcache_slabs, ext4_bcache_slab) slabs;
+
+	/**@brief   Unused arena buffers (linked through dirty_node)*/
+	struct ext4_buf_dirty free_list;
+
+	/**@brief   Arena size (buffers)*/
+	uint32_t arena_cnt;
 };
 
 /**@brief buffer state bits
@@ -156,12 +197,18 @@ struct ext4_bcache {
  *              when no one references it.
  *  - BC_TMP: Buffer will be dropped once its refctr
  *            reaches zero.
+ *  - BC_WRITEBACK: Buffer is part of a batched flush. Cleared as soon
+ *                  as somebody references the buffer again.
+ *  - BC_META: Buffer holds filesystem metadata. The 2Q policy moves it
+ *             to the main queue when it is released.
  */
 enum bcache_state_bits {
 	BC_UPTODATE,
 	BC_DIRTY,
 	BC_FLUSH,
-	BC_TMP
+	BC_TMP,
+	BC_WRITEBACK,
+	BC_META
 };
 
 #define ext4_bcache_set_flag(buf, b)    \
@@ -220,6 +267,24 @@ ext4_bcache_remove_dirty_node(struct ext4_bcache *bc, struct ext4_buf *buf) {
 int ext4_bcache_init_dynamic(struct ext4_bcache *bc, uint32_t cnt,
 			     uint32_t itemsize);
 
+/**@brief   Select replacement policy of an empty block cache.
+ * @param   bc block cache descriptor
+ * @param   policy BC_POLICY_LRU, BC_POLICY_2Q
+ *          (BC_POLICY_DEFAULT - CONFIG_BLOCK_DEV_CACHE_POLICY)
+ * @return  standard error code*/
+int ext4_bcache_set_policy(struct ext4_bcache *bc, uint32_t policy);
+
+/**@brief   Grow block cache arena, so at least cnt buffers are
+ *          available without further allocation.
+ * @param   bc block cache descriptor
+ * @param   cnt buffer count
+ * @return  standard error code*/
+int ext4_bcache_reserve(struct ext4_bcache *bc, uint32_t cnt);
+
+/**@brief   Release arena slabs with no buffer in use.
+ * @param   bc block cache descriptor*/
+void ext4_bcache_trim(struct ext4_bcache *bc);
+
 /**@brief   Do cleanup works on block cache.
  * @param   bc block cache descriptor.*/
 void ext4_bcache_cleanup(struct ext4_bcache *bc);
@@ -229,9 +294,9 @@ void ext4_bcache_cleanup(struct ext4_bcache *bc);
  * @return  standard error code*/
 int ext4_bcache_fini_dynamic(struct ext4_bcache *bc);
 
-/**@brief   Get a buffer with the lowest LRU counter in bcache.
+/**@brief   Get the least recently used unreferenced buffer in bcache.
  * @param   bc block cache descriptor
- * @return  buffer with the lowest LRU counter*/
+ * @return  least recently used buffer (NULL if there is none)*/
 struct ext4_buf *ext4_buf_lowest_lru(struct ext4_bcache *bc);
 
 /**@brief   Drop unreferenced buffer from bcache.
@@ -84,6 +84,12 @@ static inline bool ext4_bmap_is_bit_clr(uint8_t *bmap, uint32_t bit)
  * @param   bcnt bit count*/
 void ext4_bmap_bits_free(uint8_t *bmap, uint32_t sbit, uint32_t bcnt);
 
+/**@brief   Set range of bits in bitmap.
+ * @param   bmap bitmap buffer
+ * @param   sbit start bit
+ * @param   bcnt bit count*/
+void ext4_bmap_bits_set(uint8_t *bmap, uint32_t sbit, uint32_t bcnt);
+
 /**@brief   Find first clear bit in bitmap.
  * @param   sbit start bit of search
  * @param   ebit end bit of search
@@ -92,6 +98,23 @@ void ext4_bmap_bits_free(uint8_t *bmap, uint32_t sbit, uint32_t bcnt);
 int ext4_bmap_bit_find_clr(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
 			   uint32_t *bit_id);
 
+/**@brief   Find first set bit in bitmap.
+ * @param   sbit start bit of search
+ * @param   ebit end bit of search
+ * @param   bit_id output parameter (first set bit)
+ * @return  standard error code*/
+int ext4_bmap_bit_find_set(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
+			   uint32_t *bit_id);
+
+/**@brief   Find first run of clear bits in bitmap.
+ * @param   sbit start bit of search
+ * @param   ebit end bit of search
+ * @param   len run length
+ * @param   bit_id output parameter (first bit of the run)
+ * @return  standard error code*/
+int ext4_bmap_find_clr_run(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
+			   uint32_t len, uint32_t *bit_id);
+
 #ifdef __cplusplus
 }
 #endif
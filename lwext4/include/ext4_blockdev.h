@@ -46,6 +46,42 @@ extern "C" {
 #include <stdbool.h>
 #include <stdint.h>
 
+/**@brief   Block device I/O vector.*/
+struct ext4_blockdev_iovec {
+	/**@brief   Data buffer*/
+	const void *buf;
+
+	/**@brief   Physical block count*/
+	uint32_t blk_cnt;
+};
+
+/**@brief   Asynchronous block request.*/
+struct ext4_blockdev_req {
+	/**@brief   Request direction: true - write, false - read*/
+	bool write;
+
+	/**@brief   Data buffer*/
+	void *buf;
+
+	/**@brief   Physical block id*/
+	uint64_t blk_id;
+
+	/**@brief   Physical block count*/
+	uint32_t blk_cnt;
+
+	/**@brief   Standard error code of finished request*/
+	int res;
+
+	/**@brief   Completion callback (may be NULL).
+	 * @param   bdev block device
+	 * @param   req finished request*/
+	void (*end_io)(struct ext4_blockdev *bdev,
+		       struct ext4_blockdev_req *req);
+
+	/**@brief   Argument for completion callback*/
+	void *arg;
+};
+
 struct ext4_blockdev_iface {
 	/**@brief   Open device function
 	 * @param   bdev block device.*/
@@ -87,7 +123,7 @@ struct ext4_blockdev_iface {
 	uint64_t ph_bcnt;
 
 	/**@brief   Block size buffer: physical*/
-	uint8_t ph_bbuf[512];
+	uint8_t ph_bbuf[CONFIG_BLOCK_DEV_MAX_PH_BSIZE];
 
 	/**@brief   Reference counter to block device interface*/
 	uint32_t ph_refctr;
@@ -109,6 +145,49 @@ struct ext4_blockdev_iface {
 
 	char fname[512];
 	void* dev_file;
+
+	/**@brief   Queue asynchronous block request. Completion is reported
+	 *          through req->end_io, called from submit or wait.
+	 *          Not mandatory field.
+	 * @param   bdev block device
+	 * @param   req block request*/
+	int (*submit)(struct ext4_blockdev *bdev,
+		      struct ext4_blockdev_req *req);
+
+	/**@brief   Submit all queued requests and wait for their completion.
+	 *          Not mandatory field (required when submit is set).
+	 * @param   bdev block device*/
+	int (*wait)(struct ext4_blockdev *bdev);
+
+	/**@brief   Vectored block write function. Writes buffers of iov
+	 *          to consecutive physical blocks starting at blk_id.
+	 *          Not mandatory field.
+	 * @param   bdev block device
+	 * @param   iov I/O vector
+	 * @param   iov_cnt I/O vector length
+	 * @param   blk_id first block id*/
+	int (*bwritev)(struct ext4_blockdev *bdev,
+		       const struct ext4_blockdev_iovec *iov,
+		       uint32_t iov_cnt, uint64_t blk_id);
+
+	/**@brief   Discard function. Tells the device that contents of
+	 *          the blocks are no longer needed (TRIM, hole punching).
+	 *          Not mandatory field.
+	 * @param   bdev block device
+	 * @param   blk_id first block id
+	 * @param   blk_cnt block count*/
+	int (*discard)(struct ext4_blockdev *bdev, uint64_t blk_id,
+		       uint64_t blk_cnt);
+
+	/**@brief   Check whether blocks are known to read as zeroes
+	 *          (holes of a sparse image file). Lets zero fills be
+	 *          skipped. Not mandatory field.
+	 * @param   bdev block device
+	 * @param   blk_id first block id
+	 * @param   blk_cnt block count
+	 * @return  true if every block of the range reads as zeroes*/
+	bool (*reads_zero)(struct ext4_blockdev *bdev, uint64_t blk_id,
+			   uint64_t blk_cnt);
 };
 
 /**@brief   Definition of the simple block device.*/
@@ -236,6 +315,45 @@ int ext4_blocks_get_direct(struct ext4_blockdev *bdev, void *buf, uint64_t lba,
 int ext4_blocks_set_direct(struct ext4_blockdev *bdev, const void *buf,
 			   uint64_t lba, uint32_t cnt);
 
+/**@brief   Queue block request (without cache). Falls back to synchronous
+ *          I/O when the block device has no asynchronous interface.
+ *          Request result is stored in req->res before req->end_io
+ *          is called.
+ * @param   bdev block device descriptor
+ * @param   req request descriptor (end_io and arg set by caller)
+ * @param   write request direction
+ * @param   buf data buffer
+ * @param   lba logical block address
+ * @param   cnt logical block count
+ * @return  standard error code*/
+int ext4_blocks_submit(struct ext4_blockdev *bdev,
+		       struct ext4_blockdev_req *req, bool write,
+		       void *buf, uint64_t lba, uint32_t cnt);
+
+/**@brief   Wait for all requests queued by @ref ext4_blocks_submit.
+ * @param   bdev block device descriptor
+ * @return  standard error code*/
+int ext4_blocks_wait(struct ext4_blockdev *bdev);
+
+/**@brief   Zero fill blocks (without cache). Large writes are queued
+ *          through @ref ext4_blocks_submit, cached copies of the blocks
+ *          are dropped. Nothing is written if the device reports the
+ *          range already reads as zeroes.
+ * @param   bdev block device descriptor
+ * @param   lba first logical block address
+ * @param   cnt logical block count
+ * @return  standard error code*/
+int ext4_blocks_zero(struct ext4_blockdev *bdev, uint64_t lba, uint32_t cnt);
+
+/**@brief   Discard blocks (without cache).
+ * @param   bdev block device descriptor
+ * @param   lba first logical block address
+ * @param   cnt logical block count
+ * @return  standard error code, ENOTSUP if the block device can't
+ *          discard*/
+int ext4_blocks_discard(struct ext4_blockdev *bdev, uint64_t lba,
+			uint64_t cnt);
+
 /**@brief   Write to block device (by direct address).
  * @param   bdev block device descriptor
  * @param   off byte offset in block device
@@ -259,6 +377,14 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
  * @return  standard error code*/
 int ext4_block_cache_flush(struct ext4_blockdev *bdev);
 
+/**@brief   Change block cache capacity. Least recently used unreferenced
+ *          buffers are written back and dropped until the cache fits,
+ *          then arena slabs left unused are released.
+ * @param   bdev block device descriptor
+ * @param   cnt new capacity (in blocks)
+ * @return  standard error code*/
+int ext4_block_cache_resize(struct ext4_blockdev *bdev, uint32_t cnt);
+
 /**@brief   Enable/disable write back cache mode
  * @param   bdev block device descriptor
  * @param   on_off
@@ -98,6 +98,29 @@ extern "C" {
 #define CONFIG_EXTENTS_ENABLE 1
 #endif
 
+/**@brief  Slots of the per-inode extent mapping cache (0 - disabled)*/
+#ifndef CONFIG_EXTENT_CACHE_SIZE
+#define CONFIG_EXTENT_CACHE_SIZE 32
+#endif
+
+/**@brief Orlov style i-node placement: spread top level directories
+ *        over block groups, keep other i-nodes near their parent*/
+#ifndef CONFIG_IALLOC_ORLOV
+#define CONFIG_IALLOC_ORLOV 1
+#endif
+
+/**@brief Maximum free runs kept in memory per block group by the block
+ *        allocator (0 - disabled). More fragmented groups are scanned.*/
+#ifndef CONFIG_BALLOC_INDEX_RUNS
+#define CONFIG_BALLOC_INDEX_RUNS 4096
+#endif
+
+/**@brief Maximum freed block ranges queued for discard in a single
+ *        transaction. Ranges over the limit are left for ext4_fstrim.*/
+#ifndef CONFIG_DISCARD_MAX_RANGES
+#define CONFIG_DISCARD_MAX_RANGES 8192
+#endif
+
 /**@brief   Include error codes from ext4_errno or standard library.*/
 #ifndef CONFIG_HAVE_OWN_ERRNO
 #define CONFIG_HAVE_OWN_ERRNO 0
@@ -128,6 +151,61 @@ extern "C" {
 #define CONFIG_BLOCK_DEV_CACHE_SIZE 8
 #endif
 
+#define BC_POLICY_DEFAULT 0
+#define BC_POLICY_LRU 1
+#define BC_POLICY_2Q 2
+
+/**@brief   Block cache replacement policy (BC_POLICY_LRU/BC_POLICY_2Q).*/
+#ifndef CONFIG_BLOCK_DEV_CACHE_POLICY
+#define CONFIG_BLOCK_DEV_CACHE_POLICY BC_POLICY_2Q
+#endif
+
+/**@brief   Number of cache blocks carved from a single arena slab.*/
+#ifndef CONFIG_BLOCK_DEV_CACHE_SLAB
+#define CONFIG_BLOCK_DEV_CACHE_SLAB 64
+#endif
+
+/**@brief   Alignment of cache block data (suitable for O_DIRECT).*/
+#ifndef CONFIG_BLOCK_DEV_CACHE_ALIGN
+#define CONFIG_BLOCK_DEV_CACHE_ALIGN 4096
+#endif
+
+/**@brief   Maximum physical block (sector) size of block device*/
+#ifndef CONFIG_BLOCK_DEV_MAX_PH_BSIZE
+#define CONFIG_BLOCK_DEV_MAX_PH_BSIZE 4096
+#endif
+
+/**@brief   Maximum number of adjacent cache blocks merged into a single
+ *          write during cache flush*/
+#ifndef CONFIG_BLOCK_DEV_WRITE_RUN
+#define CONFIG_BLOCK_DEV_WRITE_RUN 64
+#endif
+
+/**@brief   Staging buffer (in blocks) a batched cache flush copies runs
+ *          of adjacent dirty blocks into, so that each run is queued as
+ *          one request (at least CONFIG_BLOCK_DEV_WRITE_RUN)*/
+#ifndef CONFIG_BLOCK_DEV_FLUSH_STAGE
+#define CONFIG_BLOCK_DEV_FLUSH_STAGE 256
+#endif
+
+/**@brief   Blocks written by a single request when a block range is
+ *          zero filled (inode tables)*/
+#ifndef CONFIG_BLOCK_DEV_ZERO_RUN
+#define CONFIG_BLOCK_DEV_ZERO_RUN 256
+#endif
+
+/**@brief   Journal log blocks assembled in memory by a transaction
+ *          commit before they are written out together*/
+#ifndef CONFIG_JBD_LOG_STAGE
+#define CONFIG_JBD_LOG_STAGE 128
+#endif
+
+/**@brief   Journal blocks read by a single request during recovery,
+ *          also the longest run of replayed blocks written at once*/
+#ifndef CONFIG_JBD_LOG_READAHEAD
+#define CONFIG_JBD_LOG_READAHEAD 128
+#endif
+
 
 /**@brief   Maximum block device name*/
 #ifndef CONFIG_EXT4_MAX_BLOCKDEV_NAME
@@ -167,6 +245,18 @@ extern "C" {
 #define CONFIG_UNALIGNED_ACCESS 0
 #endif
 
+/**@brief Use SSE4.2 crc32 instruction for CRC32C when the CPU supports it
+ *        (x86-64 only, runtime detected)*/
+#ifndef CONFIG_CRC32C_SSE42
+#define CONFIG_CRC32C_SSE42 1
+#endif
+
+/**@brief Use AVX2 to skip uniform bitmap areas when the CPU supports it
+ *        (x86-64 only, runtime detected)*/
+#ifndef CONFIG_BITMAP_AVX2
+#define CONFIG_BITMAP_AVX2 1
+#endif
+
 /**@brief Switches use of malloc/free functions family
  *        from standard library to user provided*/
 #ifndef CONFIG_USE_USER_MALLOC
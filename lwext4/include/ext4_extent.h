@@ -51,10 +51,34 @@ extern "C" {
 
 void ext4_extent_tree_init(struct ext4_inode_ref *inode_ref);
 
+/**@brief Drop all cached extent mappings of the filesystem.
+ * @param fs Filesystem */
+void ext4_extent_cache_flush(struct ext4_fs *fs);
 
+/**@brief Allocate blocks for holes and initialize unwritten ranges.*/
+#define EXT4_GET_BLOCKS_CREATE 0x01
+/**@brief Allocate holes as unwritten extents, keep unwritten ranges as
+ *        they are (preallocation).*/
+#define EXT4_GET_BLOCKS_UNWRIT 0x02
+/**@brief Caller overwrites the whole run: initialize unwritten ranges
+ *        without zeroing them first.*/
+#define EXT4_GET_BLOCKS_NOZERO 0x04
+/**@brief Caller writes only a part of the run: zero the blocks allocated
+ *        for a hole.*/
+#define EXT4_GET_BLOCKS_ZERO 0x08
+
+/**@brief Map logical blocks of an i-node to a physical run.
+ * @param inode_ref    I-node
+ * @param iblock       First logical block
+ * @param max_blocks   Maximum run length
+ * @param result       Output first physical block, 0 for a hole or
+ *                     unwritten range (when nothing is created)
+ * @param flags        EXT4_GET_BLOCKS_* flags, 0 for a pure lookup
+ * @param blocks_count Output run length (also length of a hole)
+ * @return Error code */
 int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
-			   uint32_t max_blocks, ext4_fsblk_t *result, bool create,
-			   uint32_t *blocks_count);
+			   uint32_t max_blocks, ext4_fsblk_t *result,
+			   uint32_t flags, uint32_t *blocks_count);
 
 
 /**@brief Release all data blocks starting from specified logical block.
@@ -53,6 +53,120 @@ extern "C" {
 #include <stdint.h>
 #include <stdbool.h>
 
+/**@brief   Last extent resolved for an inode.*/
+struct ext4_extent_cache {
+	/**@brief   I-node number, 0 - empty slot.*/
+	uint32_t inode;
+
+	/**@brief   Extent unwritten flag.*/
+	bool unwritten;
+
+	/**@brief   First logical block of the extent.*/
+	ext4_lblk_t lblk;
+
+	/**@brief   Extent length in blocks.*/
+	uint32_t len;
+
+	/**@brief   First physical block of the extent.*/
+	ext4_fsblk_t pblk;
+};
+
+/**@brief Free run of a block group (group relative blocks).*/
+struct ext4_balloc_run {
+	uint32_t start;
+	uint32_t len;
+};
+
+/**@brief Range of blocks (absolute addresses).*/
+struct ext4_balloc_range {
+	ext4_fsblk_t start;
+	uint32_t len;
+};
+
+/**@brief Blocks whose release is postponed until the end of a batch.*/
+struct ext4_balloc_free_batch {
+	struct ext4_balloc_range *ranges;
+	uint32_t cnt;
+	uint32_t max;
+
+	/**@brief   Nesting level of open batches.*/
+	uint32_t depth;
+};
+
+/**@brief Freed blocks waiting for the transaction which released them to
+ *        commit, before they are discarded on the block device.*/
+struct ext4_balloc_discard {
+	struct ext4_balloc_range *ranges;
+	uint32_t cnt;
+	uint32_t max;
+
+	/**@brief   Discard freed blocks (mount option).*/
+	bool enabled;
+};
+
+/**@brief Blocks freed by the running transaction, returned to the bitmaps
+ *        when it is committed.*/
+struct ext4_balloc_pending {
+	struct ext4_balloc_range *ranges;
+	uint32_t cnt;
+	uint32_t max;
+
+	/**@brief   Blocks of all ranges.*/
+	uint64_t blocks;
+};
+
+/**@brief Content of a block before an operation changed it.*/
+struct ext4_trans_undo_rec {
+	uint64_t lba;
+
+	/**@brief   Saved copy, NULL if the block was clean: the disk has it.*/
+	uint8_t *data;
+};
+
+/**@brief Rollback point of an operation which joined a running (group
+ *        commit) transaction. If it fails, only its own changes are
+ *        taken back, the operations before it stay in the transaction.*/
+struct ext4_trans_undo {
+	struct ext4_trans_undo_rec *recs;
+	uint32_t cnt;
+	uint32_t max;
+
+	/**@brief   Tag of the operation in buffers it saved.*/
+	uint32_t seq;
+
+	/**@brief   An operation is being recorded.*/
+	bool active;
+
+	/**@brief   Superblock and pending frees when the operation started.*/
+	struct ext4_sblock sb;
+	uint32_t pending_cnt;
+	uint64_t pending_blocks;
+};
+
+/**@brief In-memory free space index of one block group.*/
+struct ext4_balloc_group_index {
+	/**@brief   Free runs sorted by start (valid when built).*/
+	struct ext4_balloc_run *runs;
+	uint32_t runs_cnt;
+	uint32_t runs_max;
+
+	/**@brief   Length of the largest free run (valid when built).*/
+	uint32_t largest;
+
+	/**@brief   Free blocks of the group (valid when known).*/
+	uint32_t free;
+
+	/**@brief   EXT4_BIDX_* state flags.*/
+	uint8_t flags;
+};
+
+/**@brief In-memory copy of the counters of one block group descriptor.*/
+struct ext4_bg_summary {
+	uint32_t free_inodes;
+	uint32_t free_blocks;
+	uint32_t used_dirs;
+};
+
 struct ext4_fs {
 	bool read_only;
 
@@ -67,6 +181,30 @@ struct ext4_fs {
 	struct jbd_fs *jbd_fs;
 	struct jbd_journal *jbd_journal;
 	struct jbd_trans *curr_trans;
+
+#if CONFIG_EXTENT_CACHE_SIZE
+	struct ext4_extent_cache ext_cache[CONFIG_EXTENT_CACHE_SIZE];
+#endif
+
+	/**@brief   Block allocator index, one entry per group (lazy).*/
+	struct ext4_balloc_group_index *bidx;
+	uint32_t bidx_cnt;
+
+	/**@brief   Blocks freed by a running truncate.*/
+	struct ext4_balloc_free_batch free_batch;
+
+	/**@brief   Blocks freed by the running transaction.*/
+	struct ext4_balloc_pending pending;
+
+	/**@brief   Rollback point of the running operation.*/
+	struct ext4_trans_undo undo;
+
+	/**@brief   Freed blocks to discard after commit.*/
+	struct ext4_balloc_discard discard;
+
+	/**@brief   Block group counters, one entry per group (lazy).*/
+	struct ext4_bg_summary *bg_sum;
+	uint32_t bg_sum_cnt;
 };
 
 struct ext4_block_group_ref {
@@ -164,6 +302,28 @@ int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
  */
 int ext4_fs_put_block_group_ref(struct ext4_block_group_ref *ref);
 
+/**@brief Compute checksum of block group descriptor.
+ * @param sb   Superblock
+ * @param bgid Index of block group in the filesystem
+ * @param bg   Block group to compute checksum for
+ * @return Checksum value
+ */
+uint16_t ext4_fs_bg_checksum(struct ext4_sblock *sb, uint32_t bgid,
+			     struct ext4_bgroup *bg);
+
+/**@brief Get counters of all block groups. They are read from the
+ *        descriptor table on first use and kept in sync by
+ *        @ref ext4_fs_put_block_group_ref afterwards.
+ * @param fs Filesystem
+ * @return Array of ext4_block_group_cnt entries, NULL on error
+ */
+struct ext4_bg_summary *ext4_fs_bg_summary(struct ext4_fs *fs);
+
+/**@brief Drop block group counters (descriptors changed behind our back).
+ * @param fs Filesystem
+ */
+void ext4_fs_bg_summary_drop(struct ext4_fs *fs);
+
 /**@brief Get reference to i-node specified by index.
  * @param fs    Filesystem to find i-node on
  * @param index Index of i-node to load
@@ -196,10 +356,11 @@ uint32_t ext4_fs_correspond_inode_mode(int filetype);
  * @param fs        Filesystem to allocated i-node on
  * @param inode_ref Output pointer to return reference to allocated i-node
  * @param filetype  File type of newly created i-node
+ * @param parent    Parent directory i-node (placement hint), 0 if none
  * @return Error code
  */
 int ext4_fs_alloc_inode(struct ext4_fs *fs, struct ext4_inode_ref *inode_ref,
-			int filetype);
+			int filetype, uint32_t parent);
 
 /**@brief Release i-node and mark it as free.
  * @param inode_ref I-node to be released
@@ -241,6 +402,19 @@ int ext4_fs_get_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 				 ext4_lblk_t iblock, ext4_fsblk_t *fblock,
 				 bool support_unwritten);
 
+/**@brief Get physical run backing consecutive logical blocks.
+ * @param inode_ref    I-node to read block addresses from
+ * @param iblock       First logical block
+ * @param max_blocks   Maximum length of the run
+ * @param fblock       Output first physical block, 0 if the run is a
+ *                     hole or unwritten range
+ * @param blocks_count Output length of the run (at least 1)
+ * @return Error code
+ */
+int ext4_fs_get_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+			       ext4_lblk_t iblock, uint32_t max_blocks,
+			       ext4_fsblk_t *fblock, uint32_t *blocks_count);
+
 /**@brief Initialize a part of unwritten range of the inode.
  * @param inode_ref I-node to proceed on.
  * @param iblock    Logical index of block
@@ -250,6 +424,20 @@ int ext4_fs_get_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 int ext4_fs_init_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 				  ext4_lblk_t iblock, ext4_fsblk_t *fblock);
 
+/**@brief Initialize a run of logical blocks of the inode for writing.
+ *        The caller overwrites the whole run, so preallocated (unwritten)
+ *        blocks are not zeroed first.
+ * @param inode_ref    I-node to proceed on.
+ * @param iblock       First logical block
+ * @param max_blocks   Maximum length of the run
+ * @param fblock       Output first physical block of the run
+ * @param blocks_count Output length of the run (at least 1)
+ * @return Error code
+ */
+int ext4_fs_init_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+				ext4_lblk_t iblock, uint32_t max_blocks,
+				ext4_fsblk_t *fblock, uint32_t *blocks_count);
+
 /**@brief Append following logical block to the i-node.
  * @param inode_ref I-node to append block to
  * @param fblock    Output physical block address of newly allocated block
@@ -259,6 +447,19 @@ int ext4_fs_init_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 int ext4_fs_append_inode_dblk(struct ext4_inode_ref *inode_ref,
 			      ext4_fsblk_t *fblock, ext4_lblk_t *iblock);
 
+/**@brief Append a run of contiguous blocks to the i-node. As with
+ *        @ref ext4_fs_init_inode_dblk_run the caller overwrites the run.
+ * @param inode_ref    I-node to append blocks to
+ * @param max_blocks   Maximum number of blocks to append
+ * @param fblock       Output physical address of the first new block
+ * @param iblock       Output logical number of the first new block
+ * @param blocks_count Output number of appended blocks (at least 1)
+ * @return Error code
+ */
+int ext4_fs_append_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+				  uint32_t max_blocks, ext4_fsblk_t *fblock,
+				  ext4_lblk_t *iblock, uint32_t *blocks_count);
+
 /**@brief   Increment inode link count.
  * @param   inode none handle
  */
@@ -65,14 +65,18 @@ void ext4_ialloc_set_bitmap_csum(struct ext4_sblock *sb, struct ext4_bgroup *bg,
 int ext4_ialloc_free_inode(struct ext4_fs *fs, uint32_t index, bool is_dir);
 
 /**@brief I-node allocation algorithm.
- * This is more simple algorithm, than Orlov allocator used
- * in the Linux kernel.
+ * With CONFIG_IALLOC_ORLOV, directories created in the root are spread
+ * over block groups and other i-nodes are kept near their parent, like
+ * the Orlov allocator of the Linux kernel (simplified). Without a parent
+ * the search continues from the group of the last allocation.
  * @param fs     Filesystem to allocate i-node on
  * @param index  Output value - allocated i-node number
  * @param is_dir Flag if allocated i-node will be file or directory
+ * @param parent Parent directory i-node, 0 if none
  * @return Error code
  */
-int ext4_ialloc_alloc_inode(struct ext4_fs *fs, uint32_t *index, bool is_dir);
+int ext4_ialloc_alloc_inode(struct ext4_fs *fs, uint32_t *index, bool is_dir,
+			    uint32_t parent);
 
 #ifdef __cplusplus
 }
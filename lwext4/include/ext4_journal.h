@@ -46,11 +46,23 @@ extern "C" {
 #include "misc/queue.h"
 #include "misc/tree.h"
 
+/**@brief  Journal blocks stored contiguously on disk.*/
+struct jbd_bmap_run {
+	ext4_lblk_t iblock;
+	uint32_t cnt;
+	ext4_fsblk_t fblock;
+};
+
 struct jbd_fs {
 	struct ext4_blockdev *bdev;
 	struct ext4_inode_ref inode_ref;
 	struct jbd_sb sb;
 
+	/* Journal inode layout, resolved at jbd_get_fs time.*/
+	struct jbd_bmap_run *bmap;
+	uint32_t bmap_cnt;
+	uint32_t bmap_hint;
+
 	bool dirty;
 };
 
@@ -86,6 +98,9 @@ struct jbd_trans {
 	int written_cnt;
 	int error;
 
+	/* Selected by a running checkpoint. */
+	bool checkpoint;
+
 	struct jbd_journal *journal;
 
 	TAILQ_HEAD(jbd_trans_buf, jbd_buf) buf_queue;
@@ -106,6 +121,13 @@ struct jbd_journal {
 	TAILQ_HEAD(jbd_cp_queue, jbd_trans) cp_queue;
 	RB_HEAD(jbd_block, jbd_block_rec) block_rec_root;
 
+	/* Log blocks of the transaction being committed. */
+	void *stage_mem;
+	uint8_t *stage;
+	uint32_t *stage_iblock;
+	uint32_t stage_max;
+	uint32_t stage_cnt;
+
 	struct jbd_fs *jbd_fs;
 };
 
@@ -132,6 +154,9 @@ void jbd_journal_free_trans(struct jbd_journal *journal,
 			    bool abort);
 int jbd_journal_commit_trans(struct jbd_journal *journal,
 			     struct jbd_trans *trans);
+uint32_t jbd_journal_free_blocks(struct jbd_journal *journal);
+int jbd_journal_checkpoint(struct jbd_journal *journal,
+			   uint32_t free_blocks);
 void
 jbd_journal_purge_cp_trans(struct jbd_journal *journal,
 			   bool flush,
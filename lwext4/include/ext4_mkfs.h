@@ -66,6 +66,10 @@ struct ext4_mkfs_info {
 	uint8_t uuid[UUID_SIZE];
 	bool journal;
 	const char *label;
+
+	/**@brief Leave block groups uninitialized (uninit_bg): bitmaps and
+	 *        inode tables are set up on first use instead of by mkfs.*/
+	bool lazy_itable_init;
 };
 
 
@@ -44,6 +44,7 @@ extern "C" {
 #include "ext4_config.h"
 #include "ext4_types.h"
 
+struct ext4_fs;
 
 /**@brief   Mark a buffer dirty and add it to the current transaction.
  * @param   buf buffer
@@ -72,6 +73,21 @@ int ext4_trans_block_get(struct ext4_blockdev *bdev,
 		   struct ext4_block *b,
 		   uint64_t lba);
 
+/**@brief   Start recording a rollback point: an operation joins the
+ *          running transaction. Blocks it gets through
+ *          @ref ext4_trans_block_get are saved first.
+ * @param   fs filesystem*/
+void ext4_trans_undo_begin(struct ext4_fs *fs);
+
+/**@brief   Operation done: forget its rollback point.
+ * @param   fs filesystem*/
+void ext4_trans_undo_end(struct ext4_fs *fs);
+
+/**@brief   Operation failed: take back its changes of the cached blocks,
+ *          the superblock and the blocks it freed.
+ * @param   fs filesystem*/
+void ext4_trans_undo_rollback(struct ext4_fs *fs);
+
 /**@brief  Try to add block to be revoked to the current transaction.
  * @param  bdev block device descriptor
  * @param  lba logical block address
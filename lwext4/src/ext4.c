@@ -52,6 +52,8 @@
 #include "ext4_dir_idx.h"
 #include "ext4_xattr.h"
 #include "ext4_journal.h"
+#include "ext4_extent.h"
+#include "ext4_balloc.h"
 
 
 #include <stdlib.h>
@@ -94,6 +96,30 @@ struct ext4_mountpoint {
 
 	/**@brief   Block cache.*/
 	struct ext4_bcache bc;
+
+	/**@brief   Per-file delayed allocation buffer size (0 - disabled).*/
+	uint32_t delalloc_size;
+
+	/**@brief   Files owning a delayed allocation buffer.*/
+	ext4_file *delalloc_files;
+
+	/**@brief   Group commit block limit (0 - commit every operation).*/
+	uint32_t commit_blocks;
+
+	/**@brief   Group commit age limit (ms, 0 - none).*/
+	uint32_t commit_interval;
+
+	/**@brief   Clock for commit_interval.*/
+	uint64_t (*clock)(void);
+
+	/**@brief   Checkpoint low-water mark (journal blocks, 0 - none).*/
+	uint32_t checkpoint_low;
+
+	/**@brief   Operations finished in the running transaction.*/
+	uint32_t trans_ops;
+
+	/**@brief   Start time of the running transaction.*/
+	uint64_t trans_time;
 };
 
 /**@brief   Block devices descriptor.*/
@@ -112,6 +138,14 @@ static struct ext4_block_devices s_bdevices[CONFIG_EXT4_BLOCKDEVS_COUNT];
 /**@brief   Mountpoints.*/
 static struct ext4_mountpoint s_mp[CONFIG_EXT4_MOUNTPOINTS_COUNT];
 
+static int ext4_delalloc_flush(ext4_file *file);
+static int ext4_delalloc_flush_all(struct ext4_mountpoint *mp);
+static int ext4_delalloc_flush_inode(struct ext4_mountpoint *mp,
+				     uint32_t inode);
+static int ext4_delalloc_open(ext4_file *file);
+static void ext4_delalloc_release(ext4_file *file);
+static int ext4_trans_commit(struct ext4_mountpoint *mp);
+
 int ext4_device_register(struct ext4_blockdev *bd,
 			 const char *dev_name)
 {
@@ -359,11 +393,32 @@ static int ext4_unlink(struct ext4_mountpoint *mp,
 
 /****************************************************************************/
 
+/**@brief   Block cache item count for a capacity given in bytes.*/
+static uint32_t ext4_cache_blocks(uint64_t size, uint32_t bsize)
+{
+	uint64_t cnt = size / bsize;
+
+	if (cnt < CONFIG_BLOCK_DEV_CACHE_SIZE)
+		return CONFIG_BLOCK_DEV_CACHE_SIZE;
+
+	if (cnt > UINT32_MAX)
+		return UINT32_MAX;
+
+	return (uint32_t)cnt;
+}
+
 int ext4_mount(const char *dev_name, const char *mount_point,
 	       bool read_only)
+{
+	return ext4_mount_ex(dev_name, mount_point, read_only, NULL);
+}
+
+int ext4_mount_ex(const char *dev_name, const char *mount_point,
+		  bool read_only, const struct ext4_mount_opts *opts)
 {
 	int r;
 	uint32_t bsize;
+	uint64_t cache_size = opts ? opts->cache_size : 0;
 	struct ext4_bcache *bc;
 	struct ext4_blockdev *bd = 0;
 	struct ext4_mountpoint *mp = 0;
@@ -417,8 +472,21 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 	ext4_block_set_lb_size(bd, bsize);
 	bc = &mp->bc;
 
-	r = ext4_bcache_init_dynamic(bc, CONFIG_BLOCK_DEV_CACHE_SIZE, bsize);
+	r = ext4_bcache_init_dynamic(bc, ext4_cache_blocks(cache_size, bsize),
+				     bsize);
+	if (r != EOK) {
+		ext4_block_fini(bd);
+		return r;
+	}
+
+	if (opts && opts->cache_policy != BC_POLICY_DEFAULT)
+		r = ext4_bcache_set_policy(bc, opts->cache_policy);
+
+	if (r == EOK && opts && opts->cache_reserve)
+		r = ext4_bcache_reserve(bc, bc->cnt);
+
 	if (r != EOK) {
+		ext4_bcache_fini_dynamic(bc);
 		ext4_block_fini(bd);
 		return r;
 	}
@@ -435,6 +503,15 @@ int ext4_mount(const char *dev_name, const char *mount_point,
 		return r;
 	}
 
+	mp->delalloc_size = opts ? opts->delalloc_size : 0;
+	mp->fs.discard.enabled = opts && opts->discard && !read_only;
+	mp->delalloc_files = NULL;
+	mp->commit_blocks = opts ? opts->commit_blocks : 0;
+	mp->commit_interval = opts ? opts->commit_interval : 0;
+	mp->clock = opts ? opts->clock : NULL;
+	mp->checkpoint_low = opts ? opts->checkpoint_low : 0;
+	mp->trans_ops = 0;
+
 	bd->fs = &mp->fs;
 	return r;
 }
@@ -456,6 +533,14 @@ int ext4_umount(const char *mount_point)
 	if (!mp)
 		return ENODEV;
 
+	/*Files left open still own delayed data*/
+	ext4_delalloc_flush_all(mp);
+	while (mp->delalloc_files)
+		ext4_delalloc_release(mp->delalloc_files);
+
+	/*Group commit transaction left running*/
+	ext4_trans_commit(mp);
+
 	r = ext4_fs_fini(&mp->fs);
 	if (r != EOK)
 		goto Finish;
@@ -530,7 +615,9 @@ static int __ext4_journal_stop(const char *mount_point)
 
 	if (ext4_sb_feature_com(&mp->fs.sb,
 				EXT4_FCOM_HAS_JOURNAL)) {
-		r = jbd_journal_stop(&mp->jbd_journal);
+		r = ext4_trans_commit(mp);
+		if (r == EOK)
+			r = jbd_journal_stop(&mp->jbd_journal);
 		if (r != EOK) {
 			mp->jbd_fs.dirty = false;
 			jbd_put_fs(&mp->jbd_fs);
@@ -579,6 +666,11 @@ static int __ext4_recover(const char *mount_point)
 		r = jbd_recover(jbd_fs);
 		jbd_put_fs(jbd_fs);
 		ext4_free(jbd_fs);
+
+		/*Replayed blocks may have changed extent trees and bitmaps*/
+		ext4_extent_cache_flush(&mp->fs);
+		ext4_balloc_index_drop(&mp->fs);
+		ext4_fs_bg_summary_drop(&mp->fs);
 	}
 	if (r == EOK && !mp->fs.read_only) {
 		uint32_t bgid;
@@ -652,6 +744,9 @@ static void __ext4_trans_abort(struct ext4_mountpoint *mp)
 		struct jbd_trans *trans = mp->fs.curr_trans;
 		jbd_journal_free_trans(journal, trans, true);
 		mp->fs.curr_trans = NULL;
+		ext4_extent_cache_flush(&mp->fs);
+		ext4_balloc_index_drop(&mp->fs);
+		ext4_fs_bg_summary_drop(&mp->fs);
 	}
 }
 
@@ -673,6 +768,24 @@ int ext4_journal_stop(const char *mount_point __unused)
 	return r;
 }
 
+int ext4_journal_checkpoint(const char *mount_point __unused,
+			    uint32_t free_blocks __unused)
+{
+	int r = EOK;
+#if CONFIG_JOURNALING_ENABLE
+	struct ext4_mountpoint *mp = ext4_get_mount(mount_point);
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	if (mp->fs.jbd_journal)
+		r = jbd_journal_checkpoint(mp->fs.jbd_journal, free_blocks);
+	EXT4_MP_UNLOCK(mp);
+#endif
+	return r;
+}
+
 int ext4_recover(const char *mount_point __unused)
 {
 	int r = EOK;
@@ -686,28 +799,168 @@ static int ext4_trans_start(struct ext4_mountpoint *mp __unused)
 {
 	int r = EOK;
 #if CONFIG_JOURNALING_ENABLE
+	bool running = mp->fs.curr_trans != NULL;
+
 	r = __ext4_trans_start(mp);
+	if (r == EOK && !running && mp->fs.curr_trans && mp->clock)
+		mp->trans_time = mp->clock();
+
+	/*Group commit: a failure must not take back earlier operations*/
+	if (r == EOK && running)
+		ext4_trans_undo_begin(&mp->fs);
 #endif
 	return r;
 }
 
-static int ext4_trans_stop(struct ext4_mountpoint *mp __unused)
+/**@brief   Group commit: check if the running transaction is big or old
+ *          enough to be committed.*/
+static bool ext4_trans_due(struct ext4_mountpoint *mp __unused)
 {
-	int r = EOK;
 #if CONFIG_JOURNALING_ENABLE
-	r = __ext4_trans_stop(mp);
+	struct jbd_trans *trans = mp->fs.curr_trans;
+	uint32_t max = mp->commit_blocks;
+	uint32_t jlen;
+
+	if (!max || !trans)
+		return true;
+
+	/*Blocks freed by the transaction can't be allocated before it is
+	 * committed: they must not hold back much of the free space*/
+	if (mp->fs.pending.blocks > ext4_sb_get_free_blocks_cnt(&mp->fs.sb))
+		return true;
+
+	/*Blocks of the transaction stay pinned in the cache and have to
+	 * fit in the journal at once*/
+	jlen = jbd_get32(&mp->jbd_fs.sb, maxlen) - mp->jbd_journal.first;
+	if (max > jlen / 4)
+		max = jlen / 4;
+	if (max > mp->bc.cnt / 4)
+		max = mp->bc.cnt / 4;
+
+	if ((uint32_t)trans->data_cnt >= max)
+		return true;
+
+	if (mp->commit_interval && mp->clock &&
+	    mp->clock() - mp->trans_time >= mp->commit_interval)
+		return true;
+
+	return false;
+#else
+	return true;
+#endif
+}
+
+/**@brief   Commit the running transaction now.*/
+static int ext4_trans_commit(struct ext4_mountpoint *mp __unused)
+{
+	int r;
+
+	ext4_trans_undo_end(&mp->fs);
+
+	/*Freed blocks are released with the transaction which freed them*/
+	r = ext4_balloc_pending_flush(&mp->fs);
+#if CONFIG_JOURNALING_ENABLE
+	if (r == EOK)
+		r = __ext4_trans_stop(mp);
+	else
+		__ext4_trans_abort(mp);
+#endif
+	mp->trans_ops = 0;
+
+	/*Freed blocks may be discarded once their release is committed*/
+	if (r == EOK)
+		ext4_balloc_discard_flush(&mp->fs);
+	else
+		ext4_balloc_discard_drop(&mp->fs);
+
+#if CONFIG_JOURNALING_ENABLE
+	/*Make room in the journal before commits run out of it*/
+	if (r == EOK && mp->fs.jbd_journal && mp->checkpoint_low &&
+	    jbd_journal_free_blocks(mp->fs.jbd_journal) < mp->checkpoint_low)
+		r = jbd_journal_checkpoint(mp->fs.jbd_journal,
+					   2 * mp->checkpoint_low);
 #endif
 	return r;
 }
 
+static int ext4_trans_stop(struct ext4_mountpoint *mp __unused)
+{
+	ext4_trans_undo_end(&mp->fs);
+
+	/*Group commit: later operations join the transaction*/
+	if (!ext4_trans_due(mp)) {
+		mp->trans_ops++;
+		return EOK;
+	}
+
+	return ext4_trans_commit(mp);
+}
+
 static void ext4_trans_abort(struct ext4_mountpoint *mp __unused)
 {
+	/*Only this operation is taken back, the transaction keeps running
+	 * with the ones which joined it before*/
+	if (mp->fs.undo.active) {
+		ext4_trans_undo_rollback(&mp->fs);
+		ext4_extent_cache_flush(&mp->fs);
+		ext4_balloc_index_drop(&mp->fs);
+		ext4_fs_bg_summary_drop(&mp->fs);
+		return;
+	}
+
 #if CONFIG_JOURNALING_ENABLE
 	__ext4_trans_abort(mp);
 #endif
+	ext4_balloc_pending_drop(&mp->fs);
+	ext4_balloc_discard_drop(&mp->fs);
 }
 
 
+int ext4_fstrim(const char *mount_point, uint64_t start, uint64_t len,
+		uint64_t minlen, uint64_t *trimmed)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(mount_point);
+	uint64_t blocks = 0;
+	uint64_t minblk;
+	uint32_t bsize;
+	int r;
+
+	if (!mp)
+		return ENOENT;
+
+	if (mp->fs.read_only)
+		return EROFS;
+
+	bsize = ext4_sb_get_block_size(&mp->fs.sb);
+	minblk = minlen / bsize + !!(minlen % bsize);
+	if (minblk > UINT32_MAX)
+		minblk = UINT32_MAX;
+
+	EXT4_MP_LOCK(mp);
+	/*Blocks freed by the running transaction stay set in the bitmaps
+	 * until it commits: they are not discarded before their release
+	 * is on disk*/
+	r = ext4_trans_commit(mp);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(mp);
+		return r;
+	}
+
+	ext4_trans_start(mp);
+	r = ext4_balloc_trim(&mp->fs, start / bsize, len / bsize,
+			     (uint32_t)minblk, &blocks);
+	if (r != EOK)
+		ext4_trans_abort(mp);
+	else
+		r = ext4_trans_stop(mp);
+	EXT4_MP_UNLOCK(mp);
+
+	if (trimmed)
+		*trimmed = blocks * bsize;
+
+	return r;
+}
+
 int ext4_mount_point_stats(const char *mount_point,
 			   struct ext4_mount_stats *stats)
 {
@@ -828,6 +1081,22 @@ static int ext4_trunc_inode(struct ext4_mountpoint *mp,
 		return r;
 
 	inode_size = ext4_inode_get_size(&fs->sb, inode_ref.inode);
+
+	/*A truncation which fits in one transaction stays a part of the
+	 * running operation: its abort takes the truncation back too*/
+	if (has_trans && inode_size <= new_size + CONFIG_MAX_TRUNCATE_SIZE) {
+		if (inode_size < new_size) {
+			ext4_fs_put_inode_ref(&inode_ref);
+			return EOK;
+		}
+		r = ext4_fs_truncate_inode(&inode_ref, new_size);
+		if (r != EOK) {
+			ext4_fs_put_inode_ref(&inode_ref);
+			return r;
+		}
+		return ext4_fs_put_inode_ref(&inode_ref);
+	}
+
 	ext4_fs_put_inode_ref(&inode_ref);
 	if (has_trans)
 		ext4_trans_stop(mp);
@@ -855,7 +1124,8 @@ static int ext4_trunc_inode(struct ext4_mountpoint *mp,
 			ext4_trans_stop(mp);
 	}
 
-	if (inode_size > new_size) {
+	/*Equal sizes still release blocks preallocated past the end*/
+	if (inode_size >= new_size) {
 
 		inode_size = new_size;
 
@@ -938,6 +1208,9 @@ static int ext4_generic_open2(ext4_file *f, const char *path, int flags,
 	struct ext4_inode_ref ref;
 
 	f->mp = 0;
+	f->da_buf = NULL;
+	f->da_len = 0;
+	f->da_next = NULL;
 
 	if (!mp)
 		return ENOENT;
@@ -992,7 +1265,8 @@ static int ext4_generic_open2(ext4_file *f, const char *path, int flags,
 			/*O_CREAT allows create new entry*/
 			struct ext4_inode_ref child_ref;
 			r = ext4_fs_alloc_inode(fs, &child_ref,
-					is_goal ? ftype : EXT4_DE_DIR);
+					is_goal ? ftype : EXT4_DE_DIR,
+					ref.index);
 
 			if (r != EOK)
 				break;
@@ -1422,6 +1696,11 @@ int ext4_cache_write_back(const char *path, bool on)
 }
 
 int ext4_cache_flush(const char *path)
+{
+	return ext4_sync(path);
+}
+
+int ext4_sync(const char *path)
 {
 	struct ext4_mountpoint *mp = ext4_get_mount(path);
 	int ret;
@@ -1430,7 +1709,53 @@ int ext4_cache_flush(const char *path)
 		return ENOENT;
 
 	EXT4_MP_LOCK(mp);
-	ret = ext4_block_cache_flush(mp->fs.bdev);
+	ret = ext4_delalloc_flush_all(mp);
+	if (ret == EOK)
+		ret = ext4_trans_commit(mp);
+	if (ret == EOK)
+		ret = ext4_block_cache_flush(mp->fs.bdev);
+	EXT4_MP_UNLOCK(mp);
+	return ret;
+}
+
+int ext4_cache_stats(const char *path, struct ext4_cache_stats *stats)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	struct ext4_bcache *bc;
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	bc = mp->fs.bdev->bc;
+	stats->capacity = (uint64_t)bc->cnt * bc->itemsize;
+	stats->used = (uint64_t)bc->ref_blocks * bc->itemsize;
+	stats->reserved = (uint64_t)bc->arena_cnt * bc->itemsize;
+	stats->block_size = bc->itemsize;
+	stats->hits = bc->hit_ctr;
+	stats->misses = bc->miss_ctr;
+	EXT4_MP_UNLOCK(mp);
+	return EOK;
+}
+
+int ext4_cache_resize(const char *path, uint64_t size)
+{
+	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	struct ext4_bcache *bc;
+	int ret;
+
+	if (!mp)
+		return ENOENT;
+
+	EXT4_MP_LOCK(mp);
+	bc = mp->fs.bdev->bc;
+
+	/*Blocks of a running transaction are pinned in the cache*/
+	ret = ext4_trans_commit(mp);
+	if (ret == EOK)
+		ret = ext4_block_cache_resize(mp->fs.bdev,
+					      ext4_cache_blocks(size,
+								bc->itemsize));
 	EXT4_MP_UNLOCK(mp);
 	return ret;
 }
@@ -1455,6 +1780,14 @@ int ext4_fremove(const char *path)
 		return EROFS;
 
 	EXT4_MP_LOCK(mp);
+
+	/*Do not let delayed data reach a released inode later*/
+	r = ext4_delalloc_flush_all(mp);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(mp);
+		return r;
+	}
+
 	r = ext4_generic_open2(&f, path, O_RDONLY, EXT4_DE_UNKNOWN,
 			       &parent_inode, &name_off);
 	if (r != EOK) {
@@ -1541,15 +1874,30 @@ Finish:
 int ext4_fopen(ext4_file *file, const char *path, const char *flags)
 {
 	struct ext4_mountpoint *mp = ext4_get_mount(path);
+	uint32_t iflags;
 	int r;
 
 	if (!mp)
 		return ENOENT;
 
+	if (ext4_parse_flags(flags, &iflags) == false)
+		return EINVAL;
+
 	EXT4_MP_LOCK(mp);
 
+	/*Delayed data of other handles must not land past the truncation*/
+	if (iflags & O_TRUNC) {
+		r = ext4_delalloc_flush_all(mp);
+		if (r != EOK) {
+			EXT4_MP_UNLOCK(mp);
+			return r;
+		}
+	}
+
 	ext4_block_cache_write_back(mp->fs.bdev, 1);
 	r = ext4_generic_open(file, path, flags, true, 0, 0);
+	if (r == EOK)
+		r = ext4_delalloc_open(file);
 	ext4_block_cache_write_back(mp->fs.bdev, 0);
 
 	EXT4_MP_UNLOCK(mp);
@@ -1568,6 +1916,16 @@ int ext4_fopen2(ext4_file *file, const char *path, int flags)
         filetype = EXT4_DE_REG_FILE;
 
 	EXT4_MP_LOCK(mp);
+
+	/*Delayed data of other handles must not land past the truncation*/
+	if (flags & O_TRUNC) {
+		r = ext4_delalloc_flush_all(mp);
+		if (r != EOK) {
+			EXT4_MP_UNLOCK(mp);
+			return r;
+		}
+	}
+
 	ext4_block_cache_write_back(mp->fs.bdev, 1);
 
 	if (flags & O_CREAT)
@@ -1582,6 +1940,9 @@ int ext4_fopen2(ext4_file *file, const char *path, int flags)
 			ext4_trans_abort(mp);
 	}
 
+	if (r == EOK)
+		r = ext4_delalloc_open(file);
+
 	ext4_block_cache_write_back(mp->fs.bdev, 0);
 	EXT4_MP_UNLOCK(mp);
 
@@ -1590,14 +1951,23 @@ int ext4_fopen2(ext4_file *file, const char *path, int flags)
 
 int ext4_fclose(ext4_file *file)
 {
+	int r = EOK;
+
 	ext4_assert(file && file->mp);
 
+	if (file->da_buf) {
+		EXT4_MP_LOCK(file->mp);
+		r = ext4_delalloc_flush(file);
+		ext4_delalloc_release(file);
+		EXT4_MP_UNLOCK(file->mp);
+	}
+
 	file->mp = 0;
 	file->flags = 0;
 	file->inode = 0;
 	file->fpos = file->fsize = 0;
 
-	return EOK;
+	return r;
 }
 
 static int ext4_ftruncate_no_lock(ext4_file *file, uint64_t size)
@@ -1614,7 +1984,7 @@ static int ext4_ftruncate_no_lock(ext4_file *file, uint64_t size)
 
 	/*Sync file size*/
 	file->fsize = ext4_inode_get_size(&file->mp->fs.sb, ref.inode);
-	if (file->fsize <= size) {
+	if (file->fsize < size) {
 		r = EOK;
 		goto Finish;
 	}
@@ -1657,6 +2027,13 @@ int ext4_ftruncate(ext4_file *f, uint64_t size)
 
 	EXT4_MP_LOCK(f->mp);
 
+	/*Delayed data of any handle may lie past the new size*/
+	r = ext4_delalloc_flush_all(f->mp);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(f->mp);
+		return r;
+	}
+
 	ext4_trans_start(f->mp);
 	r = ext4_ftruncate_no_lock(f, size);
 	if (r != EOK)
@@ -1668,157 +2045,350 @@ int ext4_ftruncate(ext4_file *f, uint64_t size)
 	return r;
 }
 
-int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
+#if CONFIG_EXTENT_ENABLE
+static int ext4_fzero_partial(struct ext4_inode_ref *ref, uint64_t off,
+			      uint32_t len)
 {
-	uint32_t unalg;
-	uint32_t iblock_idx;
-	uint32_t iblock_last;
-	uint32_t block_size;
-
-	ext4_fsblk_t fblock;
-	ext4_fsblk_t fblock_start;
-	uint32_t fblock_count;
-
-	uint8_t *u8_buf = buf;
+	struct ext4_fs *fs = ref->fs;
+	uint32_t block_size = ext4_sb_get_block_size(&fs->sb);
+	ext4_fsblk_t fblk;
+	uint8_t *zero;
 	int r;
-	struct ext4_inode_ref ref;
 
-	ext4_assert(file && file->mp);
+	r = ext4_fs_get_inode_dblk_idx(ref, (ext4_lblk_t)(off / block_size),
+				       &fblk, true);
+	if (r != EOK || !fblk)
+		return r;
 
-	if (file->flags & O_WRONLY)
-		return EPERM;
+	/*Block is mapped and initialized: clear bytes in place*/
+	zero = ext4_calloc(1, len);
+	if (!zero)
+		return ENOMEM;
 
-	if (!size)
-		return EOK;
+	r = ext4_block_writebytes(fs->bdev,
+				  fblk * block_size + off % block_size,
+				  zero, len);
+	ext4_free(zero);
+	return r;
+}
 
-	EXT4_MP_LOCK(file->mp);
+static int ext4_fpunch_no_lock(ext4_file *file, uint64_t offset,
+			       uint64_t end)
+{
+	struct ext4_inode_ref ref;
+	uint32_t block_size;
+	ext4_lblk_t from, to;
+	uint64_t head_end;
+	int r;
 
-	struct ext4_fs *const fs = &file->mp->fs;
-	struct ext4_sblock *const sb = &file->mp->fs.sb;
+	r = ext4_fs_get_inode_ref(&file->mp->fs, file->inode, &ref);
+	if (r != EOK)
+		return r;
 
-	if (rcnt)
-		*rcnt = 0;
+	block_size = ext4_sb_get_block_size(&file->mp->fs.sb);
 
-	r = ext4_fs_get_inode_ref(fs, file->inode, &ref);
-	if (r != EOK) {
-		EXT4_MP_UNLOCK(file->mp);
-		return r;
+	/*Whole blocks are released, partial ones are zeroed*/
+	from = (ext4_lblk_t)((offset + block_size - 1) / block_size);
+	to = (ext4_lblk_t)(end / block_size);
+	if (from < to) {
+		r = ext4_extent_remove_space(&ref, from, to - 1);
+		if (r != EOK)
+			goto Finish;
 	}
 
-	/*Sync file size*/
-	file->fsize = ext4_inode_get_size(sb, ref.inode);
+	head_end = (uint64_t)from * block_size;
+	if (head_end > end)
+		head_end = end;
 
-	block_size = ext4_sb_get_block_size(sb);
-	size = ((uint64_t)size > (file->fsize - file->fpos))
-		? ((size_t)(file->fsize - file->fpos)) : size;
+	if (offset < head_end) {
+		r = ext4_fzero_partial(&ref, offset,
+				       (uint32_t)(head_end - offset));
+		if (r != EOK)
+			goto Finish;
+	}
 
-	iblock_idx = (uint32_t)((file->fpos) / block_size);
-	iblock_last = (uint32_t)((file->fpos + size) / block_size);
-	unalg = (file->fpos) % block_size;
+	if ((uint64_t)to * block_size > head_end && end % block_size)
+		r = ext4_fzero_partial(&ref, (uint64_t)to * block_size,
+				       end % block_size);
 
-	/*If the size of symlink is smaller than 60 bytes*/
-	bool softlink;
-	softlink = ext4_inode_is_type(sb, ref.inode, EXT4_INODE_MODE_SOFTLINK);
-	if (softlink && file->fsize < sizeof(ref.inode->blocks)
-		     && !ext4_inode_get_blocks_count(sb, ref.inode)) {
+Finish:
+	ext4_fs_put_inode_ref(&ref);
+	return r;
+}
 
-		char *content = (char *)ref.inode->blocks;
-		if (file->fpos < file->fsize) {
-			size_t len = size;
-			if (unalg + size > (uint32_t)file->fsize)
-				len = (uint32_t)file->fsize - unalg;
-			memcpy(buf, content + unalg, len);
-			if (rcnt)
-				*rcnt = len;
+static int ext4_fprealloc_no_lock(ext4_file *file, ext4_lblk_t *iblock,
+				  ext4_lblk_t last, uint64_t new_size)
+{
+	struct ext4_inode_ref ref;
+	ext4_fsblk_t fblk;
+	uint64_t old_size;
+	uint32_t block_size;
+	uint32_t cnt = 0;
+	int r;
+
+	r = ext4_fs_get_inode_ref(&file->mp->fs, file->inode, &ref);
+	if (r != EOK)
+		return r;
+
+	/*One unwritten extent (or already mapped run) per call*/
+	if (*iblock < last) {
+		r = ext4_extent_get_blocks(&ref, *iblock, last - *iblock, &fblk,
+					   EXT4_GET_BLOCKS_CREATE |
+					       EXT4_GET_BLOCKS_UNWRIT,
+					   &cnt);
+		if (r != EOK)
+			goto Finish;
+
+		*iblock += cnt;
+	}
 
+	old_size = ext4_inode_get_size(&file->mp->fs.sb, ref.inode);
+	if (*iblock >= last && new_size > old_size) {
+		/*The rest of the old last block becomes part of the file*/
+		block_size = ext4_sb_get_block_size(&file->mp->fs.sb);
+		if (old_size % block_size) {
+			r = ext4_fzero_partial(&ref, old_size,
+					       block_size - old_size % block_size);
+			if (r != EOK)
+				goto Finish;
 		}
 
-		r = EOK;
-		goto Finish;
+		ext4_inode_set_size(ref.inode, new_size);
+		ref.dirty = true;
+		file->fsize = new_size;
 	}
 
-	if (unalg) {
-		size_t len =  size;
-		if (size > (block_size - unalg))
-			len = block_size - unalg;
+Finish:
+	ext4_fs_put_inode_ref(&ref);
+	return r;
+}
 
-		r = ext4_fs_get_inode_dblk_idx(&ref, iblock_idx, &fblock, true);
-		if (r != EOK)
+int ext4_fallocate(ext4_file *file, uint64_t offset, uint64_t len,
+		   uint32_t mode)
+{
+	struct ext4_inode_ref ref;
+	uint32_t block_size;
+	uint64_t end, new_size = 0;
+	ext4_lblk_t iblock, last;
+	int r;
+
+	ext4_assert(file && file->mp);
+
+	if (mode & ~(EXT4_FALLOC_FL_KEEP_SIZE | EXT4_FALLOC_FL_PUNCH_HOLE |
+		     EXT4_FALLOC_FL_ZERO_RANGE))
+		return EINVAL;
+
+	if ((mode & EXT4_FALLOC_FL_PUNCH_HOLE) &&
+	    (mode & EXT4_FALLOC_FL_ZERO_RANGE))
+		return EINVAL;
+
+	/*Same as fallocate(2): punching never changes the size*/
+	if ((mode & EXT4_FALLOC_FL_PUNCH_HOLE) &&
+	    !(mode & EXT4_FALLOC_FL_KEEP_SIZE))
+		return ENOTSUP;
+
+	if (!len)
+		return EINVAL;
+
+	if (file->mp->fs.read_only)
+		return EROFS;
+
+	if (file->flags & O_RDONLY)
+		return EPERM;
+
+	block_size = ext4_sb_get_block_size(&file->mp->fs.sb);
+	end = offset + len;
+	if (end < offset ||
+	    (end + block_size - 1) / block_size >= EXT_MAX_BLOCKS)
+		return EFBIG;
+
+	iblock = (ext4_lblk_t)(offset / block_size);
+	last = (ext4_lblk_t)((end + block_size - 1) / block_size);
+	if (!(mode & EXT4_FALLOC_FL_KEEP_SIZE))
+		new_size = end;
+
+	EXT4_MP_LOCK(file->mp);
+
+	r = ext4_fs_get_inode_ref(&file->mp->fs, file->inode, &ref);
+	if (r != EOK)
+		goto Finish;
+
+	if (!ext4_sb_feature_incom(&file->mp->fs.sb, EXT4_FINCOM_EXTENTS) ||
+	    !ext4_inode_has_flag(ref.inode, EXT4_INODE_FLAG_EXTENTS))
+		r = ENOTSUP;
+
+	ext4_fs_put_inode_ref(&ref);
+	if (r != EOK)
+		goto Finish;
+
+	/*Delayed data of any handle may lie in the range*/
+	r = ext4_delalloc_flush_all(file->mp);
+	if (r != EOK)
+		goto Finish;
+
+	if (mode & (EXT4_FALLOC_FL_PUNCH_HOLE | EXT4_FALLOC_FL_ZERO_RANGE)) {
+		ext4_trans_start(file->mp);
+		r = ext4_fpunch_no_lock(file, offset, end);
+		if (r != EOK) {
+			ext4_trans_abort(file->mp);
 			goto Finish;
+		}
+		ext4_trans_stop(file->mp);
 
-		/* Do we get an unwritten range? */
-		if (fblock != 0) {
-			uint64_t off = fblock * block_size + unalg;
-			r = ext4_block_readbytes(file->mp->fs.bdev, off, u8_buf, len);
-			if (r != EOK)
-				goto Finish;
+		if (mode & EXT4_FALLOC_FL_PUNCH_HOLE)
+			goto Finish;
+	}
 
-		} else {
-			/* Yes, we do. */
-			memset(u8_buf, 0, len);
+	/*A transaction per extent keeps journal usage bounded*/
+	do {
+		ext4_trans_start(file->mp);
+		r = ext4_fprealloc_no_lock(file, &iblock, last, new_size);
+		if (r != EOK) {
+			ext4_trans_abort(file->mp);
+			break;
 		}
+		ext4_trans_stop(file->mp);
+	} while (iblock < last);
 
-		u8_buf += len;
-		size -= len;
-		file->fpos += len;
+Finish:
+	EXT4_MP_UNLOCK(file->mp);
+	return r;
+}
+#else
+int ext4_fallocate(ext4_file *file, uint64_t offset, uint64_t len,
+		   uint32_t mode)
+{
+	(void)file;
+	(void)offset;
+	(void)len;
+	(void)mode;
+	return ENOTSUP;
+}
+#endif
 
-		if (rcnt)
-			*rcnt += len;
+int ext4_fread(ext4_file *file, void *buf, size_t size, size_t *rcnt)
+{
+	uint32_t unalg;
+	uint32_t iblock_idx;
+	uint32_t block_size;
+	ext4_fsblk_t fblock;
 
-		iblock_idx++;
+	uint8_t *u8_buf = buf;
+	int r;
+	struct ext4_inode_ref ref;
+
+	ext4_assert(file && file->mp);
+
+	if (file->flags & O_WRONLY)
+		return EPERM;
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(file->mp);
+
+	struct ext4_fs *const fs = &file->mp->fs;
+	struct ext4_sblock *const sb = &file->mp->fs.sb;
+
+	if (rcnt)
+		*rcnt = 0;
+
+	/*Delayed data of any handle of the file has to be read back*/
+	r = ext4_delalloc_flush_inode(file->mp, file->inode);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(file->mp);
+		return r;
 	}
 
-	fblock_start = 0;
-	fblock_count = 0;
-	while (size >= block_size) {
-		while (iblock_idx < iblock_last) {
-			r = ext4_fs_get_inode_dblk_idx(&ref, iblock_idx,
-						       &fblock, true);
-			if (r != EOK)
-				goto Finish;
+	r = ext4_fs_get_inode_ref(fs, file->inode, &ref);
+	if (r != EOK) {
+		EXT4_MP_UNLOCK(file->mp);
+		return r;
+	}
 
-			iblock_idx++;
+	/*Sync file size*/
+	file->fsize = ext4_inode_get_size(sb, ref.inode);
 
-			if (!fblock_start)
-				fblock_start = fblock;
+	block_size = ext4_sb_get_block_size(sb);
+	size = ((uint64_t)size > (file->fsize - file->fpos))
+		? ((size_t)(file->fsize - file->fpos)) : size;
 
-			if ((fblock_start + fblock_count) != fblock)
-				break;
+	unalg = (file->fpos) % block_size;
+
+	/*If the size of symlink is smaller than 60 bytes*/
+	bool softlink;
+	softlink = ext4_inode_is_type(sb, ref.inode, EXT4_INODE_MODE_SOFTLINK);
+	if (softlink && file->fsize < sizeof(ref.inode->blocks)
+		     && !ext4_inode_get_blocks_count(sb, ref.inode)) {
+
+		char *content = (char *)ref.inode->blocks;
+		if (file->fpos < file->fsize) {
+			size_t len = size;
+			if (unalg + size > (uint32_t)file->fsize)
+				len = (uint32_t)file->fsize - unalg;
+			memcpy(buf, content + unalg, len);
+			if (rcnt)
+				*rcnt = len;
 
-			fblock_count++;
 		}
 
-		r = ext4_blocks_get_direct(file->mp->fs.bdev, u8_buf, fblock_start,
-					   fblock_count);
-		if (r != EOK)
-			goto Finish;
+		r = EOK;
+		goto Finish;
+	}
 
-		size -= block_size * fblock_count;
-		u8_buf += block_size * fblock_count;
-		file->fpos += block_size * fblock_count;
+	while (size) {
+		uint64_t want;
+		uint32_t run;
+		size_t len;
 
-		if (rcnt)
-			*rcnt += block_size * fblock_count;
+		iblock_idx = (uint32_t)(file->fpos / block_size);
+		unalg = file->fpos % block_size;
 
-		fblock_start = fblock;
-		fblock_count = 1;
-	}
+		/*Map as many blocks as the rest of the request spans, up to
+		 * the length of the longest extent*/
+		want = (unalg + (uint64_t)size + block_size - 1) / block_size;
+		if (want > 32768)
+			want = 32768;
 
-	if (size) {
-		uint64_t off;
-		r = ext4_fs_get_inode_dblk_idx(&ref, iblock_idx, &fblock, true);
+		r = ext4_fs_get_inode_dblk_run(&ref, iblock_idx, (uint32_t)want,
+					       &fblock, &run);
 		if (r != EOK)
 			goto Finish;
 
-		off = fblock * block_size;
-		r = ext4_block_readbytes(file->mp->fs.bdev, off, u8_buf, size);
-		if (r != EOK)
-			goto Finish;
+		len = (size_t)run * block_size - unalg;
+		if (len > size)
+			len = size;
 
-		file->fpos += size;
+		if (!fblock) {
+			/*Hole or unwritten range, no I/O needed*/
+			memset(u8_buf, 0, len);
+		} else if (unalg || len < block_size) {
+			/*Partial head or tail block*/
+			if (len > block_size - unalg)
+				len = block_size - unalg;
+
+			r = ext4_block_readbytes(file->mp->fs.bdev,
+						 fblock * block_size + unalg,
+						 u8_buf, (uint32_t)len);
+			if (r != EOK)
+				goto Finish;
+		} else {
+			/*Whole blocks of the run straight into the caller
+			 * buffer*/
+			run = (uint32_t)(len / block_size);
+			len = (size_t)run * block_size;
+			r = ext4_blocks_get_direct(file->mp->fs.bdev, u8_buf,
+						   fblock, run);
+			if (r != EOK)
+				goto Finish;
+		}
+
+		u8_buf += len;
+		size -= len;
+		file->fpos += len;
 
 		if (rcnt)
-			*rcnt += size;
+			*rcnt += len;
 	}
 
 Finish:
@@ -1827,7 +2397,8 @@ Finish:
 	return r;
 }
 
-int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
+static int ext4_fwrite_no_lock(ext4_file *file, const void *buf, size_t size,
+			       size_t *wcnt)
 {
 	uint32_t unalg;
 	uint32_t iblk_idx;
@@ -1841,20 +2412,9 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 
 	struct ext4_inode_ref ref;
 	const uint8_t *u8_buf = buf;
+	uint64_t fpos, fsize;
 	int r, rr = EOK;
 
-	ext4_assert(file && file->mp);
-
-	if (file->mp->fs.read_only)
-		return EROFS;
-
-	if (file->flags & O_RDONLY)
-		return EPERM;
-
-	if (!size)
-		return EOK;
-
-	EXT4_MP_LOCK(file->mp);
 	ext4_trans_start(file->mp);
 
 	struct ext4_fs *const fs = &file->mp->fs;
@@ -1866,12 +2426,13 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 	r = ext4_fs_get_inode_ref(fs, file->inode, &ref);
 	if (r != EOK) {
 		ext4_trans_abort(file->mp);
-		EXT4_MP_UNLOCK(file->mp);
 		return r;
 	}
 
 	/*Sync file size*/
 	file->fsize = ext4_inode_get_size(sb, ref.inode);
+	fpos = file->fpos;
+	fsize = file->fsize;
 	block_size = ext4_sb_get_block_size(sb);
 
 	iblock_last = (uint32_t)((file->fpos + size) / block_size);
@@ -1913,58 +2474,71 @@ int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
 	fblock_start = 0;
 	fblock_count = 0;
 	while (size >= block_size) {
+		uint32_t run = 0;
+		uint32_t want = iblock_last - iblk_idx;
+
+		/*Map or allocate as many blocks as possible at once, up to
+		 * the length of the longest extent*/
+		if (want > 32768)
+			want = 32768;
+
+		if (!want) {
+			/*Everything mapped, write the pending run*/
+		} else if (iblk_idx < ifile_blocks) {
+			if (want > ifile_blocks - iblk_idx)
+				want = ifile_blocks - iblk_idx;
+
+			r = ext4_fs_init_inode_dblk_run(&ref, iblk_idx, want,
+							&fblk, &run);
+			if (r != EOK)
+				break;
+		} else {
+			rr = ext4_fs_append_inode_dblk_run(&ref, want, &fblk,
+							   &iblk_idx, &run);
+			if (rr != EOK)
+				run = 0;
+		}
 
-		while (iblk_idx < iblock_last) {
-			if (iblk_idx < ifile_blocks) {
-				r = ext4_fs_init_inode_dblk_idx(&ref, iblk_idx,
-								&fblk);
-				if (r != EOK)
-					goto Finish;
-			} else {
-				rr = ext4_fs_append_inode_dblk(&ref, &fblk,
-							       &iblk_idx);
-				if (rr != EOK) {
-					/* Unable to append more blocks. But
-					 * some block might be allocated already
-					 * */
-					break;
-				}
-			}
-
-			iblk_idx++;
-
-			if (!fblock_start) {
+		/*Extend the pending run while blocks stay contiguous*/
+		if (run && (!fblock_count ||
+			    fblock_start + fblock_count == fblk)) {
+			if (!fblock_count)
 				fblock_start = fblk;
-			}
 
-			if ((fblock_start + fblock_count) != fblk)
-				break;
+			fblock_count += run;
+			iblk_idx += run;
+			if (iblk_idx < iblock_last)
+				continue;
 
-			fblock_count++;
+			run = 0;
 		}
 
-		r = ext4_blocks_set_direct(file->mp->fs.bdev, u8_buf, fblock_start,
-					   fblock_count);
-		if (r != EOK)
-			break;
-
-		size -= block_size * fblock_count;
-		u8_buf += block_size * fblock_count;
-		file->fpos += block_size * fblock_count;
+		if (fblock_count) {
+			r = ext4_blocks_set_direct(file->mp->fs.bdev, u8_buf,
+						   fblock_start, fblock_count);
+			if (r != EOK)
+				break;
 
-		if (wcnt)
-			*wcnt += block_size * fblock_count;
+			size -= block_size * fblock_count;
+			u8_buf += block_size * fblock_count;
+			file->fpos += block_size * fblock_count;
 
-		fblock_start = fblk;
-		fblock_count = 1;
+			if (wcnt)
+				*wcnt += block_size * fblock_count;
+		}
 
 		if (rr != EOK) {
 			/*ext4_fs_append_inode_block has failed and no
 			 * more blocks might be written. But node size
 			 * should be updated.*/
 			r = rr;
+			ext4_block_cache_write_back(file->mp->fs.bdev, 0);
 			goto out_fsize;
 		}
+
+		fblock_start = fblk;
+		fblock_count = run;
+		iblk_idx += run;
 	}
 
 	/*Stop write back cache mode*/
@@ -2007,11 +2581,232 @@ out_fsize:
 Finish:
 	r = ext4_fs_put_inode_ref(&ref);
 
-	if (r != EOK)
+	if (r != EOK) {
+		/*The write is taken back, so are the position and size*/
 		ext4_trans_abort(file->mp);
-	else
+		file->fpos = fpos;
+		file->fsize = fsize;
+		if (wcnt)
+			*wcnt = 0;
+	} else
 		ext4_trans_stop(file->mp);
 
+	return r;
+}
+
+/**@brief   Write out the delayed allocation buffer of a file. Blocks
+ *          for the whole buffer are allocated at once.*/
+static int ext4_delalloc_flush(ext4_file *file)
+{
+	uint64_t fpos = file->fpos;
+	uint32_t len = file->da_len;
+	size_t wcnt = 0;
+	int r;
+
+	if (!len)
+		return EOK;
+
+	file->da_len = 0;
+	file->fpos = file->da_off;
+	r = ext4_fwrite_no_lock(file, file->da_buf, len, &wcnt);
+	file->fpos = fpos;
+
+	/*Keep what could not be written*/
+	if (wcnt < len)
+		memmove(file->da_buf, file->da_buf + wcnt, len - wcnt);
+
+	file->da_len = len - (uint32_t)wcnt;
+	file->da_off += wcnt;
+	if (file->fsize < file->da_off + file->da_len)
+		file->fsize = file->da_off + file->da_len;
+
+	return r;
+}
+
+static int ext4_delalloc_flush_all(struct ext4_mountpoint *mp)
+{
+	ext4_file *f;
+	int r, ret = EOK;
+
+	for (f = mp->delalloc_files; f; f = f->da_next) {
+		r = ext4_delalloc_flush(f);
+		if (r != EOK && ret == EOK)
+			ret = r;
+	}
+
+	return ret;
+}
+
+static int ext4_delalloc_flush_inode(struct ext4_mountpoint *mp,
+				     uint32_t inode)
+{
+	ext4_file *f;
+	int r, ret = EOK;
+
+	for (f = mp->delalloc_files; f; f = f->da_next) {
+		if (f->inode != inode)
+			continue;
+
+		r = ext4_delalloc_flush(f);
+		if (r != EOK && ret == EOK)
+			ret = r;
+	}
+
+	return ret;
+}
+
+/**@brief   A new handle sees the data other handles of the file delayed.*/
+static int ext4_delalloc_open(ext4_file *file)
+{
+	struct ext4_inode_ref ref;
+	int r;
+
+	if (!file->mp->delalloc_files)
+		return EOK;
+
+	r = ext4_delalloc_flush_inode(file->mp, file->inode);
+	if (r != EOK)
+		return r;
+
+	r = ext4_fs_get_inode_ref(&file->mp->fs, file->inode, &ref);
+	if (r != EOK)
+		return r;
+
+	file->fsize = ext4_inode_get_size(&file->mp->fs.sb, ref.inode);
+	if (file->flags & O_APPEND)
+		file->fpos = file->fsize;
+
+	return ext4_fs_put_inode_ref(&ref);
+}
+
+static void ext4_delalloc_release(ext4_file *file)
+{
+	ext4_file **pp;
+
+	for (pp = &file->mp->delalloc_files; *pp; pp = &(*pp)->da_next) {
+		if (*pp == file) {
+			*pp = file->da_next;
+			break;
+		}
+	}
+
+	ext4_free(file->da_buf);
+	file->da_buf = NULL;
+	file->da_len = 0;
+	file->da_next = NULL;
+}
+
+/**@brief   Try to keep an append in the delayed allocation buffer.
+ * @param   delayed set if the data went to the buffer, the write has
+ *          to be done directly otherwise*/
+static int ext4_delalloc_write(ext4_file *file, const void *buf, size_t size,
+			       size_t *wcnt, bool *delayed)
+{
+	struct ext4_mountpoint *mp = file->mp;
+	const uint8_t *u8_buf = buf;
+	uint32_t cap = mp->delalloc_size;
+	int r;
+
+	*delayed = false;
+
+	if (!file->da_len) {
+		struct ext4_inode_ref ref;
+		bool reg;
+
+		/*Large writes already get contiguous runs*/
+		if (size >= cap)
+			return EOK;
+
+		r = ext4_fs_get_inode_ref(&mp->fs, file->inode, &ref);
+		if (r != EOK)
+			return r;
+
+		file->fsize = ext4_inode_get_size(&mp->fs.sb, ref.inode);
+		reg = ext4_inode_is_type(&mp->fs.sb, ref.inode,
+					 EXT4_INODE_MODE_FILE);
+		ext4_fs_put_inode_ref(&ref);
+
+		/*Only appends are delayed*/
+		if (!reg || file->fpos != file->fsize)
+			return EOK;
+
+		if (!file->da_buf) {
+			file->da_buf = ext4_malloc(cap);
+			if (!file->da_buf)
+				return EOK;
+
+			file->da_next = mp->delalloc_files;
+			mp->delalloc_files = file;
+		}
+
+		file->da_off = file->fpos;
+	} else if (file->fpos != file->da_off + file->da_len) {
+		return EOK;
+	}
+
+	*delayed = true;
+	if (wcnt)
+		*wcnt = 0;
+
+	while (size) {
+		uint32_t len = cap - file->da_len;
+		if (len > size)
+			len = (uint32_t)size;
+
+		memcpy(file->da_buf + file->da_len, u8_buf, len);
+		file->da_len += len;
+		file->fpos += len;
+		u8_buf += len;
+		size -= len;
+
+		if (wcnt)
+			*wcnt += len;
+
+		if (file->fpos > file->fsize)
+			file->fsize = file->fpos;
+
+		/*Buffer full, allocate and write it out*/
+		if (file->da_len == cap) {
+			r = ext4_delalloc_flush(file);
+			if (r != EOK)
+				return r;
+		}
+	}
+
+	return EOK;
+}
+
+int ext4_fwrite(ext4_file *file, const void *buf, size_t size, size_t *wcnt)
+{
+	bool delayed;
+	int r;
+
+	ext4_assert(file && file->mp);
+
+	if (file->mp->fs.read_only)
+		return EROFS;
+
+	if (file->flags & O_RDONLY)
+		return EPERM;
+
+	if (!size)
+		return EOK;
+
+	EXT4_MP_LOCK(file->mp);
+
+	if (file->mp->delalloc_size) {
+		r = ext4_delalloc_write(file, buf, size, wcnt, &delayed);
+		if (r != EOK || delayed)
+			goto Finish;
+
+		r = ext4_delalloc_flush(file);
+		if (r != EOK)
+			goto Finish;
+	}
+
+	r = ext4_fwrite_no_lock(file, buf, size, wcnt);
+
+Finish:
 	EXT4_MP_UNLOCK(file->mp);
 	return r;
 }
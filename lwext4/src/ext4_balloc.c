@@ -53,6 +53,9 @@
 #include "ext4_bitmap.h"
 #include "ext4_inode.h"
 
+#include <stdlib.h>
+#include <string.h>
+
 /**@brief Compute number of block group from block address.
  * @param sb superblock pointer.
  * @param baddr Absolute address of block.
@@ -149,155 +152,549 @@ ext4_balloc_verify_bitmap_csum(struct ext4_sblock *sb,
 #define ext4_balloc_verify_bitmap_csum(...) true
 #endif
 
-int ext4_balloc_free_block(struct ext4_inode_ref *inode_ref, ext4_fsblk_t baddr)
+#if CONFIG_BALLOC_INDEX_RUNS
+/**@brief Free runs of the group are valid.*/
+#define EXT4_BIDX_BUILT 0x01
+/**@brief Free blocks count of the group is valid.*/
+#define EXT4_BIDX_FREE 0x02
+/**@brief Group is too fragmented to be indexed, scan its bitmap.*/
+#define EXT4_BIDX_NOINDEX 0x04
+
+static struct ext4_balloc_group_index *
+ext4_bidx_get(struct ext4_fs *fs, uint32_t bgid)
 {
-	struct ext4_fs *fs = inode_ref->fs;
-	struct ext4_sblock *sb = &fs->sb;
+	if (!fs->bidx) {
+		uint32_t cnt = ext4_block_group_cnt(&fs->sb);
+		fs->bidx = ext4_calloc(cnt, sizeof(*fs->bidx));
+		if (!fs->bidx)
+			return NULL;
 
-	uint32_t bg_id = ext4_balloc_get_bgid_of_block(sb, baddr);
-	uint32_t index_in_group = ext4_fs_addr_to_idx_bg(sb, baddr);
+		fs->bidx_cnt = cnt;
+	}
 
-	/* Load block group reference */
-	struct ext4_block_group_ref bg_ref;
-	int rc = ext4_fs_get_block_group_ref(fs, bg_id, &bg_ref);
-	if (rc != EOK)
-		return rc;
+	return bgid < fs->bidx_cnt ? &fs->bidx[bgid] : NULL;
+}
 
-	struct ext4_bgroup *bg = bg_ref.block_group;
+static void ext4_bidx_reset(struct ext4_balloc_group_index *gi, uint8_t flags)
+{
+	ext4_free(gi->runs);
+	gi->runs = NULL;
+	gi->runs_cnt = 0;
+	gi->runs_max = 0;
+	gi->largest = 0;
+	gi->flags = flags;
+}
 
-	/* Load block with bitmap */
-	ext4_fsblk_t bitmap_block_addr =
-	    ext4_bg_get_block_bitmap(bg, sb);
+/**@brief Position of the first run ending past @p idx (binary search).*/
+static uint32_t ext4_bidx_find(struct ext4_balloc_group_index *gi,
+			       uint32_t idx)
+{
+	uint32_t l = 0, r = gi->runs_cnt;
+
+	while (l < r) {
+		uint32_t m = l + (r - l) / 2;
+		if (gi->runs[m].start + gi->runs[m].len <= idx)
+			l = m + 1;
+		else
+			r = m;
+	}
 
-	struct ext4_block bitmap_block;
+	return l;
+}
 
-	rc = ext4_trans_block_get(fs->bdev, &bitmap_block, bitmap_block_addr);
-	if (rc != EOK) {
-		ext4_fs_put_block_group_ref(&bg_ref);
-		return rc;
+static bool ext4_bidx_insert(struct ext4_balloc_group_index *gi,
+			     uint32_t pos, uint32_t start, uint32_t len)
+{
+	if (gi->runs_cnt == gi->runs_max) {
+		uint32_t max = gi->runs_max ? gi->runs_max * 2 : 16;
+		struct ext4_balloc_run *runs;
+
+		if (max > CONFIG_BALLOC_INDEX_RUNS)
+			max = CONFIG_BALLOC_INDEX_RUNS;
+
+		runs = gi->runs_cnt < max
+			   ? ext4_realloc(gi->runs, max * sizeof(*runs))
+			   : NULL;
+		if (!runs) {
+			/*Too fragmented (or out of memory): fall back to
+			 * bitmap scans for this group*/
+			ext4_bidx_reset(gi, (gi->flags & EXT4_BIDX_FREE) |
+						EXT4_BIDX_NOINDEX);
+			return false;
+		}
+
+		gi->runs = runs;
+		gi->runs_max = max;
 	}
 
-	if (!ext4_balloc_verify_bitmap_csum(sb, bg, bitmap_block.data)) {
-		ext4_dbg(DEBUG_BALLOC,
-			DBG_WARN "Bitmap checksum failed."
-			"Group: %" PRIu32"\n",
-			bg_ref.index);
+	memmove(gi->runs + pos + 1, gi->runs + pos,
+		(gi->runs_cnt - pos) * sizeof(*gi->runs));
+	gi->runs[pos].start = start;
+	gi->runs[pos].len = len;
+	gi->runs_cnt++;
+	return true;
+}
+
+static void ext4_bidx_remove(struct ext4_balloc_group_index *gi,
+			     uint32_t pos)
+{
+	gi->runs_cnt--;
+	memmove(gi->runs + pos, gi->runs + pos + 1,
+		(gi->runs_cnt - pos) * sizeof(*gi->runs));
+}
+
+static void ext4_bidx_update_largest(struct ext4_balloc_group_index *gi)
+{
+	uint32_t i;
+
+	gi->largest = 0;
+	for (i = 0; i < gi->runs_cnt; i++)
+		if (gi->runs[i].len > gi->largest)
+			gi->largest = gi->runs[i].len;
+}
+
+/**@brief Rebuild the free runs of a group from its bitmap.*/
+static void ext4_bidx_build(struct ext4_balloc_group_index *gi,
+			    uint8_t *bmap, uint32_t idx, uint32_t end)
+{
+	uint32_t start, free = 0;
+
+	ext4_bidx_reset(gi, EXT4_BIDX_BUILT | EXT4_BIDX_FREE);
+	while (idx < end) {
+		if (ext4_bmap_bit_find_clr(bmap, idx, end, &start) != EOK)
+			break;
+
+		if (ext4_bmap_bit_find_set(bmap, start, end, &idx) != EOK)
+			idx = end;
+
+		if (!ext4_bidx_insert(gi, gi->runs_cnt, start, idx - start))
+			return;
+
+		free += idx - start;
+		if (idx - start > gi->largest)
+			gi->largest = idx - start;
 	}
 
-	/* Modify bitmap */
-	ext4_bmap_bit_clr(bitmap_block.data, index_in_group);
-	ext4_balloc_set_bitmap_csum(sb, bg, bitmap_block.data);
-	ext4_trans_set_block_dirty(bitmap_block.buf);
+	gi->free = free;
+}
 
-	/* Release block with bitmap */
-	rc = ext4_block_set(fs->bdev, &bitmap_block);
-	if (rc != EOK) {
-		/* Error in saving bitmap */
-		ext4_fs_put_block_group_ref(&bg_ref);
-		return rc;
+/**@brief Account blocks [start, start + len) of a group as used.*/
+static void ext4_bidx_claim(struct ext4_fs *fs, uint32_t bgid, uint32_t start,
+			    uint32_t len)
+{
+	struct ext4_balloc_group_index *gi = ext4_bidx_get(fs, bgid);
+	struct ext4_balloc_run *run;
+	uint32_t pos, run_end, run_len;
+
+	if (!gi)
+		return;
+
+	if (gi->flags & EXT4_BIDX_FREE)
+		gi->free -= len;
+
+	if (!(gi->flags & EXT4_BIDX_BUILT))
+		return;
+
+	pos = ext4_bidx_find(gi, start);
+	run = gi->runs + pos;
+	if (pos == gi->runs_cnt || run->start > start ||
+	    start + len > run->start + run->len) {
+		/*Out of sync with the bitmap*/
+		ext4_bidx_reset(gi, 0);
+		return;
 	}
 
-	uint32_t block_size = ext4_sb_get_block_size(sb);
+	run_len = run->len;
+	run_end = run->start + run->len;
+	if (run->start == start && run_end == start + len) {
+		ext4_bidx_remove(gi, pos);
+	} else if (run->start == start) {
+		run->start += len;
+		run->len -= len;
+	} else {
+		run->len = start - run->start;
+		if (start + len < run_end &&
+		    !ext4_bidx_insert(gi, pos + 1, start + len,
+				      run_end - start - len))
+			return;
+	}
 
-	/* Update superblock free blocks count */
-	uint64_t sb_free_blocks = ext4_sb_get_free_blocks_cnt(sb);
-	sb_free_blocks++;
-	ext4_sb_set_free_blocks_cnt(sb, sb_free_blocks);
+	if (run_len == gi->largest)
+		ext4_bidx_update_largest(gi);
+}
 
-	/* Update inode blocks count */
-	uint64_t ino_blocks = ext4_inode_get_blocks_count(sb, inode_ref->inode);
-	ino_blocks -= block_size / EXT4_INODE_BLOCK_SIZE;
-	ext4_inode_set_blocks_count(sb, inode_ref->inode, ino_blocks);
-	inode_ref->dirty = true;
+/**@brief Account blocks [start, start + len) of a group as free.*/
+static void ext4_bidx_release(struct ext4_fs *fs, uint32_t bgid,
+			      uint32_t start, uint32_t len)
+{
+	struct ext4_balloc_group_index *gi = ext4_bidx_get(fs, bgid);
+	struct ext4_balloc_run *prev, *next;
+	uint32_t pos;
 
-	/* Update block group free blocks count */
-	uint32_t free_blocks = ext4_bg_get_free_blocks_count(bg, sb);
-	free_blocks++;
-	ext4_bg_set_free_blocks_count(bg, sb, free_blocks);
+	if (!gi)
+		return;
 
-	bg_ref.dirty = true;
+	if (gi->flags & EXT4_BIDX_FREE)
+		gi->free += len;
 
-	rc = ext4_trans_try_revoke_block(fs->bdev, baddr);
-	if (rc != EOK) {
-		bg_ref.dirty = false;
-		ext4_fs_put_block_group_ref(&bg_ref);
-		return rc;
+	if (!(gi->flags & EXT4_BIDX_BUILT))
+		return;
+
+	pos = ext4_bidx_find(gi, start);
+	prev = pos ? gi->runs + pos - 1 : NULL;
+	next = pos < gi->runs_cnt ? gi->runs + pos : NULL;
+	if (next && next->start < start + len) {
+		/*Out of sync with the bitmap*/
+		ext4_bidx_reset(gi, 0);
+		return;
 	}
-	ext4_bcache_invalidate_lba(fs->bdev->bc, baddr, 1);
-	/* Release block group reference */
-	rc = ext4_fs_put_block_group_ref(&bg_ref);
 
-	return rc;
+	if (prev && prev->start + prev->len == start) {
+		prev->len += len;
+		if (next && next->start == start + len) {
+			prev->len += next->len;
+			ext4_bidx_remove(gi, pos);
+		}
+		len = prev->len;
+	} else if (next && next->start == start + len) {
+		next->start = start;
+		next->len += len;
+		len = next->len;
+	} else if (!ext4_bidx_insert(gi, pos, start, len)) {
+		return;
+	}
+
+	if (len > gi->largest)
+		gi->largest = len;
 }
 
-int ext4_balloc_free_blocks(struct ext4_inode_ref *inode_ref,
-			    ext4_fsblk_t first, uint32_t count)
+/**@brief Choose a free run of a group using its index.
+ * @param gi   group index
+ * @param goal preferred first block, taken regardless of the run length
+ *             when @p at_goal is set and it is free
+ * @param min  minimum run length
+ * @param start output first block of the run
+ * @return true if a run was found*/
+static bool ext4_bidx_pick(struct ext4_balloc_group_index *gi, uint32_t goal,
+			   bool at_goal, uint32_t min, uint32_t *start)
 {
-	int rc = EOK;
-	uint32_t blk_cnt = count;
-	ext4_fsblk_t start_block = first;
-	struct ext4_fs *fs = inode_ref->fs;
-	struct ext4_sblock *sb = &fs->sb;
+	uint32_t pos = ext4_bidx_find(gi, goal), i;
 
-	/* Compute indexes */
-	uint32_t bg_first = ext4_balloc_get_bgid_of_block(sb, first);
+	if (pos < gi->runs_cnt && gi->runs[pos].start <= goal &&
+	    (at_goal || gi->runs[pos].start + gi->runs[pos].len - goal >= min)) {
+		*start = goal;
+		return true;
+	}
 
-	/* Compute indexes */
-	uint32_t bg_last = ext4_balloc_get_bgid_of_block(sb, first + count - 1);
-
-	if (!ext4_sb_feature_incom(sb, EXT4_FINCOM_FLEX_BG)) {
-		/*It is not possible without flex_bg that blocks are continuous
-		 * and and last block belongs to other bg.*/
-		if (bg_last != bg_first) {
-			ext4_dbg(DEBUG_BALLOC, DBG_WARN "FLEX_BG: disabled & "
-				"bg_last: %"PRIu32" bg_first: %"PRIu32"\n",
-				bg_last, bg_first);
+	if (gi->largest < min)
+		return false;
+
+	/*Nearest run after the goal, then from the group start*/
+	for (i = pos; i < gi->runs_cnt; i++)
+		if (gi->runs[i].len >= min)
+			goto found;
+
+	for (i = 0; i < pos; i++)
+		if (gi->runs[i].len >= min)
+			goto found;
+
+	return false;
+
+found:
+	*start = gi->runs[i].start;
+	return true;
+}
+#endif
+
+void ext4_balloc_index_drop(struct ext4_fs *fs __unused)
+{
+#if CONFIG_BALLOC_INDEX_RUNS
+	uint32_t i;
+
+	if (!fs->bidx)
+		return;
+
+	for (i = 0; i < fs->bidx_cnt; i++)
+		ext4_free(fs->bidx[i].runs);
+
+	ext4_free(fs->bidx);
+	fs->bidx = NULL;
+	fs->bidx_cnt = 0;
+#endif
+}
+
+/**@brief Queue freed blocks for discard.*/
+static void ext4_balloc_discard_add(struct ext4_fs *fs, ext4_fsblk_t first,
+				    uint32_t count)
+{
+	struct ext4_balloc_discard *d = &fs->discard;
+	struct ext4_balloc_range *last;
+
+	if (!d->enabled)
+		return;
+
+	last = d->cnt ? &d->ranges[d->cnt - 1] : NULL;
+	if (last && last->start + last->len == first &&
+	    last->len <= UINT32_MAX - count) {
+		last->len += count;
+		return;
+	}
+
+	if (d->cnt == d->max) {
+		uint32_t max = d->max ? d->max * 2 : 64;
+		struct ext4_balloc_range *r;
+
+		if (d->max >= CONFIG_DISCARD_MAX_RANGES)
+			return;
+
+		r = ext4_realloc(d->ranges, max * sizeof(*r));
+		if (!r)
+			return;
+
+		d->ranges = r;
+		d->max = max;
+	}
+
+	d->ranges[d->cnt].start = first;
+	d->ranges[d->cnt].len = count;
+	d->cnt++;
+}
+
+/**@brief Blocks allocated again before their release was committed must
+ *        not be discarded.*/
+static void ext4_balloc_discard_cancel(struct ext4_fs *fs, ext4_fsblk_t first,
+				       uint32_t count)
+{
+	struct ext4_balloc_discard *d = &fs->discard;
+	ext4_fsblk_t last = first + count;
+	uint32_t i, cnt = d->cnt;
+
+	for (i = 0; i < cnt; i++) {
+		struct ext4_balloc_range *r = &d->ranges[i];
+		ext4_fsblk_t end = r->start + r->len;
+
+		if (last <= r->start || first >= end)
+			continue;
+
+		if (first <= r->start && last >= end) {
+			r->len = 0;
+		} else if (first <= r->start) {
+			r->len = end - last;
+			r->start = last;
+		} else {
+			/* Head is kept, tail goes to a new range (if any room:
+			 * dropping it only costs a discard) */
+			r->len = first - r->start;
+			if (last < end && d->cnt < d->max) {
+				d->ranges[d->cnt].start = last;
+				d->ranges[d->cnt].len = end - last;
+				d->cnt++;
+			}
 		}
 	}
+}
 
-	/* Load block group reference */
+/**@brief Order ranges by start block.*/
+static int ext4_balloc_range_cmp(const void *a, const void *b)
+{
+	const struct ext4_balloc_range *ra = a, *rb = b;
+
+	if (ra->start == rb->start)
+		return 0;
+
+	return ra->start < rb->start ? -1 : 1;
+}
+
+void ext4_balloc_discard_flush(struct ext4_fs *fs)
+{
+	struct ext4_balloc_discard *d = &fs->discard;
+	ext4_fsblk_t start, end;
+	uint64_t len;
+	uint32_t i;
+	int r;
+
+	if (d->cnt > 1)
+		qsort(d->ranges, d->cnt, sizeof(d->ranges[0]),
+		      ext4_balloc_range_cmp);
+
+	/* Adjacent ranges (of neighbour groups too) go out as one request */
+	i = 0;
+	while (i < d->cnt) {
+		start = d->ranges[i].start;
+		len = 0;
+		for (; i < d->cnt && d->ranges[i].start <= start + len; i++) {
+			end = d->ranges[i].start + d->ranges[i].len;
+			if (end > start + len)
+				len = end - start;
+		}
+
+		if (!len)
+			continue;
+
+		r = ext4_blocks_discard(fs->bdev, start, len);
+		if (r == ENOTSUP) {
+			d->enabled = false;
+			break;
+		}
+
+		if (r != EOK)
+			ext4_dbg(DEBUG_BALLOC, DBG_WARN "Discard failed: %d."
+				 " Blocks: %" PRIu64 " - %" PRIu64 "\n",
+				 r, start, start + len - 1);
+	}
+
+	ext4_balloc_discard_drop(fs);
+}
+
+void ext4_balloc_discard_drop(struct ext4_fs *fs)
+{
+	struct ext4_balloc_discard *d = &fs->discard;
+
+	ext4_free(d->ranges);
+	d->ranges = NULL;
+	d->cnt = 0;
+	d->max = 0;
+}
+
+/**@brief Make room for @p cnt more pending ranges.*/
+static int ext4_balloc_pending_reserve(struct ext4_fs *fs, uint32_t cnt)
+{
+	struct ext4_balloc_pending *p = &fs->pending;
+	struct ext4_balloc_range *r;
+	uint32_t max;
+
+	if (cnt <= p->max - p->cnt)
+		return EOK;
+
+	max = p->max ? p->max * 2 : 64;
+	if (max - p->cnt < cnt)
+		max = p->cnt + cnt;
+
+	r = ext4_realloc(p->ranges, max * sizeof(*r));
+	if (!r)
+		return ENOMEM;
+
+	p->ranges = r;
+	p->max = max;
+	return EOK;
+}
+
+/**@brief Add a range to the pending list (room is reserved).*/
+static void ext4_balloc_pending_add(struct ext4_fs *fs, ext4_fsblk_t first,
+				    uint32_t count)
+{
+	struct ext4_balloc_pending *p = &fs->pending;
+	struct ext4_balloc_range *last;
+
+	p->blocks += count;
+
+	/*Ranges from before the running operation must stay as they are
+	 * in case it is rolled back*/
+	last = p->cnt > fs->undo.pending_cnt ? &p->ranges[p->cnt - 1] : NULL;
+	if (last && last->len <= UINT32_MAX - count) {
+		if (last->start + last->len == first) {
+			last->len += count;
+			return;
+		}
+
+		if (first + count == last->start) {
+			last->start = first;
+			last->len += count;
+			return;
+		}
+	}
+
+	ext4_assert(p->cnt < p->max);
+	p->ranges[p->cnt].start = first;
+	p->ranges[p->cnt].len = count;
+	p->cnt++;
+}
+
+void ext4_balloc_pending_drop(struct ext4_fs *fs)
+{
+	struct ext4_balloc_pending *p = &fs->pending;
+
+	ext4_free(p->ranges);
+	memset(p, 0, sizeof(*p));
+}
+
+/**@brief Return block ranges to the filesystem. Ranges are sorted, so
+ *        every block group bitmap and descriptor is updated once.
+ * @param fs     filesystem
+ * @param ranges ranges to release (consumed)
+ * @param cnt    number of ranges
+ * @return standard error code*/
+static int ext4_balloc_release_ranges(struct ext4_fs *fs,
+				      struct ext4_balloc_range *ranges,
+				      uint32_t cnt)
+{
+	struct ext4_sblock *sb = &fs->sb;
 	struct ext4_block_group_ref bg_ref;
-	while (bg_first <= bg_last) {
+	struct ext4_block blk;
+	uint32_t i, bgid, blk_in_bg, idx, n, freed;
+	int rc;
+
+	if (cnt > 1)
+		qsort(ranges, cnt, sizeof(ranges[0]), ext4_balloc_range_cmp);
+
+	i = 0;
+	while (i < cnt) {
+		bgid = ext4_balloc_get_bgid_of_block(sb, ranges[i].start);
+		blk_in_bg = ext4_blocks_in_group_cnt(sb, bgid);
 
-		rc = ext4_fs_get_block_group_ref(fs, bg_first, &bg_ref);
+		/* Load block group reference */
+		rc = ext4_fs_get_block_group_ref(fs, bgid, &bg_ref);
 		if (rc != EOK)
 			return rc;
 
 		struct ext4_bgroup *bg = bg_ref.block_group;
 
-		uint32_t idx_in_bg_first;
-		idx_in_bg_first = ext4_fs_addr_to_idx_bg(sb, first);
-
 		/* Load block with bitmap */
 		ext4_fsblk_t bitmap_blk = ext4_bg_get_block_bitmap(bg, sb);
-
-		struct ext4_block blk;
 		rc = ext4_trans_block_get(fs->bdev, &blk, bitmap_blk);
 		if (rc != EOK) {
 			ext4_fs_put_block_group_ref(&bg_ref);
 			return rc;
 		}
 
+		ext4_bcache_set_flag(blk.buf, BC_META);
+
 		if (!ext4_balloc_verify_bitmap_csum(sb, bg, blk.data)) {
 			ext4_dbg(DEBUG_BALLOC,
 				DBG_WARN "Bitmap checksum failed."
 				"Group: %" PRIu32"\n",
 				bg_ref.index);
 		}
-		uint32_t free_cnt;
-		free_cnt = ext4_sb_get_block_size(sb) * 8 - idx_in_bg_first;
 
-		/*If last block, free only count blocks*/
-		free_cnt = count > free_cnt ? free_cnt : count;
+		/* Modify bitmap: all ranges of this group */
+		freed = 0;
+		while (i < cnt &&
+		       ext4_balloc_get_bgid_of_block(sb, ranges[i].start) ==
+			   bgid) {
+			idx = ext4_fs_addr_to_idx_bg(sb, ranges[i].start);
+			n = blk_in_bg - idx;
+			if (n > ranges[i].len)
+				n = ranges[i].len;
+
+			ext4_bmap_bits_free(blk.data, idx, n);
+#if CONFIG_BALLOC_INDEX_RUNS
+			ext4_bidx_release(fs, bgid, idx, n);
+#endif
+			ext4_balloc_discard_add(fs, ranges[i].start, n);
+			freed += n;
+			ranges[i].start += n;
+			ranges[i].len -= n;
+
+			/* Rest of the range belongs to the next group */
+			if (ranges[i].len)
+				break;
+
+			i++;
+		}
 
-		/* Modify bitmap */
-		ext4_bmap_bits_free(blk.data, idx_in_bg_first, free_cnt);
 		ext4_balloc_set_bitmap_csum(sb, bg, blk.data);
 		ext4_trans_set_block_dirty(blk.buf);
 
-		count -= free_cnt;
-		first += free_cnt;
-
 		/* Release block with bitmap */
 		rc = ext4_block_set(fs->bdev, &blk);
 		if (rc != EOK) {
@@ -305,279 +702,440 @@ int ext4_balloc_free_blocks(struct ext4_inode_ref *inode_ref,
 			return rc;
 		}
 
-		uint32_t block_size = ext4_sb_get_block_size(sb);
-
 		/* Update superblock free blocks count */
 		uint64_t sb_free_blocks = ext4_sb_get_free_blocks_cnt(sb);
-		sb_free_blocks += free_cnt;
+		sb_free_blocks += freed;
 		ext4_sb_set_free_blocks_cnt(sb, sb_free_blocks);
 
-		/* Update inode blocks count */
-		uint64_t ino_blocks;
-		ino_blocks = ext4_inode_get_blocks_count(sb, inode_ref->inode);
-		ino_blocks -= free_cnt * (block_size / EXT4_INODE_BLOCK_SIZE);
-		ext4_inode_set_blocks_count(sb, inode_ref->inode, ino_blocks);
-		inode_ref->dirty = true;
-
 		/* Update block group free blocks count */
 		uint32_t free_blocks;
 		free_blocks = ext4_bg_get_free_blocks_count(bg, sb);
-		free_blocks += free_cnt;
+		free_blocks += freed;
 		ext4_bg_set_free_blocks_count(bg, sb, free_blocks);
 		bg_ref.dirty = true;
 
 		/* Release block group reference */
 		rc = ext4_fs_put_block_group_ref(&bg_ref);
 		if (rc != EOK)
-			break;
-
-		bg_first++;
+			return rc;
 	}
 
+	return EOK;
+}
+
+/**@brief Revoke journalled copies of released blocks and drop their
+ *        cached buffers. Without a journal this is done as soon as blocks
+ *        are released: they stay allocated in the bitmap until the batch
+ *        is flushed, so nothing can reuse them before that. With one, it
+ *        is done when the pending blocks are flushed: an operation rolled
+ *        back before keeps them.*/
+static int ext4_balloc_forget(struct ext4_fs *fs, ext4_fsblk_t first,
+			      uint32_t count)
+{
 	uint32_t i;
-	for (i = 0;i < blk_cnt;i++) {
-		rc = ext4_trans_try_revoke_block(fs->bdev, start_block + i);
+	int rc;
+
+	for (i = 0; i < count; i++) {
+		rc = ext4_trans_try_revoke_block(fs->bdev, first + i);
 		if (rc != EOK)
 			return rc;
-
 	}
 
-	ext4_bcache_invalidate_lba(fs->bdev->bc, start_block, blk_cnt);
-	/*All blocks should be released*/
-	ext4_assert(count == 0);
+	ext4_bcache_invalidate_lba(fs->bdev->bc, first, count);
+	return EOK;
+}
+
+/**@brief Release block ranges. With a journal, they stay allocated in the
+ *        bitmaps until the running transaction commits: if it is lost in
+ *        a crash, the blocks are still owned by what was freed, so they
+ *        must not be written with new data before.
+ * @param fs     filesystem
+ * @param ranges ranges to release
+ * @param cnt    number of ranges
+ * @return standard error code*/
+static int ext4_balloc_free_ranges(struct ext4_fs *fs,
+				   struct ext4_balloc_range *ranges,
+				   uint32_t cnt)
+{
+	uint32_t i;
+	int rc;
+
+	if (!fs->jbd_journal)
+		return ext4_balloc_release_ranges(fs, ranges, cnt);
+
+	rc = ext4_balloc_pending_reserve(fs, cnt);
+	if (rc != EOK)
+		return rc;
+
+	for (i = 0; i < cnt; i++)
+		ext4_balloc_pending_add(fs, ranges[i].start, ranges[i].len);
+
+	return EOK;
+}
+
+int ext4_balloc_pending_flush(struct ext4_fs *fs)
+{
+	struct ext4_balloc_pending *p = &fs->pending;
+	uint32_t i;
+	int rc = EOK;
 
+	for (i = 0; i < p->cnt && rc == EOK; i++)
+		rc = ext4_balloc_forget(fs, p->ranges[i].start,
+					p->ranges[i].len);
+
+	if (rc == EOK && p->cnt)
+		rc = ext4_balloc_release_ranges(fs, p->ranges, p->cnt);
+
+	ext4_balloc_pending_drop(fs);
 	return rc;
 }
 
-int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
-			    ext4_fsblk_t goal,
-			    ext4_fsblk_t *fblock)
+/**@brief Add blocks to the open batch.
+ * @return false if there is no batch (or no memory to extend it)*/
+static bool ext4_balloc_batch_add(struct ext4_fs *fs, ext4_fsblk_t first,
+				  uint32_t count)
 {
-	ext4_fsblk_t alloc = 0;
-	ext4_fsblk_t bmp_blk_adr;
-	uint32_t rel_blk_idx = 0;
-	uint64_t free_blocks;
-	int r;
-	struct ext4_sblock *sb = &inode_ref->fs->sb;
+	struct ext4_balloc_free_batch *fb = &fs->free_batch;
+	struct ext4_balloc_range *last;
 
-	/* Load block group number for goal and relative index */
-	uint32_t bg_id = ext4_balloc_get_bgid_of_block(sb, goal);
-	uint32_t idx_in_bg = ext4_fs_addr_to_idx_bg(sb, goal);
+	if (!fb->depth)
+		return false;
 
-	struct ext4_block b;
-	struct ext4_block_group_ref bg_ref;
+	/* Extents are usually released back to front */
+	last = fb->cnt ? &fb->ranges[fb->cnt - 1] : NULL;
+	if (last && last->len <= UINT32_MAX - count) {
+		if (last->start + last->len == first) {
+			last->len += count;
+			return true;
+		}
 
-	/* Load block group reference */
-	r = ext4_fs_get_block_group_ref(inode_ref->fs, bg_id, &bg_ref);
-	if (r != EOK)
-		return r;
+		if (first + count == last->start) {
+			last->start = first;
+			last->len += count;
+			return true;
+		}
+	}
 
-	struct ext4_bgroup *bg = bg_ref.block_group;
+	if (fb->cnt == fb->max) {
+		uint32_t max = fb->max ? fb->max * 2 : 64;
+		struct ext4_balloc_range *r;
 
-	free_blocks = ext4_bg_get_free_blocks_count(bg_ref.block_group, sb);
-	if (free_blocks == 0) {
-		/* This group has no free blocks */
-		goto goal_failed;
+		r = ext4_realloc(fb->ranges, max * sizeof(*r));
+		if (!r)
+			return false;
+
+		fb->ranges = r;
+		fb->max = max;
 	}
 
-	/* Compute indexes */
-	ext4_fsblk_t first_in_bg;
-	first_in_bg = ext4_balloc_get_block_of_bgid(sb, bg_ref.index);
+	fb->ranges[fb->cnt].start = first;
+	fb->ranges[fb->cnt].len = count;
+	fb->cnt++;
+	return true;
+}
 
-	uint32_t first_in_bg_index;
-	first_in_bg_index = ext4_fs_addr_to_idx_bg(sb, first_in_bg);
+void ext4_balloc_free_batch_begin(struct ext4_fs *fs)
+{
+	fs->free_batch.depth++;
+}
+
+int ext4_balloc_free_batch_end(struct ext4_fs *fs)
+{
+	struct ext4_balloc_free_batch *fb = &fs->free_batch;
+	int rc = EOK;
 
-	if (idx_in_bg < first_in_bg_index)
-		idx_in_bg = first_in_bg_index;
+	ext4_assert(fb->depth);
+	if (--fb->depth)
+		return EOK;
 
-	/* Load block with bitmap */
-	bmp_blk_adr = ext4_bg_get_block_bitmap(bg_ref.block_group, sb);
+	if (fb->cnt)
+		rc = ext4_balloc_free_ranges(fs, fb->ranges, fb->cnt);
 
-	r = ext4_trans_block_get(inode_ref->fs->bdev, &b, bmp_blk_adr);
-	if (r != EOK) {
-		ext4_fs_put_block_group_ref(&bg_ref);
-		return r;
-	}
+	ext4_free(fb->ranges);
+	fb->ranges = NULL;
+	fb->cnt = 0;
+	fb->max = 0;
+	return rc;
+}
 
-	if (!ext4_balloc_verify_bitmap_csum(sb, bg, b.data)) {
-		ext4_dbg(DEBUG_BALLOC,
-			DBG_WARN "Bitmap checksum failed."
-			"Group: %" PRIu32"\n",
-			bg_ref.index);
-	}
+int ext4_balloc_free_block(struct ext4_inode_ref *inode_ref, ext4_fsblk_t baddr)
+{
+	return ext4_balloc_free_blocks(inode_ref, baddr, 1);
+}
 
-	/* Check if goal is free */
-	if (ext4_bmap_is_bit_clr(b.data, idx_in_bg)) {
-		ext4_bmap_bit_set(b.data, idx_in_bg);
-		ext4_balloc_set_bitmap_csum(sb, bg_ref.block_group,
-					    b.data);
-		ext4_trans_set_block_dirty(b.buf);
-		r = ext4_block_set(inode_ref->fs->bdev, &b);
-		if (r != EOK) {
-			ext4_fs_put_block_group_ref(&bg_ref);
-			return r;
-		}
+int ext4_balloc_free_blocks(struct ext4_inode_ref *inode_ref,
+			    ext4_fsblk_t first, uint32_t count)
+{
+	struct ext4_fs *fs = inode_ref->fs;
+	struct ext4_sblock *sb = &fs->sb;
+	struct ext4_balloc_range range = {
+		.start = first,
+		.len = count
+	};
 
-		alloc = ext4_fs_bg_idx_to_addr(sb, idx_in_bg, bg_id);
-		goto success;
+	int rc;
+
+	if (!count)
+		return EOK;
+
+	if (!fs->jbd_journal) {
+		rc = ext4_balloc_forget(fs, first, count);
+		if (rc != EOK)
+			return rc;
 	}
 
-	uint32_t blk_in_bg = ext4_blocks_in_group_cnt(sb, bg_id);
+	/* Update inode blocks count */
+	uint32_t block_size = ext4_sb_get_block_size(sb);
+	uint64_t ino_blocks = ext4_inode_get_blocks_count(sb, inode_ref->inode);
+	ino_blocks -= (uint64_t)count * (block_size / EXT4_INODE_BLOCK_SIZE);
+	ext4_inode_set_blocks_count(sb, inode_ref->inode, ino_blocks);
+	inode_ref->dirty = true;
 
-	uint32_t end_idx = (idx_in_bg + 63) & ~63;
-	if (end_idx > blk_in_bg)
-		end_idx = blk_in_bg;
+	/* Released together with the rest of the batch */
+	if (ext4_balloc_batch_add(fs, first, count))
+		return EOK;
 
-	/* Try to find free block near to goal */
-	uint32_t tmp_idx;
-	for (tmp_idx = idx_in_bg + 1; tmp_idx < end_idx; ++tmp_idx) {
-		if (ext4_bmap_is_bit_clr(b.data, tmp_idx)) {
-			ext4_bmap_bit_set(b.data, tmp_idx);
+	return ext4_balloc_free_ranges(fs, &range, 1);
+}
 
-			ext4_balloc_set_bitmap_csum(sb, bg, b.data);
-			ext4_trans_set_block_dirty(b.buf);
-			r = ext4_block_set(inode_ref->fs->bdev, &b);
-			if (r != EOK)
-				return r;
+/**@brief   Requests are served from the first free run at least this long
+ *          (or as long as the request), before falling back to any free
+ *          block near the goal.*/
+#define EXT4_BALLOC_GOOD_RUN 2048
+
+/**@brief   Mark free blocks starting at a clear bit as used.
+ * @param   bmap block bitmap
+ * @param   idx first (clear) bit
+ * @param   end bit past the end of the group
+ * @param   max maximum number of blocks to claim
+ * @return  number of blocks claimed*/
+static uint32_t ext4_balloc_claim(uint8_t *bmap, uint32_t idx, uint32_t end,
+				  uint32_t max)
+{
+	uint32_t stop;
 
-			alloc = ext4_fs_bg_idx_to_addr(sb, tmp_idx, bg_id);
-			goto success;
-		}
-	}
+	if (max > end - idx)
+		max = end - idx;
 
-	/* Find free bit in bitmap */
-	r = ext4_bmap_bit_find_clr(b.data, idx_in_bg, blk_in_bg, &rel_blk_idx);
-	if (r == EOK) {
-		ext4_bmap_bit_set(b.data, rel_blk_idx);
-		ext4_balloc_set_bitmap_csum(sb, bg_ref.block_group, b.data);
-		ext4_trans_set_block_dirty(b.buf);
-		r = ext4_block_set(inode_ref->fs->bdev, &b);
-		if (r != EOK)
-			return r;
+	if (ext4_bmap_bit_find_set(bmap, idx, idx + max, &stop) != EOK)
+		stop = idx + max;
 
-		alloc = ext4_fs_bg_idx_to_addr(sb, rel_blk_idx, bg_id);
-		goto success;
-	}
+	ext4_bmap_bits_set(bmap, idx, stop - idx);
+	return stop - idx;
+}
 
-	/* No free block found yet */
-	r = ext4_block_set(inode_ref->fs->bdev, &b);
-	if (r != EOK) {
-		ext4_fs_put_block_group_ref(&bg_ref);
-		return r;
-	}
+/**@brief   Allocate a run of blocks from a single block group.
+ * @param   inode_ref inode reference
+ * @param   bgid block group
+ * @param   goal preferred index in the group
+ * @param   at_goal goal group: a free goal block is taken regardless of @p min
+ * @param   min minimum run length
+ * @param   max_cnt maximum number of blocks
+ * @param   fblock first allocated block address
+ * @param   blk_cnt allocated blocks
+ * @return  standard error code, ENOSPC if the group can't serve the request*/
+static int ext4_balloc_alloc_in_group(struct ext4_inode_ref *inode_ref,
+				      uint32_t bgid, uint32_t goal,
+				      bool at_goal, uint32_t min,
+				      uint32_t max_cnt, ext4_fsblk_t *fblock,
+				      uint32_t *blk_cnt)
+{
+	struct ext4_fs *fs = inode_ref->fs;
+	struct ext4_sblock *sb = &fs->sb;
+	struct ext4_block_group_ref bg_ref;
+	struct ext4_block b;
+	uint32_t free_blocks, first_in_bg_index, blk_in_bg, idx, cnt;
+	int r, rc;
+
+#if CONFIG_BALLOC_INDEX_RUNS
+	struct ext4_balloc_group_index *gi = ext4_bidx_get(fs, bgid);
+	bool rebuilt = false;
 
-goal_failed:
+	/* Skip groups which can't serve the request without any I/O */
+	if (gi && !at_goal) {
+		if ((gi->flags & EXT4_BIDX_FREE) && gi->free < min)
+			return ENOSPC;
 
-	r = ext4_fs_put_block_group_ref(&bg_ref);
+		if ((gi->flags & EXT4_BIDX_BUILT) && gi->largest < min)
+			return ENOSPC;
+	}
+#endif
+
+	/* Load block group reference */
+	r = ext4_fs_get_block_group_ref(fs, bgid, &bg_ref);
 	if (r != EOK)
 		return r;
 
-	/* Try other block groups */
-	uint32_t block_group_count = ext4_block_group_cnt(sb);
-	uint32_t bgid = (bg_id + 1) % block_group_count;
-	uint32_t count = block_group_count;
-
-	while (count > 0) {
-		r = ext4_fs_get_block_group_ref(inode_ref->fs, bgid, &bg_ref);
-		if (r != EOK)
-			return r;
+	free_blocks = ext4_bg_get_free_blocks_count(bg_ref.block_group, sb);
+#if CONFIG_BALLOC_INDEX_RUNS
+	if (gi && !(gi->flags & EXT4_BIDX_BUILT)) {
+		gi->free = free_blocks;
+		gi->flags |= EXT4_BIDX_FREE;
+	}
+#endif
+	if (!free_blocks || (!at_goal && free_blocks < min)) {
+		r = ENOSPC;
+		goto out_bg;
+	}
 
-		struct ext4_bgroup *bg = bg_ref.block_group;
-		free_blocks = ext4_bg_get_free_blocks_count(bg, sb);
-		if (free_blocks == 0) {
-			/* This group has no free blocks */
-			goto next_group;
-		}
+	/* Compute indexes */
+	ext4_fsblk_t first_in_bg = ext4_balloc_get_block_of_bgid(sb, bgid);
+	first_in_bg_index = ext4_fs_addr_to_idx_bg(sb, first_in_bg);
+	blk_in_bg = ext4_blocks_in_group_cnt(sb, bgid);
+	if (goal < first_in_bg_index)
+		goal = first_in_bg_index;
 
-		/* Load block with bitmap */
-		bmp_blk_adr = ext4_bg_get_block_bitmap(bg, sb);
-		r = ext4_trans_block_get(inode_ref->fs->bdev, &b, bmp_blk_adr);
-		if (r != EOK) {
-			ext4_fs_put_block_group_ref(&bg_ref);
-			return r;
-		}
+	/* Load block with bitmap */
+	ext4_fsblk_t bmp_blk_adr;
+	bmp_blk_adr = ext4_bg_get_block_bitmap(bg_ref.block_group, sb);
+	r = ext4_trans_block_get(fs->bdev, &b, bmp_blk_adr);
+	if (r != EOK)
+		goto out_bg;
 
-		if (!ext4_balloc_verify_bitmap_csum(sb, bg, b.data)) {
-			ext4_dbg(DEBUG_BALLOC,
-				DBG_WARN "Bitmap checksum failed."
-				"Group: %" PRIu32"\n",
-				bg_ref.index);
-		}
+	ext4_bcache_set_flag(b.buf, BC_META);
 
-		/* Compute indexes */
-		first_in_bg = ext4_balloc_get_block_of_bgid(sb, bgid);
-		idx_in_bg = ext4_fs_addr_to_idx_bg(sb, first_in_bg);
-		blk_in_bg = ext4_blocks_in_group_cnt(sb, bgid);
-		first_in_bg_index = ext4_fs_addr_to_idx_bg(sb, first_in_bg);
-
-		if (idx_in_bg < first_in_bg_index)
-			idx_in_bg = first_in_bg_index;
-
-		r = ext4_bmap_bit_find_clr(b.data, idx_in_bg, blk_in_bg,
-				&rel_blk_idx);
-		if (r == EOK) {
-			ext4_bmap_bit_set(b.data, rel_blk_idx);
-			ext4_balloc_set_bitmap_csum(sb, bg, b.data);
-			ext4_trans_set_block_dirty(b.buf);
-			r = ext4_block_set(inode_ref->fs->bdev, &b);
-			if (r != EOK) {
-				ext4_fs_put_block_group_ref(&bg_ref);
-				return r;
-			}
+	if (!ext4_balloc_verify_bitmap_csum(sb, bg_ref.block_group, b.data)) {
+		ext4_dbg(DEBUG_BALLOC,
+			DBG_WARN "Bitmap checksum failed."
+			"Group: %" PRIu32"\n",
+			bg_ref.index);
+	}
 
-			alloc = ext4_fs_bg_idx_to_addr(sb, rel_blk_idx, bgid);
-			goto success;
-		}
+#if CONFIG_BALLOC_INDEX_RUNS
+	if (gi && !(gi->flags & (EXT4_BIDX_BUILT | EXT4_BIDX_NOINDEX)))
+		ext4_bidx_build(gi, b.data, first_in_bg_index, blk_in_bg);
 
-		r = ext4_block_set(inode_ref->fs->bdev, &b);
-		if (r != EOK) {
-			ext4_fs_put_block_group_ref(&bg_ref);
-			return r;
+pick:
+	if (gi && (gi->flags & EXT4_BIDX_BUILT)) {
+		if (!ext4_bidx_pick(gi, goal, at_goal, min, &idx)) {
+			r = ENOSPC;
+			goto out_bmap;
 		}
-
-	next_group:
-		r = ext4_fs_put_block_group_ref(&bg_ref);
-		if (r != EOK) {
-			return r;
+	} else
+#endif
+	{
+		/* Free goal block, then a long enough run after it or before */
+		if (at_goal && goal < blk_in_bg &&
+		    ext4_bmap_is_bit_clr(b.data, goal))
+			idx = goal;
+		else if (ext4_bmap_find_clr_run(b.data, goal, blk_in_bg, min,
+						&idx) != EOK &&
+			 ext4_bmap_find_clr_run(b.data, first_in_bg_index,
+						blk_in_bg, min, &idx) != EOK) {
+			r = ENOSPC;
+			goto out_bmap;
 		}
+	}
 
-		/* Goto next group */
-		bgid = (bgid + 1) % block_group_count;
-		count--;
+	cnt = ext4_balloc_claim(b.data, idx, blk_in_bg, max_cnt);
+#if CONFIG_BALLOC_INDEX_RUNS
+	if (!cnt && gi && !rebuilt) {
+		/* Index is out of sync with the bitmap: rebuild it */
+		ext4_bidx_build(gi, b.data, first_in_bg_index, blk_in_bg);
+		rebuilt = true;
+		goto pick;
 	}
 
-	return ENOSPC;
+	if (cnt)
+		ext4_bidx_claim(fs, bgid, idx, cnt);
+#endif
+	if (!cnt) {
+		r = ENOSPC;
+		goto out_bmap;
+	}
 
-success:
-    /* Empty command - because of syntax */
-    ;
+	ext4_balloc_set_bitmap_csum(sb, bg_ref.block_group, b.data);
+	ext4_trans_set_block_dirty(b.buf);
+	r = ext4_block_set(fs->bdev, &b);
+	if (r != EOK)
+		goto out_bg;
 
 	uint32_t block_size = ext4_sb_get_block_size(sb);
 
 	/* Update superblock free blocks count */
 	uint64_t sb_free_blocks = ext4_sb_get_free_blocks_cnt(sb);
-	sb_free_blocks--;
+	sb_free_blocks -= cnt;
 	ext4_sb_set_free_blocks_cnt(sb, sb_free_blocks);
 
 	/* Update inode blocks (different block size!) count */
 	uint64_t ino_blocks = ext4_inode_get_blocks_count(sb, inode_ref->inode);
-	ino_blocks += block_size / EXT4_INODE_BLOCK_SIZE;
+	ino_blocks += (uint64_t)cnt * (block_size / EXT4_INODE_BLOCK_SIZE);
 	ext4_inode_set_blocks_count(sb, inode_ref->inode, ino_blocks);
 	inode_ref->dirty = true;
 
 	/* Update block group free blocks count */
+	ext4_bg_set_free_blocks_count(bg_ref.block_group, sb,
+				      free_blocks - cnt);
+	bg_ref.dirty = true;
 
-	uint32_t fb_cnt = ext4_bg_get_free_blocks_count(bg_ref.block_group, sb);
-	fb_cnt--;
-	ext4_bg_set_free_blocks_count(bg_ref.block_group, sb, fb_cnt);
+	*fblock = ext4_fs_bg_idx_to_addr(sb, idx, bgid);
+	*blk_cnt = cnt;
+	if (fs->discard.cnt)
+		ext4_balloc_discard_cancel(fs, *fblock, cnt);
 
-	bg_ref.dirty = true;
-	r = ext4_fs_put_block_group_ref(&bg_ref);
+	return ext4_fs_put_block_group_ref(&bg_ref);
+
+out_bmap:
+	rc = ext4_block_set(fs->bdev, &b);
+	if (rc != EOK)
+		r = rc;
+out_bg:
+	rc = ext4_fs_put_block_group_ref(&bg_ref);
+	if (rc != EOK)
+		r = rc;
 
-	*fblock = alloc;
 	return r;
 }
 
+int ext4_balloc_alloc_blocks(struct ext4_inode_ref *inode_ref,
+			     ext4_fsblk_t goal,
+			     ext4_fsblk_t *fblock, uint32_t *blk_cnt)
+{
+	struct ext4_sblock *sb = &inode_ref->fs->sb;
+	uint32_t max_cnt = *blk_cnt ? *blk_cnt : 1;
+	uint32_t bg_cnt = ext4_block_group_cnt(sb);
+	uint32_t goal_bg = ext4_balloc_get_bgid_of_block(sb, goal);
+	uint32_t goal_idx = ext4_fs_addr_to_idx_bg(sb, goal);
+	uint32_t min, i;
+	int r;
+
+	if (goal_bg >= bg_cnt) {
+		goal_bg = 0;
+		goal_idx = 0;
+	}
+
+	/* Look for a long enough run first, then for any free block */
+	min = max_cnt < EXT4_BALLOC_GOOD_RUN ? max_cnt : EXT4_BALLOC_GOOD_RUN;
+	for (;;) {
+		/* Goal group first, then the following ones */
+		for (i = 0; i < bg_cnt; i++) {
+			r = ext4_balloc_alloc_in_group(inode_ref,
+						       (goal_bg + i) % bg_cnt,
+						       i ? 0 : goal_idx, !i,
+						       min, max_cnt, fblock,
+						       blk_cnt);
+			if (r != ENOSPC)
+				return r;
+		}
+
+		if (min == 1)
+			break;
+
+		min = 1;
+	}
+
+	return ENOSPC;
+}
+
+int ext4_balloc_alloc_block(struct ext4_inode_ref *inode_ref,
+			    ext4_fsblk_t goal,
+			    ext4_fsblk_t *fblock)
+{
+	uint32_t count = 1;
+
+	return ext4_balloc_alloc_blocks(inode_ref, goal, fblock, &count);
+}
+
 int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 				ext4_fsblk_t baddr, bool *free)
 {
@@ -607,6 +1165,8 @@ int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 		return rc;
 	}
 
+	ext4_bcache_set_flag(b.buf, BC_META);
+
 	if (!ext4_balloc_verify_bitmap_csum(sb, bg_ref.block_group, b.data)) {
 		ext4_dbg(DEBUG_BALLOC,
 			DBG_WARN "Bitmap checksum failed."
@@ -622,6 +1182,11 @@ int ext4_balloc_try_alloc_block(struct ext4_inode_ref *inode_ref,
 		ext4_bmap_bit_set(b.data, index_in_group);
 		ext4_balloc_set_bitmap_csum(sb, bg_ref.block_group, b.data);
 		ext4_trans_set_block_dirty(b.buf);
+#if CONFIG_BALLOC_INDEX_RUNS
+		ext4_bidx_claim(fs, block_group, index_in_group, 1);
+#endif
+		if (fs->discard.cnt)
+			ext4_balloc_discard_cancel(fs, baddr, 1);
 	}
 
 	/* Release block with bitmap */
@@ -660,6 +1225,105 @@ terminate:
 	return ext4_fs_put_block_group_ref(&bg_ref);
 }
 
+/**@brief   Discard free runs of a block group within [start, end).*/
+static int ext4_balloc_trim_group(struct ext4_fs *fs, uint32_t bgid,
+				  ext4_fsblk_t start, ext4_fsblk_t end,
+				  uint32_t minlen, uint64_t *trimmed)
+{
+	struct ext4_sblock *sb = &fs->sb;
+	struct ext4_block_group_ref bg_ref;
+	struct ext4_block b;
+	uint32_t blk_in_bg, idx, eidx, run;
+	int r, rc;
+
+	r = ext4_fs_get_block_group_ref(fs, bgid, &bg_ref);
+	if (r != EOK)
+		return r;
+
+	if (ext4_bg_get_free_blocks_count(bg_ref.block_group, sb) < minlen)
+		goto out_bg;
+
+	/* Part of the group within the range */
+	ext4_fsblk_t first_in_bg = ext4_balloc_get_block_of_bgid(sb, bgid);
+	blk_in_bg = ext4_blocks_in_group_cnt(sb, bgid);
+	idx = ext4_fs_addr_to_idx_bg(sb, start > first_in_bg ?
+					 start : first_in_bg);
+	eidx = blk_in_bg;
+	if (ext4_fs_bg_idx_to_addr(sb, eidx - 1, bgid) >= end)
+		eidx = ext4_fs_addr_to_idx_bg(sb, end - 1) + 1;
+
+	ext4_fsblk_t bmp_blk_adr;
+	bmp_blk_adr = ext4_bg_get_block_bitmap(bg_ref.block_group, sb);
+	r = ext4_trans_block_get(fs->bdev, &b, bmp_blk_adr);
+	if (r != EOK)
+		goto out_bg;
+
+	ext4_bcache_set_flag(b.buf, BC_META);
+
+	while (idx < eidx &&
+	       ext4_bmap_bit_find_clr(b.data, idx, eidx, &run) == EOK) {
+		if (ext4_bmap_bit_find_set(b.data, run, eidx, &idx) != EOK)
+			idx = eidx;
+
+		if (idx - run < minlen)
+			continue;
+
+		r = ext4_blocks_discard(fs->bdev,
+					ext4_fs_bg_idx_to_addr(sb, run, bgid),
+					idx - run);
+		if (r != EOK)
+			break;
+
+		*trimmed += idx - run;
+	}
+
+	rc = ext4_block_set(fs->bdev, &b);
+	if (rc != EOK)
+		r = rc;
+out_bg:
+	rc = ext4_fs_put_block_group_ref(&bg_ref);
+	if (rc != EOK)
+		r = rc;
+
+	return r;
+}
+
+int ext4_balloc_trim(struct ext4_fs *fs, ext4_fsblk_t start, uint64_t cnt,
+		     uint32_t minlen, uint64_t *trimmed)
+{
+	struct ext4_sblock *sb = &fs->sb;
+	uint64_t blocks_cnt = ext4_sb_get_blocks_cnt(sb);
+	uint32_t bg_cnt = ext4_block_group_cnt(sb);
+	ext4_fsblk_t end;
+	uint32_t bgid;
+	int r;
+
+	*trimmed = 0;
+	if (!fs->bdev->bdif->discard)
+		return ENOTSUP;
+
+	if (start < ext4_get32(sb, first_data_block))
+		start = ext4_get32(sb, first_data_block);
+
+	if (start >= blocks_cnt)
+		return EOK;
+
+	end = cnt > blocks_cnt - start ? blocks_cnt : start + cnt;
+	if (!minlen)
+		minlen = 1;
+
+	for (bgid = ext4_balloc_get_bgid_of_block(sb, start);
+	     bgid < bg_cnt && ext4_balloc_get_block_of_bgid(sb, bgid) < end;
+	     bgid++) {
+		r = ext4_balloc_trim_group(fs, bgid, start, end, minlen,
+					   trimmed);
+		if (r != EOK)
+			return r;
+	}
+
+	return EOK;
+}
+
 /**
  * @}
  */
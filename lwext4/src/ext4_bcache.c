@@ -44,28 +44,115 @@
 #include <string.h>
 #include <stdlib.h>
 
-static int ext4_bcache_lba_compare(struct ext4_buf *a, struct ext4_buf *b)
+/**@brief   Initial size of LBA hash table.*/
+#define EXT4_BCACHE_TAB_MIN 64
+
+static inline uint32_t ext4_bcache_hash(struct ext4_bcache *bc, uint64_t lba)
+{
+	/*Fibonacci hashing, table size is a power of 2*/
+	return (uint32_t)((lba * 0x9E3779B97F4A7C15ull) >> 32) &
+	       (bc->lba_tab_size - 1);
+}
+
+static void ext4_bcache_tab_put(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	uint32_t i = ext4_bcache_hash(bc, buf->lba);
+
+	while (bc->lba_tab[i])
+		i = (i + 1) & (bc->lba_tab_size - 1);
+
+	bc->lba_tab[i] = buf;
+}
+
+/**@brief   Resize LBA hash table, so it stays at most half full.*/
+static int ext4_bcache_tab_grow(struct ext4_bcache *bc)
+{
+	uint32_t i, old_size = bc->lba_tab_size;
+	struct ext4_buf **old_tab = bc->lba_tab;
+	uint32_t size = old_size ? old_size * 2 : EXT4_BCACHE_TAB_MIN;
+
+	bc->lba_tab = ext4_calloc(size, sizeof(struct ext4_buf *));
+	if (!bc->lba_tab) {
+		bc->lba_tab = old_tab;
+		return ENOMEM;
+	}
+
+	bc->lba_tab_size = size;
+	for (i = 0; i < old_size; i++) {
+		if (old_tab[i])
+			ext4_bcache_tab_put(bc, old_tab[i]);
+	}
+
+	ext4_free(old_tab);
+	return EOK;
+}
+
+static int ext4_bcache_tab_insert(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	/*Keep load factor <= 1/2. A fuller table still works, so growing
+	 * is allowed to fail as long as there is a free slot.*/
+	if (2 * (bc->ref_blocks + 1) > bc->lba_tab_size &&
+	    ext4_bcache_tab_grow(bc) != EOK &&
+	    bc->ref_blocks + 1 >= bc->lba_tab_size)
+		return ENOMEM;
+
+	ext4_bcache_tab_put(bc, buf);
+	return EOK;
+}
+
+static void ext4_bcache_tab_remove(struct ext4_bcache *bc,
+				   struct ext4_buf *buf)
+{
+	uint32_t mask = bc->lba_tab_size - 1;
+	uint32_t i = ext4_bcache_hash(bc, buf->lba);
+	uint32_t j, h;
+
+	while (bc->lba_tab[i] != buf) {
+		ext4_assert(bc->lba_tab[i]);
+		i = (i + 1) & mask;
+	}
+
+	/*Backward shift deletion: pull up following entries of the cluster
+	 * which would not be found anymore with a hole at i.*/
+	for (j = (i + 1) & mask; bc->lba_tab[j]; j = (j + 1) & mask) {
+		h = ext4_bcache_hash(bc, bc->lba_tab[j]->lba);
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			bc->lba_tab[i] = bc->lba_tab[j];
+			i = j;
+		}
+	}
+	bc->lba_tab[i] = NULL;
+}
+
+/**@brief   Unreferenced buffer queue of buf.*/
+static inline struct ext4_buf_lru *ext4_bcache_queue(struct ext4_bcache *bc,
+						     struct ext4_buf *buf)
 {
-	 if (a->lba > b->lba)
-		 return 1;
-	 else if (a->lba < b->lba)
-		 return -1;
-	 return 0;
+	return buf->lru_prio ? &bc->lru_list : &bc->a1_list;
 }
 
-static int ext4_bcache_lru_compare(struct ext4_buf *a, struct ext4_buf *b)
+/**@brief   Buffer is not referenced anymore, make it an eviction
+ *          candidate.*/
+static void ext4_bcache_lru_put(struct ext4_bcache *bc, struct ext4_buf *buf)
 {
-	if (a->lru_id > b->lru_id)
-		return 1;
-	else if (a->lru_id < b->lru_id)
-		return -1;
-	return 0;
+	if (!buf->lru_prio && ext4_bcache_test_flag(buf, BC_META)) {
+		buf->lru_prio = 1;
+		bc->a1_cnt--;
+	}
+
+	TAILQ_INSERT_TAIL(ext4_bcache_queue(bc, buf), buf, lru_node);
 }
 
-RB_GENERATE_INTERNAL(ext4_buf_lba, ext4_buf, lba_node,
-		     ext4_bcache_lba_compare, static inline)
-RB_GENERATE_INTERNAL(ext4_buf_lru, ext4_buf, lru_node,
-		     ext4_bcache_lru_compare, static inline)
+/**@brief   Unreferenced buffer is used again. Under 2Q this is the
+ *          second reference, so it leaves probation.*/
+static void ext4_bcache_lru_get(struct ext4_bcache *bc, struct ext4_buf *buf)
+{
+	TAILQ_REMOVE(ext4_bcache_queue(bc, buf), buf, lru_node);
+	if (!buf->lru_prio) {
+		buf->lru_prio = 1;
+		bc->a1_cnt--;
+	}
+}
 
 int ext4_bcache_init_dynamic(struct ext4_bcache *bc, uint32_t cnt,
 			     uint32_t itemsize)
@@ -78,14 +165,42 @@ int ext4_bcache_init_dynamic(struct ext4_bcache *bc, uint32_t cnt,
 	bc->itemsize = itemsize;
 	bc->ref_blocks = 0;
 	bc->max_ref_blocks = 0;
+	TAILQ_INIT(&bc->lru_list);
+	TAILQ_INIT(&bc->a1_list);
+	SLIST_INIT(&bc->slabs);
+	SLIST_INIT(&bc->free_list);
+
+	return ext4_bcache_set_policy(bc, BC_POLICY_DEFAULT);
+}
+
+int ext4_bcache_set_policy(struct ext4_bcache *bc, uint32_t policy)
+{
+	if (policy == BC_POLICY_DEFAULT)
+		policy = CONFIG_BLOCK_DEV_CACHE_POLICY;
 
+	if (policy != BC_POLICY_LRU && policy != BC_POLICY_2Q)
+		return EINVAL;
+
+	if (bc->ref_blocks)
+		return EBUSY;
+
+	bc->policy = policy;
 	return EOK;
 }
 
 void ext4_bcache_cleanup(struct ext4_bcache *bc)
 {
-	struct ext4_buf *buf, *tmp;
-	RB_FOREACH_SAFE(buf, ext4_buf_lba, &bc->lba_root, tmp) {
+	struct ext4_buf *buf;
+	uint32_t i = 0;
+
+	/*Dropping a buffer may shift the next one into the same slot*/
+	while (i < bc->lba_tab_size) {
+		buf = bc->lba_tab[i];
+		if (!buf) {
+			i++;
+			continue;
+		}
+
 		ext4_block_flush_buf(bc->bdev, buf);
 		ext4_bcache_drop_buf(bc, buf);
 	}
@@ -93,6 +208,15 @@ void ext4_bcache_cleanup(struct ext4_bcache *bc)
 
 int ext4_bcache_fini_dynamic(struct ext4_bcache *bc)
 {
+	struct ext4_bcache_slab *slab;
+
+	while (!SLIST_EMPTY(&bc->slabs)) {
+		slab = SLIST_FIRST(&bc->slabs);
+		SLIST_REMOVE_HEAD(&bc->slabs, node);
+		ext4_free(slab);
+	}
+
+	ext4_free(bc->lba_tab);
 	memset(bc, 0, sizeof(struct ext4_bcache));
 	return EOK;
 }
@@ -101,61 +225,155 @@ int ext4_bcache_fini_dynamic(struct ext4_bcache *bc)
  *
  *  This is ext4_bcache, the module handling basic buffer-cache stuff.
  *
- *  Buffers in a bcache are sorted by their LBA and stored in a
- *  RB-Tree(lba_root).
+ *  Buffers in a bcache are indexed by their LBA in an open addressing
+ *  hash table (lba_tab, linear probing).
  *
- *  Bcache also maintains another RB-Tree(lru_root) right now, where
- *  buffers are sorted by their LRU id.
+ *  Bcache also maintains a list(lru_list) of unreferenced buffers,
+ *  ordered from the least recently used one.
  *
  *  A singly-linked list is used to track those dirty buffers which are
  *  ready to be flushed. (Those buffers which are dirty but also referenced
  *  are not considered ready to be flushed.)
  *
- *  When a buffer is not referenced, it will be stored in both lba_root
- *  and lru_root, while it will only be stored in lba_root when it is
+ *  When a buffer is not referenced, it will be stored in both lba_tab
+ *  and lru_list, while it will only be stored in lba_tab when it is
  *  referenced.
  */
 
+/**@brief   Allocate new arena slab and put its buffers on free list.*/
+static int ext4_bcache_slab_alloc(struct ext4_bcache *bc)
+{
+	uint32_t i, n = CONFIG_BLOCK_DEV_CACHE_SLAB;
+	size_t hdr;
+	struct ext4_bcache_slab *slab;
+	struct ext4_buf *bufs;
+	uintptr_t data;
+
+	/*Small caches should not overshoot their capacity*/
+	if (n > bc->cnt)
+		n = bc->cnt;
+
+	hdr = sizeof(struct ext4_bcache_slab) + n * sizeof(struct ext4_buf);
+
+	slab = ext4_malloc(hdr + CONFIG_BLOCK_DEV_CACHE_ALIGN - 1 +
+			   (size_t)n * bc->itemsize);
+	if (!slab)
+		return ENOMEM;
+
+	slab->cnt = n;
+	slab->used = 0;
+	bufs = (struct ext4_buf *)(slab + 1);
+	data = ((uintptr_t)slab + hdr + CONFIG_BLOCK_DEV_CACHE_ALIGN - 1) &
+	       ~(uintptr_t)(CONFIG_BLOCK_DEV_CACHE_ALIGN - 1);
+
+	for (i = 0; i < n; i++) {
+		bufs[i].data = (uint8_t *)data + (size_t)i * bc->itemsize;
+		bufs[i].slab = slab;
+		SLIST_INSERT_HEAD(&bc->free_list, &bufs[i], dirty_node);
+	}
+
+	SLIST_INSERT_HEAD(&bc->slabs, slab, node);
+	bc->arena_cnt += n;
+	return EOK;
+}
+
+int ext4_bcache_reserve(struct ext4_bcache *bc, uint32_t cnt)
+{
+	while (bc->arena_cnt < cnt) {
+		int r = ext4_bcache_slab_alloc(bc);
+		if (r != EOK)
+			return r;
+	}
+	return EOK;
+}
+
+void ext4_bcache_trim(struct ext4_bcache *bc)
+{
+	struct ext4_bcache_slab *slab, *tmp;
+	struct ext4_buf *buf, *next;
+	struct ext4_buf_dirty keep;
+
+	/*Unlink free buffers living in empty slabs*/
+	SLIST_INIT(&keep);
+	SLIST_FOREACH_SAFE(buf, &bc->free_list, dirty_node, next) {
+		if (buf->slab->used)
+			SLIST_INSERT_HEAD(&keep, buf, dirty_node);
+	}
+	bc->free_list = keep;
+
+	SLIST_FOREACH_SAFE(slab, &bc->slabs, node, tmp) {
+		if (slab->used)
+			continue;
+
+		SLIST_REMOVE(&bc->slabs, slab, ext4_bcache_slab, node);
+		bc->arena_cnt -= slab->cnt;
+		ext4_free(slab);
+	}
+}
+
 static struct ext4_buf *
 ext4_buf_alloc(struct ext4_bcache *bc, uint64_t lba)
 {
-	void *data;
 	struct ext4_buf *buf;
-	data = ext4_malloc(bc->itemsize);
-	if (!data)
-		return NULL;
+	struct ext4_bcache_slab *slab;
+	uint8_t *data;
 
-	buf = ext4_calloc(1, sizeof(struct ext4_buf));
-	if (!buf) {
-		ext4_free(data);
+	if (SLIST_EMPTY(&bc->free_list) && ext4_bcache_slab_alloc(bc) != EOK)
 		return NULL;
-	}
+
+	buf = SLIST_FIRST(&bc->free_list);
+	SLIST_REMOVE_HEAD(&bc->free_list, dirty_node);
+
+	data = buf->data;
+	slab = buf->slab;
+	memset(buf, 0, sizeof(struct ext4_buf));
 
 	buf->lba = lba;
 	buf->data = data;
+	buf->slab = slab;
 	buf->bc = bc;
+	slab->used++;
 	return buf;
 }
 
 static void ext4_buf_free(struct ext4_buf *buf)
 {
-	ext4_free(buf->data);
-	ext4_free(buf);
+	struct ext4_bcache *bc = buf->bc;
+
+	buf->slab->used--;
+	SLIST_INSERT_HEAD(&bc->free_list, buf, dirty_node);
 }
 
 static struct ext4_buf *
 ext4_buf_lookup(struct ext4_bcache *bc, uint64_t lba)
 {
-	struct ext4_buf tmp = {
-		.lba = lba
-	};
+	struct ext4_buf *buf;
+	uint32_t i;
+
+	if (!bc->lba_tab_size)
+		return NULL;
+
+	i = ext4_bcache_hash(bc, lba);
+	while ((buf = bc->lba_tab[i]) != NULL) {
+		if (buf->lba == lba)
+			return buf;
 
-	return RB_FIND(ext4_buf_lba, &bc->lba_root, &tmp);
+		i = (i + 1) & (bc->lba_tab_size - 1);
+	}
+	return NULL;
 }
 
 struct ext4_buf *ext4_buf_lowest_lru(struct ext4_bcache *bc)
 {
-	return RB_MIN(ext4_buf_lru, &bc->lru_root);
+	struct ext4_buf *a1 = TAILQ_FIRST(&bc->a1_list);
+	struct ext4_buf *am = TAILQ_FIRST(&bc->lru_list);
+
+	/*2Q: probation takes the hit while it holds more than 1/4 of the
+	 * cache, so one-time blocks can't push out the main queue.*/
+	if (a1 && (!am || bc->a1_cnt > bc->cnt / 4))
+		return a1;
+
+	return am ? am : a1;
 }
 
 void ext4_bcache_drop_buf(struct ext4_bcache *bc, struct ext4_buf *buf)
@@ -166,9 +384,12 @@ void ext4_bcache_drop_buf(struct ext4_bcache *bc, struct ext4_buf *buf)
 				"lba: %" PRIu64 ", refctr: %" PRIu32 "\n",
 				buf->lba, buf->refctr);
 	} else
-		RB_REMOVE(ext4_buf_lru, &bc->lru_root, buf);
+		TAILQ_REMOVE(ext4_bcache_queue(bc, buf), buf, lru_node);
+
+	if (!buf->lru_prio)
+		bc->a1_cnt--;
 
-	RB_REMOVE(ext4_buf_lba, &bc->lba_root, buf);
+	ext4_bcache_tab_remove(bc, buf);
 
 	/*Forcibly drop dirty buffer.*/
 	if (ext4_bcache_test_flag(buf, BC_DIRTY))
@@ -183,6 +404,7 @@ void ext4_bcache_invalidate_buf(struct ext4_bcache *bc,
 {
 	buf->end_write = NULL;
 	buf->end_write_arg = NULL;
+	ext4_bcache_clear_flag(buf, BC_WRITEBACK);
 
 	/* Clear both dirty and up-to-date flags. */
 	if (ext4_bcache_test_flag(buf, BC_DIRTY))
@@ -196,12 +418,23 @@ void ext4_bcache_invalidate_lba(struct ext4_bcache *bc,
 				uint32_t cnt)
 {
 	uint64_t end = from + cnt - 1;
-	struct ext4_buf *tmp = ext4_buf_lookup(bc, from), *buf;
-	RB_FOREACH_FROM(buf, ext4_buf_lba, tmp) {
-		if (buf->lba > end)
-			break;
+	struct ext4_buf *buf;
+	uint32_t i;
+
+	/*Short range: probe every block, otherwise scan the whole table*/
+	if (cnt <= bc->ref_blocks) {
+		for (i = 0; i < cnt; i++) {
+			buf = ext4_buf_lookup(bc, from + i);
+			if (buf)
+				ext4_bcache_invalidate_buf(bc, buf);
+		}
+		return;
+	}
 
-		ext4_bcache_invalidate_buf(bc, buf);
+	for (i = 0; i < bc->lba_tab_size; i++) {
+		buf = bc->lba_tab[i];
+		if (buf && buf->lba >= from && buf->lba <= end)
+			ext4_bcache_invalidate_buf(bc, buf);
 	}
 }
 
@@ -211,12 +444,13 @@ ext4_bcache_find_get(struct ext4_bcache *bc, struct ext4_block *b,
 {
 	struct ext4_buf *buf = ext4_buf_lookup(bc, lba);
 	if (buf) {
+		/* Buffer might be modified, a pending batched flush
+		 * must not mark it clean. */
+		ext4_bcache_clear_flag(buf, BC_WRITEBACK);
+
 		/* If buffer is not referenced. */
 		if (!buf->refctr) {
-			/* Assign new value to LRU id and increment LRU counter
-			 * by 1*/
-			buf->lru_id = ++bc->lru_ctr;
-			RB_REMOVE(ext4_buf_lru, &bc->lru_root, buf);
+			ext4_bcache_lru_get(bc, buf);
 			if (ext4_bcache_test_flag(buf, BC_DIRTY))
 				ext4_bcache_remove_dirty_node(bc, buf);
 
@@ -237,6 +471,7 @@ int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 	/* Try to search the buffer with exaxt LBA. */
 	struct ext4_buf *buf = ext4_bcache_find_get(bc, b, b->lb_id);
 	if (buf) {
+		bc->hit_ctr++;
 		*is_new = false;
 		return EOK;
 	}
@@ -246,7 +481,13 @@ int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 	if (!buf)
 		return ENOMEM;
 
-	RB_INSERT(ext4_buf_lba, &bc->lba_root, buf);
+	if (ext4_bcache_tab_insert(bc, buf) != EOK) {
+		ext4_buf_free(buf);
+		return ENOMEM;
+	}
+
+	bc->miss_ctr++;
+
 	/* One more buffer in bcache now. :-) */
 	bc->ref_blocks++;
 
@@ -256,9 +497,12 @@ int ext4_bcache_alloc(struct ext4_bcache *bc, struct ext4_block *b,
 
 
 	ext4_bcache_inc_ref(buf);
-	/* Assign new value to LRU id and increment LRU counter
-	 * by 1*/
-	buf->lru_id = ++bc->lru_ctr;
+
+	/*New buffers start in probation under 2Q*/
+	if (bc->policy == BC_POLICY_2Q)
+		bc->a1_cnt++;
+	else
+		buf->lru_prio = 1;
 
 	b->buf = buf;
 	b->data = buf->data;
@@ -287,7 +531,7 @@ int ext4_bcache_free(struct ext4_bcache *bc, struct ext4_block *b)
 
 	/* We are the last one touching this buffer, do the cleanups. */
 	if (!buf->refctr) {
-		RB_INSERT(ext4_buf_lru, &bc->lru_root, buf);
+		ext4_bcache_lru_put(bc, buf);
 		/* This buffer is ready to be flushed. */
 		if (ext4_bcache_test_flag(buf, BC_DIRTY) &&
 		    ext4_bcache_test_flag(buf, BC_UPTODATE)) {
@@ -42,116 +42,269 @@
 
 #include "ext4_bitmap.h"
 
-void ext4_bmap_bits_free(uint8_t *bmap, uint32_t sbit, uint32_t bcnt)
+#include <string.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+/**@brief   Load up to 64 bitmap bits, bit n of the word is bit n of the map.
+ * @param   p first byte
+ * @param   bytes number of bytes to load (1 - 8)*/
+static inline uint64_t ext4_bmap_load(const uint8_t *p, uint32_t bytes)
 {
-	uint32_t i = sbit;
+	uint64_t w = 0;
+
+	if (bytes >= sizeof(w)) {
+		memcpy(&w, p, sizeof(w));
+		return to_le64(w);
+	}
 
-	while (i & 7) {
+	while (bytes--)
+		w |= (uint64_t)p[bytes] << (bytes * 8);
 
-		if (!bcnt)
-			return;
+	return w;
+}
+
+/**@brief   Index of the lowest set bit of a non zero word.*/
+static inline uint32_t ext4_bmap_ctz64(uint64_t w)
+{
+#if defined(__GNUC__)
+	return (uint32_t)__builtin_ctzll(w);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	unsigned long i;
 
-		ext4_bmap_bit_clr(bmap, i);
+	_BitScanForward64(&i, w);
+	return (uint32_t)i;
+#else
+	uint32_t i = 0;
 
-		bcnt--;
+	while (!(w & 1)) {
+		w >>= 1;
 		i++;
 	}
-	sbit = i;
-	bmap += (sbit >> 3);
-
-#if CONFIG_UNALIGNED_ACCESS
-	while (bcnt >= 32) {
-		*(uint32_t *)bmap = 0;
-		bmap += 4;
-		bcnt -= 32;
-		sbit += 32;
-	}
+	return i;
+#endif
+}
 
-	while (bcnt >= 16) {
-		*(uint16_t *)bmap = 0;
-		bmap += 2;
-		bcnt -= 16;
-		sbit += 16;
-	}
+/**@brief   Count leading bytes equal to @p fill, in 8 byte steps.
+ * @param   p first byte (any alignment)
+ * @param   bytes number of bytes available
+ * @param   fill 0x00 or 0xFF
+ * @return  number of skipped bytes (multiple of 8)*/
+static uint32_t ext4_bmap_skip_generic(const uint8_t *p, uint32_t bytes,
+				       uint8_t fill)
+{
+	uint64_t pattern = fill ? ~(uint64_t)0 : 0;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= bytes; i += 8)
+		if (ext4_bmap_load(p + i, 8) != pattern)
+			break;
+
+	return i;
+}
+
+#if CONFIG_BITMAP_AVX2 && (defined(__x86_64__) || defined(_M_X64)) &&        \
+    (defined(__GNUC__) || defined(_MSC_VER))
+
+#include <immintrin.h>
+#ifdef _MSC_VER
+#define BITMAP_AVX2_FN
+#else
+#define BITMAP_AVX2_FN __attribute__((target("avx2")))
 #endif
 
-	while (bcnt >= 8) {
-		*bmap = 0;
-		bmap += 1;
-		bcnt -= 8;
-		sbit += 8;
+static BITMAP_AVX2_FN uint32_t ext4_bmap_skip_avx2(const uint8_t *p,
+						   uint32_t bytes,
+						   uint8_t fill)
+{
+	const __m256i pattern = _mm256_set1_epi8((char)fill);
+	uint32_t i;
+
+	/*32 bytes (256 bits) per step, two steps per iteration*/
+	for (i = 0; i + 64 <= bytes; i += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 32));
+		__m256i eq = _mm256_and_si256(_mm256_cmpeq_epi8(a, pattern),
+					      _mm256_cmpeq_epi8(b, pattern));
+		if ((uint32_t)_mm256_movemask_epi8(eq) != 0xFFFFFFFF)
+			break;
 	}
 
-	for (i = 0; i < bcnt; ++i) {
-		ext4_bmap_bit_clr(bmap, i);
+	for (; i + 32 <= bytes; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+		if ((uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(a, pattern)) != 0xFFFFFFFF)
+			break;
 	}
+
+	return i + ext4_bmap_skip_generic(p + i, bytes - i, fill);
 }
 
-int ext4_bmap_bit_find_clr(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
-			   uint32_t *bit_id)
+static bool ext4_bmap_have_avx2(void)
 {
-	uint32_t i;
-	uint32_t bcnt = ebit - sbit;
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	/*OSXSAVE and AVX, then YMM state enabled by the OS*/
+	if ((info[2] & (1 << 27 | 1 << 28)) != (1 << 27 | 1 << 28))
+		return false;
+
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+static uint32_t ext4_bmap_skip_dispatch(const uint8_t *p, uint32_t bytes,
+					uint8_t fill);
+
+/**@brief   Selected skip implementation (resolved on first use).*/
+static uint32_t (*ext4_bmap_skip)(const uint8_t *, uint32_t, uint8_t) =
+    ext4_bmap_skip_dispatch;
+
+static uint32_t ext4_bmap_skip_dispatch(const uint8_t *p, uint32_t bytes,
+					uint8_t fill)
+{
+	uint32_t (*impl)(const uint8_t *, uint32_t, uint8_t) =
+	    ext4_bmap_skip_generic;
+
+#ifdef BITMAP_AVX2_FN
+	if (ext4_bmap_have_avx2())
+		impl = ext4_bmap_skip_avx2;
+#endif
+
+	ext4_bmap_skip = impl;
+	return impl(p, bytes, fill);
+}
+
+/**@brief   Find the first bit of the given value in [sbit, ebit).*/
+static int ext4_bmap_find(const uint8_t *bmap, uint32_t sbit, uint32_t ebit,
+			  bool set, uint32_t *bit_id)
+{
+	uint64_t inv = set ? 0 : ~(uint64_t)0;
+	uint32_t i = sbit & ~63u;
+	bool skipped = false;
 
-	i = sbit;
+	while (i < ebit) {
+		uint32_t left = ebit - i;
+		uint64_t w;
 
-	while (i & 7) {
+		w = ext4_bmap_load(bmap + (i >> 3), left >= 64 ? 8 : (left + 7) >> 3);
+		w ^= inv;
+		if (i < sbit)
+			w &= ~(uint64_t)0 << (sbit - i);
 
-		if (!bcnt)
-			return ENOSPC;
+		if (left < 64)
+			w &= ((uint64_t)1 << left) - 1;
 
-		if (ext4_bmap_is_bit_clr(bmap, i)) {
-			*bit_id = sbit;
+		if (w) {
+			*bit_id = i + ext4_bmap_ctz64(w);
 			return EOK;
 		}
 
-		i++;
-		bcnt--;
+		i += 64;
+
+		/*Jump over the uniform area following the first word*/
+		if (!skipped && ebit > i && ebit - i >= 512) {
+			i += 8 * ext4_bmap_skip(bmap + (i >> 3), (ebit - i) >> 3,
+						set ? 0x00 : 0xFF);
+			skipped = true;
+		}
 	}
 
-	sbit = i;
-	bmap += (sbit >> 3);
+	return ENOSPC;
+}
+
+/**@brief   Set or clear bits [sbit, sbit + bcnt).*/
+static void ext4_bmap_bits_fill(uint8_t *bmap, uint32_t sbit, uint32_t bcnt,
+				bool set)
+{
+	uint32_t ebit = sbit + bcnt;
+	uint8_t mask;
 
-#if CONFIG_UNALIGNED_ACCESS
-	while (bcnt >= 32) {
-		if (*(uint32_t *)bmap != 0xFFFFFFFF)
-			goto finish_it;
+	if (!bcnt)
+		return;
 
-		bmap += 4;
-		bcnt -= 32;
-		sbit += 32;
-	}
+	/*Head: bits of a partial first byte*/
+	if (sbit & 7) {
+		mask = (uint8_t)(0xFF << (sbit & 7));
+		if ((sbit >> 3) == (ebit >> 3))
+			mask &= (uint8_t)((1 << (ebit & 7)) - 1);
 
-	while (bcnt >= 16) {
-		if (*(uint16_t *)bmap != 0xFFFF)
-			goto finish_it;
+		if (set)
+			bmap[sbit >> 3] |= mask;
+		else
+			bmap[sbit >> 3] &= (uint8_t)~mask;
 
-		bmap += 2;
-		bcnt -= 16;
-		sbit += 16;
+		sbit = (sbit + 8) & ~7u;
+		if (sbit >= ebit)
+			return;
 	}
-finish_it:
-#endif
-	while (bcnt >= 8) {
-		if (*bmap != 0xFF) {
-			for (i = 0; i < 8; ++i) {
-				if (ext4_bmap_is_bit_clr(bmap, i)) {
-					*bit_id = sbit + i;
-					return EOK;
-				}
-			}
-		}
 
-		bmap += 1;
-		bcnt -= 8;
-		sbit += 8;
+	/*Whole bytes*/
+	memset(bmap + (sbit >> 3), set ? 0xFF : 0x00, (ebit >> 3) - (sbit >> 3));
+
+	/*Tail: bits of a partial last byte*/
+	if (ebit & 7) {
+		mask = (uint8_t)((1 << (ebit & 7)) - 1);
+		if (set)
+			bmap[ebit >> 3] |= mask;
+		else
+			bmap[ebit >> 3] &= (uint8_t)~mask;
 	}
+}
 
-	for (i = 0; i < bcnt; ++i) {
-		if (ext4_bmap_is_bit_clr(bmap, i)) {
-			*bit_id = sbit + i;
+void ext4_bmap_bits_free(uint8_t *bmap, uint32_t sbit, uint32_t bcnt)
+{
+	ext4_bmap_bits_fill(bmap, sbit, bcnt, false);
+}
+
+void ext4_bmap_bits_set(uint8_t *bmap, uint32_t sbit, uint32_t bcnt)
+{
+	ext4_bmap_bits_fill(bmap, sbit, bcnt, true);
+}
+
+int ext4_bmap_bit_find_clr(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
+			   uint32_t *bit_id)
+{
+	return ext4_bmap_find(bmap, sbit, ebit, false, bit_id);
+}
+
+int ext4_bmap_bit_find_set(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
+			   uint32_t *bit_id)
+{
+	return ext4_bmap_find(bmap, sbit, ebit, true, bit_id);
+}
+
+int ext4_bmap_find_clr_run(uint8_t *bmap, uint32_t sbit, uint32_t ebit,
+			   uint32_t len, uint32_t *bit_id)
+{
+	uint32_t start, end, lim;
+
+	while (sbit < ebit) {
+		if (ext4_bmap_find(bmap, sbit, ebit, false, &start) != EOK)
+			break;
+
+		if (ebit - start < len)
+			break;
+
+		/*Only the first len bits matter*/
+		lim = start + len;
+		if (ext4_bmap_find(bmap, start, lim, true, &end) != EOK) {
+			*bit_id = start;
 			return EOK;
 		}
+
+		sbit = end + 1;
 	}
 
 	return ENOSPC;
@@ -85,6 +85,56 @@ static int ext4_bdif_bwrite(struct ext4_blockdev *bdev, const void *buf,
 	return r;
 }
 
+static int ext4_bdif_bwritev(struct ext4_blockdev *bdev,
+			     const struct ext4_blockdev_iovec *iov,
+			     uint32_t iov_cnt, uint64_t blk_id)
+{
+	ext4_bdif_lock(bdev);
+	int r = bdev->bdif->bwritev(bdev, iov, iov_cnt, blk_id);
+	bdev->bdif->bwrite_ctr++;
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
+static int ext4_bdif_discard(struct ext4_blockdev *bdev, uint64_t blk_id,
+			     uint64_t blk_cnt)
+{
+	ext4_bdif_lock(bdev);
+	int r = bdev->bdif->discard(bdev, blk_id, blk_cnt);
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
+static bool ext4_bdif_reads_zero(struct ext4_blockdev *bdev, uint64_t blk_id,
+				 uint64_t blk_cnt)
+{
+	ext4_bdif_lock(bdev);
+	bool r = bdev->bdif->reads_zero(bdev, blk_id, blk_cnt);
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
+static int ext4_bdif_submit(struct ext4_blockdev *bdev,
+			    struct ext4_blockdev_req *req)
+{
+	ext4_bdif_lock(bdev);
+	int r = bdev->bdif->submit(bdev, req);
+	if (req->write)
+		bdev->bdif->bwrite_ctr++;
+	else
+		bdev->bdif->bread_ctr++;
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
+static int ext4_bdif_wait(struct ext4_blockdev *bdev)
+{
+	ext4_bdif_lock(bdev);
+	int r = bdev->bdif->wait(bdev);
+	ext4_bdif_unlock(bdev);
+	return r;
+}
+
 int ext4_block_init(struct ext4_blockdev *bdev)
 {
 	int rc;
@@ -143,31 +193,36 @@ int ext4_block_fini(struct ext4_blockdev *bdev)
 	return bdev->bdif->close(bdev);
 }
 
+static void ext4_block_end_write(struct ext4_blockdev *bdev,
+				 struct ext4_buf *buf, int r)
+{
+	struct ext4_bcache *bc = bdev->bc;
+	bool dont_shake = bc->dont_shake;
+
+	/*Any pending batched write of this buffer is superseded*/
+	ext4_bcache_clear_flag(buf, BC_WRITEBACK);
+	if (r == EOK) {
+		ext4_bcache_remove_dirty_node(bc, buf);
+		ext4_bcache_clear_flag(buf, BC_DIRTY);
+	}
+
+	if (buf->end_write) {
+		bc->dont_shake = true;
+		buf->end_write(bc, buf, r, buf->end_write_arg);
+		bc->dont_shake = dont_shake;
+	}
+}
+
 int ext4_block_flush_buf(struct ext4_blockdev *bdev, struct ext4_buf *buf)
 {
 	int r;
-	struct ext4_bcache *bc = bdev->bc;
 
 	if (ext4_bcache_test_flag(buf, BC_DIRTY) &&
 	    ext4_bcache_test_flag(buf, BC_UPTODATE)) {
 		r = ext4_blocks_set_direct(bdev, buf->data, buf->lba, 1);
-		if (r) {
-			if (buf->end_write) {
-				bc->dont_shake = true;
-				buf->end_write(bc, buf, r, buf->end_write_arg);
-				bc->dont_shake = false;
-			}
-
+		ext4_block_end_write(bdev, buf, r);
+		if (r)
 			return r;
-		}
-
-		ext4_bcache_remove_dirty_node(bc, buf);
-		ext4_bcache_clear_flag(buf, BC_DIRTY);
-		if (buf->end_write) {
-			bc->dont_shake = true;
-			buf->end_write(bc, buf, r, buf->end_write_arg);
-			bc->dont_shake = false;
-		}
 	}
 	return EOK;
 }
@@ -194,11 +249,11 @@ int ext4_block_cache_shake(struct ext4_blockdev *bdev)
 
 	bdev->bc->dont_shake = true;
 
-	while (!RB_EMPTY(&bdev->bc->lru_root) &&
-		ext4_bcache_is_full(bdev->bc)) {
-
+	while (ext4_bcache_is_full(bdev->bc)) {
 		buf = ext4_buf_lowest_lru(bdev->bc);
-		ext4_assert(buf);
+		if (!buf)
+			break;
+
 		if (ext4_bcache_test_flag(buf, BC_DIRTY)) {
 			r = ext4_block_flush_buf(bdev, buf);
 			if (r != EOK)
@@ -308,6 +363,132 @@ int ext4_blocks_set_direct(struct ext4_blockdev *bdev, const void *buf,
 	return ext4_bdif_bwrite(bdev, buf, pba, pb_cnt * cnt);
 }
 
+int ext4_blocks_submit(struct ext4_blockdev *bdev,
+		       struct ext4_blockdev_req *req, bool write,
+		       void *buf, uint64_t lba, uint32_t cnt)
+{
+	uint32_t pb_cnt;
+
+	ext4_assert(bdev && req && buf);
+
+	req->write = write;
+	req->buf = buf;
+	req->blk_id = (lba * bdev->lg_bsize + bdev->part_offset) /
+		      bdev->bdif->ph_bsize;
+	pb_cnt = bdev->lg_bsize / bdev->bdif->ph_bsize;
+	req->blk_cnt = pb_cnt * cnt;
+	req->res = EOK;
+
+	if (bdev->bdif->submit)
+		return ext4_bdif_submit(bdev, req);
+
+	/*No asynchronous interface, complete request right now*/
+	if (write)
+		req->res = ext4_bdif_bwrite(bdev, buf, req->blk_id,
+					    req->blk_cnt);
+	else
+		req->res = ext4_bdif_bread(bdev, buf, req->blk_id,
+					   req->blk_cnt);
+
+	if (req->end_io)
+		req->end_io(bdev, req);
+
+	return EOK;
+}
+
+int ext4_blocks_wait(struct ext4_blockdev *bdev)
+{
+	ext4_assert(bdev);
+
+	if (!bdev->bdif->submit)
+		return EOK;
+
+	return ext4_bdif_wait(bdev);
+}
+
+/**@brief   Requests queued at once by @ref ext4_blocks_zero.*/
+#define EXT4_BLOCKS_ZERO_REQS 8
+
+int ext4_blocks_zero(struct ext4_blockdev *bdev, uint64_t lba, uint32_t cnt)
+{
+	struct ext4_blockdev_req reqs[EXT4_BLOCKS_ZERO_REQS];
+	uint32_t run = CONFIG_BLOCK_DEV_ZERO_RUN;
+	uint32_t i, n, c;
+	uint8_t *mem, *zero;
+	int r = EOK, rr;
+
+	ext4_assert(bdev);
+
+	if (!cnt)
+		return EOK;
+
+	/*Cached copies would overwrite zeroes later*/
+	if (bdev->bc)
+		ext4_bcache_invalidate_lba(bdev->bc, lba, cnt);
+
+	/*Holes of sparse images need no writes*/
+	if (bdev->bdif->reads_zero) {
+		uint64_t pba = (lba * bdev->lg_bsize + bdev->part_offset) /
+			       bdev->bdif->ph_bsize;
+		uint32_t pb_cnt = bdev->lg_bsize / bdev->bdif->ph_bsize;
+
+		if (ext4_bdif_reads_zero(bdev, pba, (uint64_t)pb_cnt * cnt))
+			return EOK;
+	}
+
+	if (run > cnt)
+		run = cnt;
+
+	mem = ext4_calloc(1, (size_t)run * bdev->lg_bsize +
+			     CONFIG_BLOCK_DEV_CACHE_ALIGN - 1);
+	if (!mem)
+		return ENOMEM;
+
+	zero = (uint8_t *)(((uintptr_t)mem + CONFIG_BLOCK_DEV_CACHE_ALIGN - 1) &
+			   ~(uintptr_t)(CONFIG_BLOCK_DEV_CACHE_ALIGN - 1));
+
+	memset(reqs, 0, sizeof(reqs));
+	while (cnt && r == EOK) {
+		for (n = 0; n < EXT4_BLOCKS_ZERO_REQS && cnt; n++) {
+			c = cnt > run ? run : cnt;
+			r = ext4_blocks_submit(bdev, &reqs[n], true, zero, lba,
+					       c);
+			if (r != EOK)
+				break;
+
+			lba += c;
+			cnt -= c;
+		}
+
+		rr = ext4_blocks_wait(bdev);
+		if (r == EOK)
+			r = rr;
+
+		for (i = 0; i < n && r == EOK; i++)
+			r = reqs[i].res;
+	}
+
+	ext4_free(mem);
+	return r;
+}
+
+int ext4_blocks_discard(struct ext4_blockdev *bdev, uint64_t lba,
+			uint64_t cnt)
+{
+	uint64_t pba;
+	uint32_t pb_cnt;
+
+	ext4_assert(bdev);
+
+	if (!bdev->bdif->discard)
+		return ENOTSUP;
+
+	pba = (lba * bdev->lg_bsize + bdev->part_offset) / bdev->bdif->ph_bsize;
+	pb_cnt = bdev->lg_bsize / bdev->bdif->ph_bsize;
+
+	return ext4_bdif_discard(bdev, pba, pb_cnt * cnt);
+}
+
 int ext4_block_writebytes(struct ext4_blockdev *bdev, uint64_t off,
 			  const void *buf, uint32_t len)
 {
@@ -443,7 +624,7 @@ int ext4_block_readbytes(struct ext4_blockdev *bdev, uint64_t off, void *buf,
 	return r;
 }
 
-int ext4_block_cache_flush(struct ext4_blockdev *bdev)
+static int ext4_block_cache_flush_seq(struct ext4_blockdev *bdev)
 {
 	while (!SLIST_EMPTY(&bdev->bc->dirty_list)) {
 		int r;
@@ -457,6 +638,298 @@ int ext4_block_cache_flush(struct ext4_blockdev *bdev)
 	return EOK;
 }
 
+static int ext4_buf_lba_cmp(const void *a, const void *b)
+{
+	const struct ext4_buf *buf_a = *(struct ext4_buf *const *)a;
+	const struct ext4_buf *buf_b = *(struct ext4_buf *const *)b;
+
+	if (buf_a->lba < buf_b->lba)
+		return -1;
+
+	return buf_a->lba > buf_b->lba;
+}
+
+/**@brief   Collect dirty buffers ready for write, sorted by LBA.
+ * @param   bc block cache descriptor
+ * @param   cnt number of returned buffers
+ * @return  buffer array (ext4_free by caller), NULL if empty or no memory*/
+static struct ext4_buf **ext4_block_dirty_sorted(struct ext4_bcache *bc,
+						 uint32_t *cnt)
+{
+	uint32_t i = 0;
+	struct ext4_buf *buf;
+	struct ext4_buf **bufs;
+
+	*cnt = 0;
+	SLIST_FOREACH(buf, &bc->dirty_list, dirty_node)
+		i++;
+
+	if (!i)
+		return NULL;
+
+	bufs = ext4_malloc(i * sizeof(struct ext4_buf *));
+	if (!bufs)
+		return NULL;
+
+	i = 0;
+	SLIST_FOREACH(buf, &bc->dirty_list, dirty_node) {
+		if (ext4_bcache_test_flag(buf, BC_UPTODATE))
+			bufs[i++] = buf;
+	}
+
+	qsort(bufs, i, sizeof(struct ext4_buf *), ext4_buf_lba_cmp);
+	*cnt = i;
+	return bufs;
+}
+
+/**@brief   Length of the run of dirty buffers with consecutive LBAs.*/
+static uint32_t ext4_block_run_len(struct ext4_buf **bufs, uint32_t cnt)
+{
+	uint32_t n = 1;
+
+	while (n < cnt && n < CONFIG_BLOCK_DEV_WRITE_RUN &&
+	       bufs[n]->lba == bufs[0]->lba + n &&
+	       ext4_bcache_test_flag(bufs[n], BC_DIRTY))
+		n++;
+
+	return n;
+}
+
+/**@brief   Write a run of buffers with consecutive LBAs using a single
+ *          device request: bwritev if available, otherwise a copy into
+ *          the staging buffer.*/
+static int ext4_block_write_run(struct ext4_blockdev *bdev,
+				struct ext4_buf **bufs, uint32_t n,
+				uint8_t **stage)
+{
+	int r;
+	uint32_t i;
+	uint64_t pba;
+	uint32_t pb_cnt = bdev->lg_bsize / bdev->bdif->ph_bsize;
+	struct ext4_blockdev_iovec iov[CONFIG_BLOCK_DEV_WRITE_RUN];
+
+	for (i = 0; i < n; i++)
+		ext4_bcache_set_flag(bufs[i], BC_WRITEBACK);
+
+	if (n == 1) {
+		r = ext4_blocks_set_direct(bdev, bufs[0]->data, bufs[0]->lba,
+					   1);
+	} else if (bdev->bdif->bwritev) {
+		for (i = 0; i < n; i++) {
+			iov[i].buf = bufs[i]->data;
+			iov[i].blk_cnt = pb_cnt;
+		}
+
+		pba = (bufs[0]->lba * bdev->lg_bsize + bdev->part_offset) /
+		      bdev->bdif->ph_bsize;
+		r = ext4_bdif_bwritev(bdev, iov, n, pba);
+	} else {
+		if (!*stage)
+			*stage = ext4_malloc(CONFIG_BLOCK_DEV_WRITE_RUN *
+					     bdev->lg_bsize);
+
+		if (*stage) {
+			for (i = 0; i < n; i++)
+				memcpy(*stage + i * bdev->lg_bsize,
+				       bufs[i]->data, bdev->lg_bsize);
+
+			r = ext4_blocks_set_direct(bdev, *stage, bufs[0]->lba,
+						   n);
+		} else {
+			r = EOK;
+			for (i = 0; i < n && r == EOK; i++)
+				r = ext4_blocks_set_direct(bdev, bufs[i]->data,
+							   bufs[i]->lba, 1);
+		}
+	}
+
+	/*Callbacks may write back later buffers of the run themselves*/
+	for (i = 0; i < n; i++) {
+		if (ext4_bcache_test_flag(bufs[i], BC_WRITEBACK))
+			ext4_block_end_write(bdev, bufs[i], r);
+	}
+
+	return r;
+}
+
+/**@brief   Write dirty buffers in LBA order, merging adjacent blocks
+ *          into single device requests.*/
+static int ext4_block_cache_flush_sorted(struct ext4_blockdev *bdev)
+{
+	int r = EOK;
+	uint32_t cnt, i, n;
+	uint8_t *stage = NULL;
+	struct ext4_bcache *bc = bdev->bc;
+	struct ext4_buf **bufs;
+	bool dont_shake;
+
+	bufs = ext4_block_dirty_sorted(bc, &cnt);
+	if (!bufs)
+		return ext4_block_cache_flush_seq(bdev);
+
+	dont_shake = bc->dont_shake;
+	bc->dont_shake = true;
+	for (i = 0; i < cnt && r == EOK; i += n) {
+		/*Already written back by end_write callback*/
+		if (!ext4_bcache_test_flag(bufs[i], BC_DIRTY)) {
+			n = 1;
+			continue;
+		}
+
+		n = ext4_block_run_len(bufs + i, cnt - i);
+		r = ext4_block_write_run(bdev, bufs + i, n, &stage);
+	}
+	bc->dont_shake = dont_shake;
+
+	ext4_free(stage);
+	ext4_free(bufs);
+	if (r != EOK)
+		return r;
+
+	/*Buffers dirtied in the meantime*/
+	return ext4_block_cache_flush_seq(bdev);
+}
+
+/**@brief   Run of dirty buffers written by one batched request.*/
+struct ext4_block_flush_run {
+	struct ext4_blockdev_req req;
+	uint32_t first;
+	uint32_t cnt;
+};
+
+/**@brief   Queue dirty buffers (in LBA order) and let the block device
+ *          keep them in flight together. Adjacent buffers are merged into
+ *          one request through a staging copy, the staging buffer bounds
+ *          how much is queued at a time. Buffers referenced again while
+ *          the batch was in flight lose BC_WRITEBACK and stay dirty.*/
+static int ext4_block_cache_flush_batch(struct ext4_blockdev *bdev)
+{
+	int r = EOK, rr;
+	uint32_t cnt, i, j, k, n, runs, staged;
+	uint32_t stage_max = CONFIG_BLOCK_DEV_FLUSH_STAGE;
+	uint8_t *mem, *stage = NULL;
+	void *data;
+	struct ext4_buf *buf;
+	struct ext4_buf **bufs;
+	struct ext4_bcache *bc = bdev->bc;
+	struct ext4_block_flush_run *run;
+	bool dont_shake;
+
+	bufs = ext4_block_dirty_sorted(bc, &cnt);
+	if (!bufs)
+		return ext4_block_cache_flush_seq(bdev);
+
+	run = ext4_calloc(cnt, sizeof(struct ext4_block_flush_run));
+	if (!run) {
+		ext4_free(bufs);
+		return ext4_block_cache_flush_sorted(bdev);
+	}
+
+	/*A whole run has to fit*/
+	if (stage_max < CONFIG_BLOCK_DEV_WRITE_RUN)
+		stage_max = CONFIG_BLOCK_DEV_WRITE_RUN;
+
+	/*Without staging memory every buffer goes out on its own*/
+	mem = ext4_malloc(stage_max * bdev->lg_bsize +
+			  CONFIG_BLOCK_DEV_CACHE_ALIGN - 1);
+	if (mem)
+		stage = (uint8_t *)(((uintptr_t)mem +
+				     CONFIG_BLOCK_DEV_CACHE_ALIGN - 1) &
+				    ~(uintptr_t)(CONFIG_BLOCK_DEV_CACHE_ALIGN - 1));
+
+	i = 0;
+	while (i < cnt && r == EOK) {
+		runs = 0;
+		staged = 0;
+		for (; i < cnt; i += n) {
+			/*Already written back by end_write callback*/
+			if (!ext4_bcache_test_flag(bufs[i], BC_DIRTY)) {
+				n = 1;
+				continue;
+			}
+
+			n = stage ? ext4_block_run_len(bufs + i, cnt - i) : 1;
+			if (n > 1 && staged + n > stage_max)
+				break;
+
+			for (j = 0; j < n; j++)
+				ext4_bcache_set_flag(bufs[i + j], BC_WRITEBACK);
+
+			if (n == 1) {
+				data = bufs[i]->data;
+			} else {
+				data = stage + (size_t)staged * bdev->lg_bsize;
+				for (j = 0; j < n; j++)
+					memcpy((uint8_t *)data +
+					       (size_t)j * bdev->lg_bsize,
+					       bufs[i + j]->data, bdev->lg_bsize);
+
+				staged += n;
+			}
+
+			run[runs].first = i;
+			run[runs].cnt = n;
+			r = ext4_blocks_submit(bdev, &run[runs].req, true, data,
+					       bufs[i]->lba, n);
+			if (r != EOK) {
+				for (j = 0; j < n; j++)
+					ext4_bcache_clear_flag(bufs[i + j],
+							       BC_WRITEBACK);
+				break;
+			}
+			runs++;
+		}
+
+		rr = ext4_blocks_wait(bdev);
+		if (r == EOK)
+			r = rr;
+
+		dont_shake = bc->dont_shake;
+		bc->dont_shake = true;
+		for (k = 0; k < runs; k++) {
+			for (j = 0; j < run[k].cnt; j++) {
+				buf = bufs[run[k].first + j];
+				if (!ext4_bcache_test_flag(buf, BC_WRITEBACK))
+					continue;
+
+				ext4_block_end_write(bdev, buf, run[k].req.res);
+			}
+			if (r == EOK)
+				r = run[k].req.res;
+		}
+		bc->dont_shake = dont_shake;
+	}
+
+	ext4_free(mem);
+	ext4_free(run);
+	ext4_free(bufs);
+	if (r != EOK)
+		return r;
+
+	/*Buffers touched in the meantime*/
+	return ext4_block_cache_flush_seq(bdev);
+}
+
+int ext4_block_cache_flush(struct ext4_blockdev *bdev)
+{
+	if (bdev->bdif->submit)
+		return ext4_block_cache_flush_batch(bdev);
+
+	return ext4_block_cache_flush_sorted(bdev);
+}
+
+int ext4_block_cache_resize(struct ext4_blockdev *bdev, uint32_t cnt)
+{
+	int r;
+
+	ext4_assert(bdev && bdev->bc && cnt);
+
+	bdev->bc->cnt = cnt;
+	r = ext4_block_cache_shake(bdev);
+	ext4_bcache_trim(bdev->bc);
+	return r;
+}
+
 int ext4_block_cache_write_back(struct ext4_blockdev *bdev, uint8_t on_off)
 {
 	if (on_off)
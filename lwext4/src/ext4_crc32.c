@@ -44,6 +44,9 @@
 
 #include "ext4_crc32.h"
 
+#include <stdbool.h>
+#include <string.h>
+
 static const uint32_t crc32_tab[] = {
 	0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
 	0xe963a535, 0x9e6495a3,	0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -177,9 +180,241 @@ uint32_t ext4_crc32(uint32_t crc, const void *buf, uint32_t size)
 	return crc32(crc, buf, size, crc32_tab);
 }
 
+/**@brief   Slicing-by-8 tables, crc32c_sb8_tab[k][n] is CRC32C of byte n
+ *          followed by k zero bytes. Table 0 is crc32c_tab.*/
+static uint32_t crc32c_sb8_tab[8][256];
+
+static void crc32c_sb8_init(void)
+{
+	uint32_t n, k, crc;
+
+	for (n = 0; n < 256; n++) {
+		crc = crc32c_tab[n];
+		crc32c_sb8_tab[0][n] = crc;
+		for (k = 1; k < 8; k++) {
+			crc = crc32c_tab[crc & 0xFF] ^ (crc >> 8);
+			crc32c_sb8_tab[k][n] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_sb8(uint32_t crc, const void *buf, uint32_t size)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const uint32_t (*t)[256] = crc32c_sb8_tab;
+	uint32_t lo;
+
+	while (size >= 8) {
+		lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+			    (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+		      t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+		      t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+		p += 8;
+		size -= 8;
+	}
+
+	return crc32(crc, p, size, crc32c_tab);
+}
+
+#if CONFIG_CRC32C_SSE42 && (defined(__x86_64__) || defined(_M_X64)) &&       \
+    (defined(__GNUC__) || defined(_MSC_VER))
+
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32C_SSE42_FN
+#else
+#define CRC32C_SSE42_FN __attribute__((target("sse4.2")))
+#endif
+
+/**@brief   Stream lengths of the 3-way interleaved loops.*/
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+/**@brief   Operators shifting a CRC over CRC32C_LONG/CRC32C_SHORT zero
+ *          bytes, one table per byte of the CRC.*/
+static uint32_t crc32c_long_tab[4][256];
+static uint32_t crc32c_short_tab[4][256];
+
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/**@brief   Build the operator for len zero bytes (len is a power of 2).*/
+static void crc32c_zeros_op(uint32_t *op, uint32_t len)
+{
+	uint32_t odd[32], even[32];
+	uint32_t *src = odd, *dst = even, *tmp;
+	int n;
+
+	/*Operator for one zero bit*/
+	odd[0] = 0x82F63B78;
+	for (n = 1; n < 32; n++)
+		odd[n] = 1u << (n - 1);
+
+	/*Square up to one zero byte, then once per bit of len*/
+	for (len *= 8; len > 1; len >>= 1) {
+		gf2_matrix_square(dst, src);
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	for (n = 0; n < 32; n++)
+		op[n] = src[n];
+}
+
+static void crc32c_zeros(uint32_t tab[4][256], uint32_t len)
+{
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32c_zeros_op(op, len);
+	for (n = 0; n < 256; n++) {
+		tab[0][n] = gf2_matrix_times(op, n);
+		tab[1][n] = gf2_matrix_times(op, n << 8);
+		tab[2][n] = gf2_matrix_times(op, n << 16);
+		tab[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static inline uint32_t crc32c_shift(uint32_t tab[4][256], uint32_t crc)
+{
+	return tab[0][crc & 0xFF] ^ tab[1][(crc >> 8) & 0xFF] ^
+	       tab[2][(crc >> 16) & 0xFF] ^ tab[3][crc >> 24];
+}
+
+static inline uint64_t crc32c_load64(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**@brief   CRC32C using the SSE4.2 crc32 instruction. Three independent
+ *          streams hide the instruction latency, their CRCs are combined
+ *          with the zeros operators.*/
+static CRC32C_SSE42_FN uint32_t crc32c_sse42(uint32_t crc, const void *buf,
+					     uint32_t size)
+{
+	const uint8_t *p = (const uint8_t *)buf;
+	const uint8_t *end;
+	uint64_t crc0 = crc, crc1, crc2;
+
+	while (size && ((uintptr_t)p & 7)) {
+		crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+		size--;
+	}
+
+	while (size >= CRC32C_LONG * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = p + CRC32C_LONG;
+		do {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load64(p));
+			crc1 = _mm_crc32_u64(crc1,
+					     crc32c_load64(p + CRC32C_LONG));
+			crc2 = _mm_crc32_u64(crc2,
+					     crc32c_load64(p + 2 * CRC32C_LONG));
+			p += 8;
+		} while (p < end);
+
+		crc0 = crc32c_shift(crc32c_long_tab, (uint32_t)crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long_tab, (uint32_t)crc0) ^ crc2;
+		p += 2 * CRC32C_LONG;
+		size -= 3 * CRC32C_LONG;
+	}
+
+	while (size >= CRC32C_SHORT * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = p + CRC32C_SHORT;
+		do {
+			crc0 = _mm_crc32_u64(crc0, crc32c_load64(p));
+			crc1 = _mm_crc32_u64(crc1,
+					     crc32c_load64(p + CRC32C_SHORT));
+			crc2 = _mm_crc32_u64(crc2,
+					     crc32c_load64(p + 2 * CRC32C_SHORT));
+			p += 8;
+		} while (p < end);
+
+		crc0 = crc32c_shift(crc32c_short_tab, (uint32_t)crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short_tab, (uint32_t)crc0) ^ crc2;
+		p += 2 * CRC32C_SHORT;
+		size -= 3 * CRC32C_SHORT;
+	}
+
+	while (size >= 8) {
+		crc0 = _mm_crc32_u64(crc0, crc32c_load64(p));
+		p += 8;
+		size -= 8;
+	}
+
+	while (size--)
+		crc0 = _mm_crc32_u8((uint32_t)crc0, *p++);
+
+	return (uint32_t)crc0;
+}
+
+static bool crc32c_have_sse42(void)
+{
+#ifdef _MSC_VER
+	int info[4];
+
+	__cpuid(info, 1);
+	return (info[2] & (1 << 20)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+static uint32_t crc32c_dispatch(uint32_t crc, const void *buf, uint32_t size);
+
+/**@brief   Selected CRC32C implementation (resolved on first use).*/
+static uint32_t (*crc32c_impl)(uint32_t, const void *, uint32_t) =
+    crc32c_dispatch;
+
+static uint32_t crc32c_dispatch(uint32_t crc, const void *buf, uint32_t size)
+{
+	uint32_t (*impl)(uint32_t, const void *, uint32_t) = crc32c_sb8;
+
+	crc32c_sb8_init();
+
+#ifdef CRC32C_SSE42_FN
+	if (crc32c_have_sse42()) {
+		crc32c_zeros(crc32c_long_tab, CRC32C_LONG);
+		crc32c_zeros(crc32c_short_tab, CRC32C_SHORT);
+		impl = crc32c_sse42;
+	}
+#endif
+
+	/*Tables are complete before the pointer is published. Concurrent
+	 * first callers just repeat the same initialization.*/
+	crc32c_impl = impl;
+	return impl(crc, buf, size);
+}
+
 uint32_t ext4_crc32c(uint32_t crc, const void *buf, uint32_t size)
 {
-	return crc32(crc, buf, size, crc32c_tab);
+	return crc32c_impl(crc, buf, size);
 }
 
 /**
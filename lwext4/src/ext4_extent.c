@@ -27,6 +27,13 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+void ext4_extent_cache_flush(struct ext4_fs *fs __unused)
+{
+#if CONFIG_EXTENT_CACHE_SIZE
+	memset(fs->ext_cache, 0, sizeof(fs->ext_cache));
+#endif
+}
+
 #if CONFIG_EXTENTS_ENABLE
 /*
  * used by extent splitting.
@@ -375,8 +382,66 @@ ext4_extent_header_set_generation(struct ext4_extent_header *header,
     header->generation = to_le32(generation);
 }
 
+#if CONFIG_EXTENT_CACHE_SIZE
+static struct ext4_extent_cache *
+ext4_ext_cache_slot(struct ext4_inode_ref *inode_ref)
+{
+	return &inode_ref->fs->ext_cache[inode_ref->index %
+					 CONFIG_EXTENT_CACHE_SIZE];
+}
+
+/**@brief Look up a block in the cached extent of the i-node.
+ * @param inode_ref I-node
+ * @param iblock    Logical block
+ * @param pblock    Output physical block
+ * @param len       Output blocks remaining in the extent
+ * @param unwritten Output unwritten flag of the extent
+ * @return true if the cache covers iblock */
+static bool ext4_ext_cache_lookup(struct ext4_inode_ref *inode_ref,
+				  ext4_lblk_t iblock, ext4_fsblk_t *pblock,
+				  uint32_t *len, bool *unwritten)
+{
+	struct ext4_extent_cache *ec = ext4_ext_cache_slot(inode_ref);
+
+	if (ec->inode != inode_ref->index || iblock < ec->lblk ||
+	    iblock - ec->lblk >= ec->len)
+		return false;
+
+	*pblock = ec->pblk + (iblock - ec->lblk);
+	*len = ec->len - (iblock - ec->lblk);
+	*unwritten = ec->unwritten;
+	return true;
+}
+
+static void ext4_ext_cache_set(struct ext4_inode_ref *inode_ref,
+			       ext4_lblk_t lblk, uint32_t len,
+			       ext4_fsblk_t pblk, bool unwritten)
+{
+	struct ext4_extent_cache *ec = ext4_ext_cache_slot(inode_ref);
+
+	ec->inode = inode_ref->index;
+	ec->lblk = lblk;
+	ec->len = len;
+	ec->pblk = pblk;
+	ec->unwritten = unwritten;
+}
+
+/**@brief Forget cached mapping, must precede any extent tree change.*/
+static void ext4_ext_cache_drop(struct ext4_inode_ref *inode_ref)
+{
+	struct ext4_extent_cache *ec = ext4_ext_cache_slot(inode_ref);
+
+	if (ec->inode == inode_ref->index)
+		ec->inode = 0;
+}
+#else
+#define ext4_ext_cache_drop(inode_ref) ((void)(inode_ref))
+#endif
+
 void ext4_extent_tree_init(struct ext4_inode_ref *inode_ref)
 {
+    ext4_ext_cache_drop(inode_ref);
+
     /* Initialize extent root header */
     struct ext4_extent_header *header =
             ext4_inode_get_extent_header(inode_ref->inode);
@@ -487,22 +552,20 @@ static void ext4_idx_store_pblock(struct ext4_extent_index *ix, ext4_fsblk_t pb)
 	ix->leaf_hi = to_le16((uint16_t)((pb >> 32)) & 0xffff);
 }
 
-static int ext4_allocate_single_block(struct ext4_inode_ref *inode_ref,
-				      ext4_fsblk_t goal, ext4_fsblk_t *blockp)
-{
-	return ext4_balloc_alloc_block(inode_ref, goal, blockp);
-}
-
 static ext4_fsblk_t ext4_new_meta_blocks(struct ext4_inode_ref *inode_ref,
 					 ext4_fsblk_t goal,
 					 uint32_t flags __unused,
 					 uint32_t *count, int *errp)
 {
 	ext4_fsblk_t block = 0;
+	uint32_t cnt = count ? *count : 1;
+
+	*errp = ext4_balloc_alloc_blocks(inode_ref, goal, &block, &cnt);
+	if (*errp != EOK)
+		return 0;
 
-	*errp = ext4_allocate_single_block(inode_ref, goal, &block);
 	if (count)
-		*count = 1;
+		*count = cnt;
 	return block;
 }
 
@@ -784,6 +847,8 @@ static int read_extent_tree_block(struct ext4_inode_ref *inode_ref,
 	if (err != EOK)
 		goto errout;
 
+	ext4_bcache_set_flag(bh->buf, BC_META);
+
 	err = ext4_ext_check(inode_ref, ext_block_hdr(bh), depth, pblk);
 	if (err != EOK)
 		goto errout;
@@ -1198,6 +1263,10 @@ static inline bool ext4_ext_can_prepend(struct ext4_extent *ex1,
 	    ext4_ext_pblock(ex1))
 		return 0;
 
+	/* initialized and unwritten extents never merge */
+	if (ext4_ext_is_unwritten(ex1) != ext4_ext_is_unwritten(ex2))
+		return 0;
+
 #ifdef AGGRESSIVE_TEST
 	if (ext4_ext_get_actual_len(ex1) + ext4_ext_get_actual_len(ex2) > 4)
 		return 0;
@@ -1226,6 +1295,10 @@ static inline bool ext4_ext_can_append(struct ext4_extent *ex1,
 	    ext4_ext_pblock(ex2))
 		return 0;
 
+	/* initialized and unwritten extents never merge */
+	if (ext4_ext_is_unwritten(ex1) != ext4_ext_is_unwritten(ex2))
+		return 0;
+
 #ifdef AGGRESSIVE_TEST
 	if (ext4_ext_get_actual_len(ex1) + ext4_ext_get_actual_len(ex2) > 4)
 		return 0;
@@ -1280,12 +1353,18 @@ static int ext4_ext_insert_leaf(struct ext4_inode_ref *inode_ref,
 		    ext4_ext_can_prepend(curp->extent, newext)) {
 			unwritten = ext4_ext_is_unwritten(curp->extent);
 			curp->extent->first_block = newext->first_block;
+			ext4_ext_store_pblock(curp->extent,
+					      ext4_ext_pblock(newext));
 			curp->extent->block_count =
 			    to_le16(ext4_ext_get_actual_len(curp->extent) +
 				    ext4_ext_get_actual_len(newext));
 			if (unwritten)
 				ext4_ext_mark_unwritten(curp->extent);
 
+			/*The first extent of the leaf may start earlier now*/
+			err = ext4_ext_correct_indexes(inode_ref, path);
+			if (err != EOK)
+				goto out;
 			err = ext4_ext_dirty(inode_ref, curp);
 			goto out;
 		}
@@ -1708,6 +1787,10 @@ int ext4_extent_remove_space(struct ext4_inode_ref *inode_ref, ext4_lblk_t from,
 	int ret = EOK;
 	int32_t depth = ext_depth(inode_ref->inode);
 	int32_t i;
+	int rc;
+
+	ext4_ext_cache_drop(inode_ref);
+	ext4_balloc_free_batch_begin(inode_ref->fs);
 
 	ret = ext4_find_extent(inode_ref, from, &path, 0);
 	if (ret != EOK)
@@ -1721,13 +1804,13 @@ int ext4_extent_remove_space(struct ext4_inode_ref *inode_ref, ext4_lblk_t from,
 	bool in_range = IN_RANGE(from, to_le32(path[depth].extent->first_block),
 				 ext4_ext_get_actual_len(path[depth].extent));
 
-	if (!in_range) {
-		ret = EOK;
-		goto out;
-	}
+	/* @from lies in a hole: start removal at the following extent */
+	if (!in_range &&
+	    to_le32(path[depth].extent->first_block) < from)
+		path[depth].extent++;
 
 	/* If we do remove_space inside the range of an extent */
-	if ((to_le32(path[depth].extent->first_block) < from) &&
+	if (in_range && (to_le32(path[depth].extent->first_block) < from) &&
 	    (to < to_le32(path[depth].extent->first_block) +
 		      ext4_ext_get_actual_len(path[depth].extent) - 1)) {
 
@@ -1736,6 +1819,7 @@ int ext4_extent_remove_space(struct ext4_inode_ref *inode_ref, ext4_lblk_t from,
 		ext4_lblk_t ee_block = to_le32(ex->first_block);
 		int32_t len = ext4_ext_get_actual_len(ex);
 		ext4_fsblk_t newblock = to + 1 - ee_block + ext4_ext_pblock(ex);
+		ext4_fsblk_t hole = from - ee_block + ext4_ext_pblock(ex);
 
 		ex->block_count = to_le16(from - ee_block);
 		if (unwritten)
@@ -1750,6 +1834,9 @@ int ext4_extent_remove_space(struct ext4_inode_ref *inode_ref, ext4_lblk_t from,
 			ext4_ext_mark_unwritten(&newex);
 
 		ret = ext4_ext_insert_extent(inode_ref, &path, &newex, 0);
+		if (ret == EOK)
+			ext4_ext_free_blocks(inode_ref, hole, to - from + 1, 0);
+
 		goto out;
 	}
 
@@ -1840,6 +1927,11 @@ out:
 	ext4_ext_drop_refs(inode_ref, path, 0);
 	ext4_free(path);
 	path = NULL;
+
+	rc = ext4_balloc_free_batch_end(inode_ref->fs);
+	if (ret == EOK)
+		ret = rc;
+
 	return ret;
 }
 
@@ -1923,6 +2015,11 @@ static int ext4_ext_convert_to_initialized(struct ext4_inode_ref *inode_ref,
 		err = ext4_ext_split_extent_at(inode_ref, ppath, split + blocks,
 					       EXT4_EXT_MARK_UNWRIT1 |
 						   EXT4_EXT_MARK_UNWRIT2);
+		/* insertion may leave the path at the right part (or in
+		 * another leaf), look the left part up again */
+		if (err == EOK)
+			err = ext4_find_extent(inode_ref, split, ppath, 0);
+
 		if (err == EOK) {
 			err = ext4_ext_split_extent_at(inode_ref, ppath, split,
 						       EXT4_EXT_MARK_UNWRIT1);
@@ -1962,6 +2059,20 @@ static ext4_lblk_t ext4_ext_next_allocated_block(struct ext4_extent_path *path)
 	return EXT_MAX_BLOCKS;
 }
 
+/**@brief   First allocated block after iblock, which is not mapped. The
+ *          extent the search found is past iblock if iblock lies in
+ *          front of the first extent of the leaf.*/
+static ext4_lblk_t ext4_ext_next_block(struct ext4_extent_path *path,
+				       ext4_lblk_t iblock)
+{
+	struct ext4_extent *ex = path[path->depth].extent;
+
+	if (ex && iblock < to_le32(ex->first_block))
+		return to_le32(ex->first_block);
+
+	return ext4_ext_next_allocated_block(path);
+}
+
 static int ext4_ext_zero_unwritten_range(struct ext4_inode_ref *inode_ref,
 					 ext4_fsblk_t block,
 					 uint32_t blocks_count)
@@ -1969,19 +2080,24 @@ static int ext4_ext_zero_unwritten_range(struct ext4_inode_ref *inode_ref,
 	int err = EOK;
 	uint32_t i;
 	uint32_t block_size = ext4_sb_get_block_size(&inode_ref->fs->sb);
-	for (i = 0; i < blocks_count; i++) {
-		struct ext4_block bh = EXT4_BLOCK_ZERO();
-		err = ext4_trans_block_get_noread(inode_ref->fs->bdev, &bh,
-						  block + i);
-		if (err != EOK)
-			break;
+	struct ext4_blockdev *bdev = inode_ref->fs->bdev;
+	void *zero;
 
-		memset(bh.data, 0, block_size);
-		ext4_trans_set_block_dirty(bh.buf);
-		err = ext4_block_set(inode_ref->fs->bdev, &bh);
+	/* File data bypasses the cache and the journal (see ext4_fwrite), so
+	 * zeroes must go the same way or a later checkpoint of a journaled
+	 * zero block would clobber data written in the meantime. */
+	zero = ext4_calloc(1, block_size);
+	if (!zero)
+		return ENOMEM;
+
+	ext4_bcache_invalidate_lba(bdev->bc, block, blocks_count);
+	for (i = 0; i < blocks_count; i++) {
+		err = ext4_blocks_set_direct(bdev, zero, block + i, 1);
 		if (err != EOK)
 			break;
 	}
+
+	ext4_free(zero);
 	return err;
 }
 
@@ -2012,7 +2128,7 @@ __unused static void print_path(struct ext4_extent_path *path)
 
 int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 			   uint32_t max_blocks, ext4_fsblk_t *result,
-			   bool create, uint32_t *blocks_count)
+			   uint32_t flags, uint32_t *blocks_count)
 {
 	struct ext4_extent_path *path = NULL;
 	struct ext4_extent newex, *ex;
@@ -2022,6 +2138,7 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	uint32_t allocated = 0;
 	ext4_lblk_t next;
 	ext4_fsblk_t newblock;
+	bool create = flags & EXT4_GET_BLOCKS_CREATE;
 
 	if (result)
 		*result = 0;
@@ -2029,6 +2146,20 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	if (blocks_count)
 		*blocks_count = 0;
 
+#if CONFIG_EXTENT_CACHE_SIZE
+	bool unwritten;
+	if (ext4_ext_cache_lookup(inode_ref, iblock, &newblock, &allocated,
+				  &unwritten)) {
+		if (!unwritten || (flags & EXT4_GET_BLOCKS_UNWRIT))
+			goto out;
+
+		if (!create) {
+			newblock = 0;
+			goto out;
+		}
+	}
+#endif
+
 	/* find extent for this block */
 	err = ext4_find_extent(inode_ref, iblock, &path, 0);
 	if (err != EOK) {
@@ -2053,7 +2184,15 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 			/* number of remain blocks in the extent */
 			allocated = ee_len - (iblock - ee_block);
 
-			if (!ext4_ext_is_unwritten(ex)) {
+#if CONFIG_EXTENT_CACHE_SIZE
+			if (!create || !ext4_ext_is_unwritten(ex))
+				ext4_ext_cache_set(inode_ref, ee_block, ee_len,
+						   ee_start,
+						   ext4_ext_is_unwritten(ex));
+#endif
+
+			if (!ext4_ext_is_unwritten(ex) ||
+			    (flags & EXT4_GET_BLOCKS_UNWRIT)) {
 				newblock = iblock - ee_block + ee_start;
 				goto out;
 			}
@@ -2063,16 +2202,20 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 				goto out;
 			}
 
+			ext4_ext_cache_drop(inode_ref);
+
 			uint32_t zero_range;
 			zero_range = allocated;
 			if (zero_range > max_blocks)
 				zero_range = max_blocks;
 
 			newblock = iblock - ee_block + ee_start;
-			err = ext4_ext_zero_unwritten_range(inode_ref, newblock,
-							    zero_range);
-			if (err != EOK)
-				goto out2;
+			if (!(flags & EXT4_GET_BLOCKS_NOZERO)) {
+				err = ext4_ext_zero_unwritten_range(
+				    inode_ref, newblock, zero_range);
+				if (err != EOK)
+					goto out2;
+			}
 
 			err = ext4_ext_convert_to_initialized(
 			    inode_ref, &path, iblock, zero_range);
@@ -2088,37 +2231,65 @@ int ext4_extent_get_blocks(struct ext4_inode_ref *inode_ref, ext4_lblk_t iblock,
 	 * we couldn't try to create block if create flag is zero
 	 */
 	if (!create) {
+		/* report the hole length so callers can skip it at once */
+		if (blocks_count) {
+			next = ext4_ext_next_block(path, iblock);
+			allocated = next - iblock;
+			if (allocated > max_blocks)
+				allocated = max_blocks;
+
+			*blocks_count = allocated;
+		}
 		goto out2;
 	}
 
 	/* find next allocated block so that we know how many
 	 * blocks we can allocate without ovelapping next extent */
-	next = ext4_ext_next_allocated_block(path);
+	next = ext4_ext_next_block(path, iblock);
 	allocated = next - iblock;
 	if (allocated > max_blocks)
 		allocated = max_blocks;
+	if (allocated > EXT_INIT_MAX_LEN)
+		allocated = EXT_INIT_MAX_LEN;
+	if ((flags & EXT4_GET_BLOCKS_UNWRIT) &&
+	    allocated > EXT_UNWRITTEN_MAX_LEN)
+		allocated = EXT_UNWRITTEN_MAX_LEN;
 
-	/* allocate new block */
+	/* allocate new blocks, as many contiguous as possible */
 	goal = ext4_ext_find_goal(inode_ref, path, iblock);
 	newblock = ext4_new_meta_blocks(inode_ref, goal, 0, &allocated, &err);
 	if (!newblock)
 		goto out2;
 
+	ext4_ext_cache_drop(inode_ref);
+
 	/* try to insert new extent into found leaf and return */
 	newex.first_block = to_le32(iblock);
 	ext4_ext_store_pblock(&newex, newblock);
 	newex.block_count = to_le16(allocated);
+	if (flags & EXT4_GET_BLOCKS_UNWRIT)
+		ext4_ext_mark_unwritten(&newex);
+
 	err = ext4_ext_insert_extent(inode_ref, &path, &newex, 0);
 	if (err != EOK) {
 		/* free data blocks we just allocated */
 		ext4_ext_free_blocks(inode_ref, ext4_ext_pblock(&newex),
-				     to_le16(newex.block_count), 0);
+				     ext4_ext_get_actual_len(&newex), 0);
 		goto out2;
 	}
 
 	/* previous routine could use block we allocated */
 	newblock = ext4_ext_pblock(&newex);
 
+	/* stale data of the new blocks must not become readable */
+	if ((flags & EXT4_GET_BLOCKS_ZERO) &&
+	    !(flags & EXT4_GET_BLOCKS_UNWRIT)) {
+		err = ext4_blocks_zero(inode_ref->fs->bdev, newblock,
+				       allocated);
+		if (err != EOK)
+			goto out2;
+	}
+
 out:
 	if (allocated > max_blocks)
 		allocated = max_blocks;
@@ -56,6 +56,7 @@
 #include "ext4_ialloc.h"
 #include "ext4_extent.h"
 
+#include <stdlib.h>
 #include <string.h>
 
 int ext4_fs_init(struct ext4_fs *fs, struct ext4_blockdev *bdev,
@@ -71,6 +72,18 @@ int ext4_fs_init(struct ext4_fs *fs, struct ext4_blockdev *bdev,
 
 	fs->read_only = read_only;
 
+#if CONFIG_EXTENT_CACHE_SIZE
+	memset(fs->ext_cache, 0, sizeof(fs->ext_cache));
+#endif
+	fs->bidx = NULL;
+	fs->bidx_cnt = 0;
+	memset(&fs->free_batch, 0, sizeof(fs->free_batch));
+	memset(&fs->pending, 0, sizeof(fs->pending));
+	memset(&fs->undo, 0, sizeof(fs->undo));
+	memset(&fs->discard, 0, sizeof(fs->discard));
+	fs->bg_sum = NULL;
+	fs->bg_sum_cnt = 0;
+
 	r = ext4_sb_read(fs->bdev, &fs->sb);
 	if (r != EOK)
 		return r;
@@ -127,6 +140,12 @@ int ext4_fs_fini(struct ext4_fs *fs)
 {
 	ext4_assert(fs);
 
+	ext4_balloc_index_drop(fs);
+	ext4_trans_undo_end(fs);
+	ext4_balloc_pending_drop(fs);
+	ext4_balloc_discard_drop(fs);
+	ext4_fs_bg_summary_drop(fs);
+
 	/*Set superblock state*/
 	ext4_set16(&fs->sb, state, EXT4_SUPERBLOCK_STATE_VALID_FS);
 
@@ -446,10 +465,16 @@ static int ext4_fs_init_inode_table(struct ext4_block_group_ref *bg_ref)
 
 	ext4_fsblk_t last_block = first_block + table_blocks - 1;
 
+	/* Stream zeroes to the device, go block by block without memory
+	 * for a zero buffer */
+	int rc = ext4_blocks_zero(bg_ref->fs->bdev, first_block, table_blocks);
+	if (rc != ENOMEM)
+		return rc;
+
 	/* Initialization of all itable blocks */
 	for (fblock = first_block; fblock <= last_block; ++fblock) {
 		struct ext4_block b;
-		int rc = ext4_trans_block_get_noread(bg_ref->fs->bdev, &b, fblock);
+		rc = ext4_trans_block_get_noread(bg_ref->fs->bdev, &b, fblock);
 		if (rc != EOK)
 			return rc;
 
@@ -464,6 +489,15 @@ static int ext4_fs_init_inode_table(struct ext4_block_group_ref *bg_ref)
 	return EOK;
 }
 
+static void ext4_fs_bg_summary_set(struct ext4_bg_summary *sum,
+				   struct ext4_sblock *sb,
+				   struct ext4_bgroup *bg)
+{
+	sum->free_inodes = ext4_bg_get_free_inodes_count(bg, sb);
+	sum->free_blocks = ext4_bg_get_free_blocks_count(bg, sb);
+	sum->used_dirs = ext4_bg_get_used_dirs_count(bg, sb);
+}
+
 static ext4_fsblk_t ext4_fs_get_descriptor_block(struct ext4_sblock *s,
 					     uint32_t bgid,
 					     uint32_t dsc_per_block)
@@ -490,8 +524,8 @@ static ext4_fsblk_t ext4_fs_get_descriptor_block(struct ext4_sblock *s,
  * @param bg   Block group to compute checksum for
  * @return Checksum value
  */
-static uint16_t ext4_fs_bg_checksum(struct ext4_sblock *sb, uint32_t bgid,
-				    struct ext4_bgroup *bg)
+uint16_t ext4_fs_bg_checksum(struct ext4_sblock *sb, uint32_t bgid,
+			     struct ext4_bgroup *bg)
 {
 	/* If checksum not supported, 0 will be returned */
 	uint16_t crc = 0;
@@ -584,6 +618,8 @@ int ext4_fs_get_block_group_ref(struct ext4_fs *fs, uint32_t bgid,
 	if (rc != EOK)
 		return rc;
 
+	ext4_bcache_set_flag(ref->block.buf, BC_META);
+
 	ref->block_group = (void *)(ref->block.data + offset);
 	ref->fs = fs;
 	ref->index = bgid;
@@ -644,12 +680,77 @@ int ext4_fs_put_block_group_ref(struct ext4_block_group_ref *ref)
 
 		/* Mark block dirty for writing changes to physical device */
 		ext4_trans_set_block_dirty(ref->block.buf);
+
+		/* Keep in-memory counters in sync */
+		if (ref->index < ref->fs->bg_sum_cnt)
+			ext4_fs_bg_summary_set(&ref->fs->bg_sum[ref->index],
+					       &ref->fs->sb, ref->block_group);
 	}
 
 	/* Put back block, that contains block group descriptor */
 	return ext4_block_set(ref->fs->bdev, &ref->block);
 }
 
+struct ext4_bg_summary *ext4_fs_bg_summary(struct ext4_fs *fs)
+{
+	struct ext4_sblock *sb = &fs->sb;
+	uint32_t bg_cnt = ext4_block_group_cnt(sb);
+	uint32_t dsc_size = ext4_sb_get_desc_size(sb);
+	uint32_t dsc_cnt = ext4_sb_get_block_size(sb) / dsc_size;
+	struct ext4_bg_summary *sum;
+	struct ext4_block b;
+	uint32_t i;
+	int r = EOK;
+
+	if (fs->bg_sum)
+		return fs->bg_sum;
+
+	sum = ext4_calloc(bg_cnt, sizeof(struct ext4_bg_summary));
+	if (!sum)
+		return NULL;
+
+	/* Read descriptors directly: getting a block group reference
+	 * would initialize uninitialized groups on the way */
+	for (i = 0; i < bg_cnt; i++) {
+		if (!(i % dsc_cnt)) {
+			if (i)
+				ext4_block_set(fs->bdev, &b);
+
+			r = ext4_trans_block_get(fs->bdev, &b,
+				ext4_fs_get_descriptor_block(sb, i, dsc_cnt));
+			if (r != EOK)
+				break;
+
+			ext4_bcache_set_flag(b.buf, BC_META);
+		}
+
+		ext4_fs_bg_summary_set(&sum[i], sb,
+			(void *)(b.data + (i % dsc_cnt) * dsc_size));
+	}
+
+	if (r != EOK) {
+		ext4_free(sum);
+		return NULL;
+	}
+
+	if (bg_cnt)
+		ext4_block_set(fs->bdev, &b);
+
+	fs->bg_sum = sum;
+	fs->bg_sum_cnt = bg_cnt;
+	return sum;
+}
+
+void ext4_fs_bg_summary_drop(struct ext4_fs *fs)
+{
+	if (!fs->bg_sum)
+		return;
+
+	ext4_free(fs->bg_sum);
+	fs->bg_sum = NULL;
+	fs->bg_sum_cnt = 0;
+}
+
 #if CONFIG_META_CSUM_ENABLE
 static uint32_t ext4_fs_inode_checksum(struct ext4_inode_ref *inode_ref)
 {
@@ -764,6 +865,8 @@ __ext4_fs_get_inode_ref(struct ext4_fs *fs, uint32_t index,
 		return rc;
 	}
 
+	ext4_bcache_set_flag(ref->block.buf, BC_META);
+
 	/* Compute position of i-node in the data block */
 	uint32_t offset_in_block = byte_offset_in_group % block_size;
 	ref->inode = (struct ext4_inode *)(ref->block.data + offset_in_block);
@@ -853,7 +956,7 @@ uint32_t ext4_fs_correspond_inode_mode(int filetype)
 }
 
 int ext4_fs_alloc_inode(struct ext4_fs *fs, struct ext4_inode_ref *inode_ref,
-			int filetype)
+			int filetype, uint32_t parent)
 {
 	/* Check if newly allocated i-node will be a directory */
 	bool is_dir;
@@ -863,7 +966,7 @@ int ext4_fs_alloc_inode(struct ext4_fs *fs, struct ext4_inode_ref *inode_ref,
 
 	/* Allocate inode by allocation algorithm */
 	uint32_t index;
-	int rc = ext4_ialloc_alloc_inode(fs, &index, is_dir);
+	int rc = ext4_ialloc_alloc_inode(fs, &index, is_dir, parent);
 	if (rc != EOK)
 		return rc;
 
@@ -1186,9 +1289,11 @@ int ext4_fs_truncate_inode(struct ext4_inode_ref *inode_ref, uint64_t new_size)
 	if (!ext4_inode_can_truncate(sb, inode_ref->inode))
 		return EINVAL;
 
-	/* If sizes are equal, nothing has to be done. */
+	/* If sizes are equal, nothing has to be done, unless extents were
+	 * preallocated past the end of file. */
 	uint64_t old_size = ext4_inode_get_size(sb, inode_ref->inode);
-	if (old_size == new_size)
+	if (old_size == new_size &&
+	    !ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS))
 		return EOK;
 
 	/* It's not supported to make the larger file by truncate operation */
@@ -1224,18 +1329,17 @@ int ext4_fs_truncate_inode(struct ext4_inode_ref *inode_ref, uint64_t new_size)
 	uint32_t new_blocks_cnt = (uint32_t)((new_size + block_size - 1) / block_size);
 	uint32_t old_blocks_cnt = (uint32_t)((old_size + block_size - 1) / block_size);
 	uint32_t diff_blocks_cnt = old_blocks_cnt - new_blocks_cnt;
+
+	/* Released blocks are returned to their groups all at once */
+	ext4_balloc_free_batch_begin(inode_ref->fs);
 #if CONFIG_EXTENT_ENABLE
 	if ((ext4_sb_feature_incom(sb, EXT4_FINCOM_EXTENTS)) &&
 	    (ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS))) {
 
-		/* Extents require special operation */
-		if (diff_blocks_cnt) {
-			r = ext4_extent_remove_space(inode_ref, new_blocks_cnt,
-						     EXT_MAX_BLOCKS);
-			if (r != EOK)
-				return r;
-
-		}
+		/* Extents require special operation, which also drops
+		 * blocks preallocated past the old end of file */
+		r = ext4_extent_remove_space(inode_ref, new_blocks_cnt,
+					     EXT_MAX_BLOCKS);
 	} else
 #endif
 	{
@@ -1243,14 +1347,19 @@ int ext4_fs_truncate_inode(struct ext4_inode_ref *inode_ref, uint64_t new_size)
 
 		/* Starting from 1 because of logical blocks are numbered from 0
 		 */
-		for (i = 0; i < diff_blocks_cnt; ++i) {
+		r = EOK;
+		for (i = 0; i < diff_blocks_cnt && r == EOK; ++i)
 			r = ext4_fs_release_inode_block(inode_ref,
 							new_blocks_cnt + i);
-			if (r != EOK)
-				return r;
-		}
 	}
 
+	int rc = ext4_balloc_free_batch_end(inode_ref->fs);
+	if (r == EOK)
+		r = rc;
+
+	if (r != EOK)
+		return r;
+
 	/* Update i-node */
 	ext4_inode_set_size(inode_ref->inode, new_size);
 	inode_ref->dirty = true;
@@ -1264,8 +1373,12 @@ int ext4_fs_truncate_inode(struct ext4_inode_ref *inode_ref, uint64_t new_size)
  */
 ext4_fsblk_t ext4_fs_inode_to_goal_block(struct ext4_inode_ref *inode_ref)
 {
-	uint32_t grp_inodes = ext4_get32(&inode_ref->fs->sb, inodes_per_group);
-	return (inode_ref->index - 1) / grp_inodes;
+	struct ext4_sblock *sb = &inode_ref->fs->sb;
+	uint32_t grp_inodes = ext4_get32(sb, inodes_per_group);
+
+	/* First block of the i-node's group */
+	return ext4_balloc_get_block_of_bgid(sb,
+					     (inode_ref->index - 1) / grp_inodes);
 }
 
 /**@brief Compute 'goal' for allocation algorithm (For blockmap).
@@ -1366,7 +1479,10 @@ static int ext4_fs_get_inode_dblk_idx_internal(struct ext4_inode_ref *inode_ref,
 
 		ext4_fsblk_t current_fsblk;
 		int rc = ext4_extent_get_blocks(inode_ref, iblock, 1,
-				&current_fsblk, extent_create, NULL);
+				&current_fsblk,
+				extent_create ? EXT4_GET_BLOCKS_CREATE |
+						    EXT4_GET_BLOCKS_ZERO : 0,
+				NULL);
 		if (rc != EOK)
 			return rc;
 
@@ -1466,6 +1582,51 @@ int ext4_fs_get_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 						   false, support_unwritten);
 }
 
+int ext4_fs_get_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+			       ext4_lblk_t iblock, uint32_t max_blocks,
+			       ext4_fsblk_t *fblock, uint32_t *blocks_count)
+{
+	struct ext4_fs *fs = inode_ref->fs;
+	ext4_fsblk_t next;
+	uint32_t cnt;
+	int rc;
+
+	ext4_assert(max_blocks);
+
+#if CONFIG_EXTENT_ENABLE
+	if ((ext4_sb_feature_incom(&fs->sb, EXT4_FINCOM_EXTENTS)) &&
+	    (ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS)) &&
+	    ext4_inode_get_size(&fs->sb, inode_ref->inode)) {
+		cnt = 0;
+		rc = ext4_extent_get_blocks(inode_ref, iblock, max_blocks,
+					    fblock, 0, &cnt);
+		if (rc != EOK)
+			return rc;
+
+		*blocks_count = cnt ? cnt : 1;
+		return EOK;
+	}
+#endif
+
+	/*Block mapped files: probe following blocks one by one*/
+	rc = ext4_fs_get_inode_dblk_idx(inode_ref, iblock, fblock, true);
+	if (rc != EOK)
+		return rc;
+
+	for (cnt = 1; cnt < max_blocks; cnt++) {
+		rc = ext4_fs_get_inode_dblk_idx(inode_ref, iblock + cnt, &next,
+						true);
+		if (rc != EOK)
+			return rc;
+
+		if (*fblock ? next != *fblock + cnt : next != 0)
+			break;
+	}
+
+	*blocks_count = cnt;
+	return EOK;
+}
+
 int ext4_fs_init_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 				ext4_lblk_t iblock, ext4_fsblk_t *fblock)
 {
@@ -1473,6 +1634,37 @@ int ext4_fs_init_inode_dblk_idx(struct ext4_inode_ref *inode_ref,
 						   true, true);
 }
 
+int ext4_fs_init_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+				ext4_lblk_t iblock, uint32_t max_blocks,
+				ext4_fsblk_t *fblock, uint32_t *blocks_count)
+{
+	struct ext4_fs *fs = inode_ref->fs;
+
+	ext4_assert(max_blocks);
+
+#if CONFIG_EXTENT_ENABLE
+	if ((ext4_sb_feature_incom(&fs->sb, EXT4_FINCOM_EXTENTS)) &&
+	    (ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS)) &&
+	    ext4_inode_get_size(&fs->sb, inode_ref->inode)) {
+		uint32_t cnt = 0;
+		int rc = ext4_extent_get_blocks(inode_ref, iblock, max_blocks,
+						fblock,
+						EXT4_GET_BLOCKS_CREATE |
+						    EXT4_GET_BLOCKS_NOZERO,
+						&cnt);
+		if (rc != EOK)
+			return rc;
+
+		ext4_assert(*fblock);
+		*blocks_count = cnt ? cnt : 1;
+		return EOK;
+	}
+#endif
+
+	*blocks_count = 1;
+	return ext4_fs_init_inode_dblk_idx(inode_ref, iblock, fblock);
+}
+
 static int ext4_fs_set_inode_data_block_index(struct ext4_inode_ref *inode_ref,
 				       ext4_lblk_t iblock, ext4_fsblk_t fblock)
 {
@@ -1639,32 +1831,66 @@ static int ext4_fs_set_inode_data_block_index(struct ext4_inode_ref *inode_ref,
 }
 
 
+static int
+ext4_fs_append_inode_dblk_internal(struct ext4_inode_ref *inode_ref,
+				   uint32_t max_blocks, ext4_fsblk_t *fblock,
+				   ext4_lblk_t *iblock, uint32_t *blocks_count,
+				   uint32_t get_flags);
+
 int ext4_fs_append_inode_dblk(struct ext4_inode_ref *inode_ref,
 			      ext4_fsblk_t *fblock, ext4_lblk_t *iblock)
 {
+	uint32_t cnt;
+
+	return ext4_fs_append_inode_dblk_internal(inode_ref, 1, fblock, iblock,
+						  &cnt, EXT4_GET_BLOCKS_CREATE);
+}
+
+int ext4_fs_append_inode_dblk_run(struct ext4_inode_ref *inode_ref,
+				  uint32_t max_blocks, ext4_fsblk_t *fblock,
+				  ext4_lblk_t *iblock, uint32_t *blocks_count)
+{
+	return ext4_fs_append_inode_dblk_internal(inode_ref, max_blocks, fblock,
+						  iblock, blocks_count,
+						  EXT4_GET_BLOCKS_CREATE |
+						      EXT4_GET_BLOCKS_NOZERO);
+}
+
+static int
+ext4_fs_append_inode_dblk_internal(struct ext4_inode_ref *inode_ref,
+				   uint32_t max_blocks, ext4_fsblk_t *fblock,
+				   ext4_lblk_t *iblock, uint32_t *blocks_count,
+				   uint32_t get_flags)
+{
+	ext4_assert(max_blocks);
+	(void)get_flags;
+
 #if CONFIG_EXTENT_ENABLE
 	/* Handle extents separately */
 	if ((ext4_sb_feature_incom(&inode_ref->fs->sb, EXT4_FINCOM_EXTENTS)) &&
 	    (ext4_inode_has_flag(inode_ref->inode, EXT4_INODE_FLAG_EXTENTS))) {
 		int rc;
+		uint32_t cnt = 0;
 		ext4_fsblk_t current_fsblk;
 		struct ext4_sblock *sb = &inode_ref->fs->sb;
 		uint64_t inode_size = ext4_inode_get_size(sb, inode_ref->inode);
 		uint32_t block_size = ext4_sb_get_block_size(sb);
 		*iblock = (uint32_t)((inode_size + block_size - 1) / block_size);
 
-		rc = ext4_extent_get_blocks(inode_ref, *iblock, 1,
-						&current_fsblk, true, NULL);
+		/* One bitmap scan and extent insertion for the whole run */
+		rc = ext4_extent_get_blocks(inode_ref, *iblock, max_blocks,
+					    &current_fsblk, get_flags, &cnt);
 		if (rc != EOK)
 			return rc;
 
 		*fblock = current_fsblk;
-		ext4_assert(*fblock);
+		ext4_assert(*fblock && cnt);
 
-		ext4_inode_set_size(inode_ref->inode, inode_size + block_size);
+		ext4_inode_set_size(inode_ref->inode,
+				    inode_size + (uint64_t)cnt * block_size);
 		inode_ref->dirty = true;
 
-
+		*blocks_count = cnt;
 		return rc;
 	}
 #endif
@@ -1705,6 +1931,7 @@ int ext4_fs_append_inode_dblk(struct ext4_inode_ref *inode_ref,
 
 	*fblock = phys_block;
 	*iblock = new_block_idx;
+	*blocks_count = 1;
 
 	return EOK;
 }
@@ -178,6 +178,8 @@ int ext4_ialloc_free_inode(struct ext4_fs *fs, uint32_t index, bool is_dir)
 	if (rc != EOK)
 		return rc;
 
+	ext4_bcache_set_flag(b.buf, BC_META);
+
 	if (!ext4_ialloc_verify_bitmap_csum(sb, bg, b.data)) {
 		ext4_dbg(DEBUG_IALLOC,
 			DBG_WARN "Bitmap checksum failed."
@@ -226,140 +228,259 @@ int ext4_ialloc_free_inode(struct ext4_fs *fs, uint32_t index, bool is_dir)
 	return EOK;
 }
 
-int ext4_ialloc_alloc_inode(struct ext4_fs *fs, uint32_t *idx, bool is_dir)
+/**@brief Allocate an i-node from a single block group.
+ * @param fs     Filesystem
+ * @param bgid   Block group
+ * @param idx    Output value - allocated i-node number
+ * @param is_dir Flag if allocated i-node will be directory
+ * @return Error code, ENOSPC if the group has no free i-node
+ */
+static int ext4_ialloc_alloc_in_group(struct ext4_fs *fs, uint32_t bgid,
+				      uint32_t *idx, bool is_dir)
 {
 	struct ext4_sblock *sb = &fs->sb;
+	struct ext4_block_group_ref bg_ref;
+	struct ext4_block b;
+	uint32_t free_inodes, used_dirs, inodes_in_bg, idx_in_bg;
 
-	uint32_t bgid = fs->last_inode_bg_id;
-	uint32_t bg_count = ext4_block_group_cnt(sb);
-	uint32_t sb_free_inodes = ext4_get32(sb, free_inodes_count);
-	bool rewind = false;
-
-	/* Try to find free i-node in all block groups */
-	while (bgid <= bg_count) {
-
-		if (bgid == bg_count) {
-			if (rewind)
-				break;
-			bg_count = fs->last_inode_bg_id;
-			bgid = 0;
-			rewind = true;
-			continue;
-		}
+	/* Load block group to check */
+	int rc = ext4_fs_get_block_group_ref(fs, bgid, &bg_ref);
+	if (rc != EOK)
+		return rc;
 
-		/* Load block group to check */
-		struct ext4_block_group_ref bg_ref;
-		int rc = ext4_fs_get_block_group_ref(fs, bgid, &bg_ref);
-		if (rc != EOK)
-			return rc;
+	struct ext4_bgroup *bg = bg_ref.block_group;
 
-		struct ext4_bgroup *bg = bg_ref.block_group;
-
-		/* Read necessary values for algorithm */
-		uint32_t free_inodes = ext4_bg_get_free_inodes_count(bg, sb);
-		uint32_t used_dirs = ext4_bg_get_used_dirs_count(bg, sb);
-
-		/* Check if this block group is good candidate for allocation */
-		if (free_inodes > 0) {
-			/* Load block with bitmap */
-			ext4_fsblk_t bmp_blk_add = ext4_bg_get_inode_bitmap(bg, sb);
-
-			struct ext4_block b;
-			rc = ext4_trans_block_get(fs->bdev, &b, bmp_blk_add);
-			if (rc != EOK) {
-				ext4_fs_put_block_group_ref(&bg_ref);
-				return rc;
-			}
-
-			if (!ext4_ialloc_verify_bitmap_csum(sb, bg, b.data)) {
-				ext4_dbg(DEBUG_IALLOC,
-					DBG_WARN "Bitmap checksum failed."
-					"Group: %" PRIu32"\n",
-					bg_ref.index);
-			}
-
-			/* Try to allocate i-node in the bitmap */
-			uint32_t inodes_in_bg;
-			uint32_t idx_in_bg;
-
-			inodes_in_bg = ext4_inodes_in_group_cnt(sb, bgid);
-			rc = ext4_bmap_bit_find_clr(b.data, 0, inodes_in_bg,
-						    &idx_in_bg);
-			/* Block group has not any free i-node */
-			if (rc == ENOSPC) {
-				rc = ext4_block_set(fs->bdev, &b);
-				if (rc != EOK) {
-					ext4_fs_put_block_group_ref(&bg_ref);
-					return rc;
-				}
-
-				rc = ext4_fs_put_block_group_ref(&bg_ref);
-				if (rc != EOK)
-					return rc;
+	/* Read necessary values for algorithm */
+	free_inodes = ext4_bg_get_free_inodes_count(bg, sb);
+	used_dirs = ext4_bg_get_used_dirs_count(bg, sb);
+	if (!free_inodes) {
+		rc = ext4_fs_put_block_group_ref(&bg_ref);
+		return rc != EOK ? rc : ENOSPC;
+	}
 
-				continue;
-			}
+	/* Load block with bitmap */
+	ext4_fsblk_t bmp_blk_add = ext4_bg_get_inode_bitmap(bg, sb);
+	rc = ext4_trans_block_get(fs->bdev, &b, bmp_blk_add);
+	if (rc != EOK) {
+		ext4_fs_put_block_group_ref(&bg_ref);
+		return rc;
+	}
 
-			ext4_bmap_bit_set(b.data, idx_in_bg);
+	ext4_bcache_set_flag(b.buf, BC_META);
 
-			/* Free i-node found, save the bitmap */
-			ext4_ialloc_set_bitmap_csum(sb,bg,
-						    b.data);
-			ext4_trans_set_block_dirty(b.buf);
+	if (!ext4_ialloc_verify_bitmap_csum(sb, bg, b.data)) {
+		ext4_dbg(DEBUG_IALLOC,
+			DBG_WARN "Bitmap checksum failed."
+			"Group: %" PRIu32"\n",
+			bg_ref.index);
+	}
 
-			ext4_block_set(fs->bdev, &b);
-			if (rc != EOK) {
-				ext4_fs_put_block_group_ref(&bg_ref);
-				return rc;
-			}
+	/* Try to allocate i-node in the bitmap */
+	inodes_in_bg = ext4_inodes_in_group_cnt(sb, bgid);
+	rc = ext4_bmap_bit_find_clr(b.data, 0, inodes_in_bg, &idx_in_bg);
+	/* Block group has not any free i-node */
+	if (rc == ENOSPC) {
+		rc = ext4_block_set(fs->bdev, &b);
+		if (rc != EOK) {
+			ext4_fs_put_block_group_ref(&bg_ref);
+			return rc;
+		}
 
-			/* Modify filesystem counters */
-			free_inodes--;
-			ext4_bg_set_free_inodes_count(bg, sb, free_inodes);
+		rc = ext4_fs_put_block_group_ref(&bg_ref);
+		return rc != EOK ? rc : ENOSPC;
+	}
 
-			/* Increment used directories counter */
-			if (is_dir) {
-				used_dirs++;
-				ext4_bg_set_used_dirs_count(bg, sb, used_dirs);
-			}
+	ext4_bmap_bit_set(b.data, idx_in_bg);
 
-			/* Decrease unused inodes count */
-			uint32_t unused =
-			    ext4_bg_get_itable_unused(bg, sb);
+	/* Free i-node found, save the bitmap */
+	ext4_ialloc_set_bitmap_csum(sb, bg, b.data);
+	ext4_trans_set_block_dirty(b.buf);
 
-			uint32_t free = inodes_in_bg - unused;
+	rc = ext4_block_set(fs->bdev, &b);
+	if (rc != EOK) {
+		ext4_fs_put_block_group_ref(&bg_ref);
+		return rc;
+	}
 
-			if (idx_in_bg >= free) {
-				unused = inodes_in_bg - (idx_in_bg + 1);
-				ext4_bg_set_itable_unused(bg, sb, unused);
-			}
+	/* Modify filesystem counters */
+	free_inodes--;
+	ext4_bg_set_free_inodes_count(bg, sb, free_inodes);
 
-			/* Save modified block group */
-			bg_ref.dirty = true;
+	/* Increment used directories counter */
+	if (is_dir) {
+		used_dirs++;
+		ext4_bg_set_used_dirs_count(bg, sb, used_dirs);
+	}
 
-			rc = ext4_fs_put_block_group_ref(&bg_ref);
-			if (rc != EOK)
-				return rc;
+	/* Decrease unused inodes count */
+	uint32_t unused = ext4_bg_get_itable_unused(bg, sb);
+	uint32_t free = inodes_in_bg - unused;
 
-			/* Update superblock */
-			sb_free_inodes--;
-			ext4_set32(sb, free_inodes_count, sb_free_inodes);
+	if (idx_in_bg >= free) {
+		unused = inodes_in_bg - (idx_in_bg + 1);
+		ext4_bg_set_itable_unused(bg, sb, unused);
+	}
 
-			/* Compute the absolute i-nodex number */
-			*idx = ext4_ialloc_bgidx_to_inode(sb, idx_in_bg, bgid);
+	/* Save modified block group */
+	bg_ref.dirty = true;
 
-			fs->last_inode_bg_id = bgid;
+	rc = ext4_fs_put_block_group_ref(&bg_ref);
+	if (rc != EOK)
+		return rc;
+
+	/* Update superblock */
+	ext4_set32(sb, free_inodes_count,
+		   ext4_get32(sb, free_inodes_count) - 1);
+
+	/* Compute the absolute i-nodex number */
+	*idx = ext4_ialloc_bgidx_to_inode(sb, idx_in_bg, bgid);
+	return EOK;
+}
 
-			return EOK;
+#if CONFIG_IALLOC_ORLOV
+/**@brief Pick a block group for a new directory.
+ *        Directories created in the root are spread over groups with
+ *        above average free space and the fewest directories. Other
+ *        directories stay close to their parent unless its area is
+ *        crowded (Orlov allocator).
+ * @param fs        Filesystem
+ * @param sum       Block group counters
+ * @param parent_bg Block group of the parent directory
+ * @param top       Parent directory is the root
+ * @return Block group to start the search at
+ */
+static uint32_t ext4_ialloc_find_group_dir(struct ext4_fs *fs,
+					   struct ext4_bg_summary *sum,
+					   uint32_t parent_bg, bool top)
+{
+	struct ext4_sblock *sb = &fs->sb;
+	uint32_t bg_cnt = ext4_block_group_cnt(sb);
+	uint32_t inodes_per_group = ext4_get32(sb, inodes_per_group);
+	uint32_t blocks_per_group = ext4_get32(sb, blocks_per_group);
+	uint32_t avg_inodes = ext4_get32(sb, free_inodes_count) / bg_cnt;
+	uint64_t avg_blocks = ext4_sb_get_free_blocks_cnt(sb) / bg_cnt;
+	uint32_t min_inodes, min_blocks, max_dirs, best, bgid, i;
+	uint64_t ndirs = 0;
+
+	if (top) {
+		/* Rotate the start, so that ties go to different groups */
+		uint32_t start = (fs->last_inode_bg_id + 1) % bg_cnt;
+
+		best = bg_cnt;
+		for (i = 0; i < bg_cnt; i++) {
+			bgid = (start + i) % bg_cnt;
+			if (!sum[bgid].free_inodes ||
+			    sum[bgid].free_inodes < avg_inodes ||
+			    sum[bgid].free_blocks < avg_blocks)
+				continue;
+
+			if (best == bg_cnt ||
+			    sum[bgid].used_dirs < sum[best].used_dirs)
+				best = bgid;
 		}
 
-		/* Block group not modified, put it and jump to the next block
-		 * group */
-		ext4_fs_put_block_group_ref(&bg_ref);
-		if (rc != EOK)
-			return rc;
+		if (best != bg_cnt)
+			return best;
+	} else {
+		for (i = 0; i < bg_cnt; i++)
+			ndirs += sum[i].used_dirs;
+
+		max_dirs = (uint32_t)(ndirs / bg_cnt) + inodes_per_group / 16;
+		min_inodes = avg_inodes > inodes_per_group / 4 ?
+			avg_inodes - inodes_per_group / 4 : 1;
+		min_blocks = avg_blocks > blocks_per_group / 4 ?
+			(uint32_t)avg_blocks - blocks_per_group / 4 : 0;
+
+		for (i = 0; i < bg_cnt; i++) {
+			bgid = (parent_bg + i) % bg_cnt;
+			if (sum[bgid].used_dirs < max_dirs &&
+			    sum[bgid].free_inodes >= min_inodes &&
+			    sum[bgid].free_blocks >= min_blocks)
+				return bgid;
+		}
+	}
 
-		++bgid;
+	/* Crowded everywhere: the first group with average free inodes */
+	for (i = 0; i < bg_cnt; i++) {
+		bgid = (parent_bg + i) % bg_cnt;
+		if (sum[bgid].free_inodes && sum[bgid].free_inodes >= avg_inodes)
+			return bgid;
+	}
+
+	return parent_bg;
+}
+
+/**@brief Pick a block group for a new file: the group of the parent
+ *        directory, or a quadratic probe from it for a group with both
+ *        free i-nodes and free blocks.
+ * @param fs        Filesystem
+ * @param sum       Block group counters
+ * @param parent_bg Block group of the parent directory
+ * @return Block group to start the search at
+ */
+static uint32_t ext4_ialloc_find_group_file(struct ext4_fs *fs,
+					    struct ext4_bg_summary *sum,
+					    uint32_t parent_bg)
+{
+	uint32_t bg_cnt = ext4_block_group_cnt(&fs->sb);
+	uint32_t bgid, i;
+
+	if (sum[parent_bg].free_inodes && sum[parent_bg].free_blocks)
+		return parent_bg;
+
+	for (i = 1; i < bg_cnt; i <<= 1) {
+		bgid = (parent_bg + i) % bg_cnt;
+		if (sum[bgid].free_inodes && sum[bgid].free_blocks)
+			return bgid;
+	}
+
+	return parent_bg;
+}
+#endif
+
+int ext4_ialloc_alloc_inode(struct ext4_fs *fs, uint32_t *idx, bool is_dir,
+			    uint32_t parent)
+{
+	struct ext4_sblock *sb = &fs->sb;
+	uint32_t bg_count = ext4_block_group_cnt(sb);
+	uint32_t start = fs->last_inode_bg_id;
+	uint32_t bgid, i;
+	int rc;
+
+	/* Free i-node counters of all groups, without touching descriptor
+	 * blocks (NULL: no memory, fall back to the descriptors) */
+	struct ext4_bg_summary *sum = ext4_fs_bg_summary(fs);
+
+#if CONFIG_IALLOC_ORLOV
+	if (sum && parent) {
+		uint32_t parent_bg = ext4_ialloc_get_bgid_of_inode(sb, parent);
+		if (parent_bg >= bg_count)
+			parent_bg = 0;
+
+		if (is_dir)
+			start = ext4_ialloc_find_group_dir(fs, sum, parent_bg,
+					parent == EXT4_INODE_ROOT_INDEX);
+		else
+			start = ext4_ialloc_find_group_file(fs, sum, parent_bg);
+	}
+#else
+	(void)parent;
+#endif
+	if (start >= bg_count)
+		start = 0;
+
+	/* Chosen group first, then all the others */
+	for (i = 0; i < bg_count; i++) {
+		bgid = (start + i) % bg_count;
+		if (sum && !sum[bgid].free_inodes)
+			continue;
+
+		rc = ext4_ialloc_alloc_in_group(fs, bgid, idx, is_dir);
+		if (rc == EOK)
+			fs->last_inode_bg_id = bgid;
+
+		if (rc != ENOSPC)
+			return rc;
 	}
 
 	return ENOSPC;
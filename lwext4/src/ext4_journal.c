@@ -66,6 +66,39 @@ struct revoke_entry {
 	RB_ENTRY(revoke_entry) revoke_node;
 };
 
+/**@brief  Block to be written during journal replay.*/
+struct replay_entry {
+	/**@brief  Block number to be replayed.*/
+	ext4_fsblk_t block;
+
+	/**@brief  Journal block holding the latest copy.*/
+	uint32_t iblock;
+
+	/**@brief  The copy had its magic number escaped.*/
+	bool is_escape;
+
+	/**@brief  Replay tree node.*/
+	RB_ENTRY(replay_entry) replay_node;
+};
+
+/**@brief  Journal blocks read ahead during replay.*/
+struct jbd_log_window {
+	/**@brief  Allocated memory, buf is aligned inside it.*/
+	void *mem;
+
+	/**@brief  Window buffer.*/
+	uint8_t *buf;
+
+	/**@brief  Window size in blocks.*/
+	uint32_t max;
+
+	/**@brief  First journal block in the window.*/
+	uint32_t first;
+
+	/**@brief  Journal blocks held in the window.*/
+	uint32_t cnt;
+};
+
 /**@brief  Valid journal replay information.*/
 struct recover_info {
 	/**@brief  Starting transaction id.*/
@@ -82,6 +115,12 @@ struct recover_info {
 
 	/**@brief  RB-Tree storing revoke entries.*/
 	RB_HEAD(jbd_revoke, revoke_entry) revoke_root;
+
+	/**@brief  RB-Tree storing blocks to be replayed.*/
+	RB_HEAD(jbd_replay, replay_entry) replay_root;
+
+	/**@brief  Journal read window.*/
+	struct jbd_log_window log;
 };
 
 /**@brief  Journal replay internal arguments.*/
@@ -120,6 +159,16 @@ jbd_revoke_entry_cmp(struct revoke_entry *a, struct revoke_entry *b)
 	return 0;
 }
 
+static int
+jbd_replay_entry_cmp(struct replay_entry *a, struct replay_entry *b)
+{
+	if (a->block > b->block)
+		return 1;
+	else if (a->block < b->block)
+		return -1;
+	return 0;
+}
+
 static int
 jbd_block_rec_cmp(struct jbd_block_rec *a, struct jbd_block_rec *b)
 {
@@ -142,6 +191,8 @@ jbd_revoke_rec_cmp(struct jbd_revoke_rec *a, struct jbd_revoke_rec *b)
 
 RB_GENERATE_INTERNAL(jbd_revoke, revoke_entry, revoke_node,
 		     jbd_revoke_entry_cmp, static inline)
+RB_GENERATE_INTERNAL(jbd_replay, replay_entry, replay_node,
+		     jbd_replay_entry_cmp, static inline)
 RB_GENERATE_INTERNAL(jbd_block, jbd_block_rec, block_rec_node,
 		     jbd_block_rec_cmp, static inline)
 RB_GENERATE_INTERNAL(jbd_revoke_tree, jbd_revoke_rec, revoke_node,
@@ -439,6 +490,61 @@ static int jbd_write_sb(struct jbd_fs *jbd_fs)
 	return rc;
 }
 
+/**@brief  Resolve the journal inode layout into a table of runs, so
+ *         that journal I/O doesn't walk the block map of the inode.
+ * @param  jbd_fs jbd filesystem
+ * @return standard error code*/
+static int jbd_bmap_build(struct jbd_fs *jbd_fs)
+{
+	int rc = EOK;
+	uint32_t len = jbd_get32(&jbd_fs->sb, maxlen);
+	uint32_t max = 0, cnt;
+	ext4_lblk_t iblock;
+	ext4_fsblk_t fblock;
+	struct jbd_bmap_run *run = NULL, *tmp;
+
+	for (iblock = 0; iblock < len; iblock += cnt) {
+		rc = ext4_fs_get_inode_dblk_run(&jbd_fs->inode_ref, iblock,
+						len - iblock, &fblock, &cnt);
+		if (rc != EOK)
+			break;
+
+		if (!fblock)
+			continue;
+
+		if (run && run->iblock + run->cnt == iblock &&
+		    run->fblock + run->cnt == fblock) {
+			run->cnt += cnt;
+			continue;
+		}
+
+		if (jbd_fs->bmap_cnt == max) {
+			max = max ? max * 2 : 4;
+			tmp = ext4_realloc(jbd_fs->bmap, max * sizeof(*tmp));
+			if (!tmp) {
+				rc = ENOMEM;
+				break;
+			}
+			jbd_fs->bmap = tmp;
+		}
+
+		run = &jbd_fs->bmap[jbd_fs->bmap_cnt++];
+		run->iblock = iblock;
+		run->cnt = cnt;
+		run->fblock = fblock;
+	}
+
+	if (rc != EOK) {
+		ext4_free(jbd_fs->bmap);
+		jbd_fs->bmap = NULL;
+		jbd_fs->bmap_cnt = 0;
+	}
+
+	/* Without the table blocks are looked up in the inode */
+	jbd_fs->bmap_hint = 0;
+	return rc == ENOMEM ? EOK : rc;
+}
+
 /**@brief  Get reference to jbd filesystem.
  * @param  fs Filesystem to load journal of
  * @param  jbd_fs jbd filesystem
@@ -470,11 +576,16 @@ int jbd_get_fs(struct ext4_fs *fs,
 		goto Error;
 	}
 
+	rc = jbd_bmap_build(jbd_fs);
+	if (rc != EOK)
+		goto Error;
+
 	if (rc == EOK)
 		jbd_fs->bdev = fs->bdev;
 
 	return rc;
 Error:
+	ext4_free(jbd_fs->bmap);
 	ext4_fs_put_inode_ref(&jbd_fs->inode_ref);
 	memset(jbd_fs, 0, sizeof(struct jbd_fs));
 
@@ -489,6 +600,9 @@ int jbd_put_fs(struct jbd_fs *jbd_fs)
 	int rc = EOK;
 	rc = jbd_write_sb(jbd_fs);
 
+	ext4_free(jbd_fs->bmap);
+	jbd_fs->bmap = NULL;
+	jbd_fs->bmap_cnt = 0;
 	ext4_fs_put_inode_ref(&jbd_fs->inode_ref);
 	return rc;
 }
@@ -502,12 +616,41 @@ int jbd_inode_bmap(struct jbd_fs *jbd_fs,
 		   ext4_lblk_t iblock,
 		   ext4_fsblk_t *fblock)
 {
-	int rc = ext4_fs_get_inode_dblk_idx(
-			&jbd_fs->inode_ref,
-			iblock,
-			fblock,
-			false);
-	return rc;
+	struct jbd_bmap_run *run;
+	uint32_t lo, hi, mid;
+
+	if (!jbd_fs->bmap_cnt)
+		return ext4_fs_get_inode_dblk_idx(&jbd_fs->inode_ref, iblock,
+						  fblock, false);
+
+	/* Journal I/O is sequential: try the last run and the one after
+	 * it before searching. */
+	lo = jbd_fs->bmap_hint;
+	run = &jbd_fs->bmap[lo];
+	if (iblock - run->iblock >= run->cnt && lo + 1 < jbd_fs->bmap_cnt) {
+		run++;
+		if (iblock - run->iblock >= run->cnt) {
+			lo = 0;
+			hi = jbd_fs->bmap_cnt;
+			while (hi - lo > 1) {
+				mid = (lo + hi) / 2;
+				if (jbd_fs->bmap[mid].iblock <= iblock)
+					lo = mid;
+				else
+					hi = mid;
+			}
+			run = &jbd_fs->bmap[lo];
+		}
+	}
+
+	/* Not mapped by the table (hole), ask the inode */
+	if (iblock - run->iblock >= run->cnt)
+		return ext4_fs_get_inode_dblk_idx(&jbd_fs->inode_ref, iblock,
+						  fblock, false);
+
+	jbd_fs->bmap_hint = (uint32_t)(run - jbd_fs->bmap);
+	*fblock = run->fblock + (iblock - run->iblock);
+	return EOK;
 }
 
 /**@brief   jbd block get function (through cache).
@@ -545,31 +688,6 @@ static int jbd_block_get(struct jbd_fs *jbd_fs,
 	return rc;
 }
 
-/**@brief   jbd block get function (through cache, don't read).
- * @param   jbd_fs jbd filesystem
- * @param   block block descriptor
- * @param   fblock jbd logical block address
- * @return  standard error code*/
-static int jbd_block_get_noread(struct jbd_fs *jbd_fs,
-			 struct ext4_block *block,
-			 ext4_fsblk_t fblock)
-{
-	/* TODO: journal device. */
-	int rc;
-	struct ext4_blockdev *bdev = jbd_fs->bdev;
-	ext4_lblk_t iblock = (ext4_lblk_t)fblock;
-	rc = jbd_inode_bmap(jbd_fs, iblock,
-			    &fblock);
-	if (rc != EOK)
-		return rc;
-
-	rc = ext4_block_get_noread(bdev, block, fblock);
-	if (rc == EOK)
-		ext4_bcache_set_flag(block->buf, BC_FLUSH);
-
-	return rc;
-}
-
 /**@brief   jbd block set procedure (through cache).
  * @param   jbd_fs jbd filesystem
  * @param   block block descriptor
@@ -873,42 +991,119 @@ jbd_revoke_entry_lookup(struct recover_info *info, ext4_fsblk_t block)
 	return RB_FIND(jbd_revoke, &info->revoke_root, &tmp);
 }
 
-/**@brief  Replay a block in a transaction.
+/**@brief  Allocate the journal read window of recovery.
+ *         A smaller window is tried when memory is short.
  * @param  jbd_fs jbd filesystem
- * @param  tag_info tag_info of the logged block.*/
-static void jbd_replay_block_tags(struct jbd_fs *jbd_fs,
-				  struct tag_info *tag_info,
-				  void *__arg)
+ * @param  log read window
+ * @return standard error code*/
+static int jbd_log_window_alloc(struct jbd_fs *jbd_fs,
+				struct jbd_log_window *log)
+{
+	uint32_t block_size = jbd_get32(&jbd_fs->sb, blocksize);
+	uint32_t max = CONFIG_JBD_LOG_READAHEAD;
+
+	if (!max)
+		max = 1;
+
+	for (;; max /= 2) {
+		log->mem = ext4_malloc((size_t)max * block_size +
+				       CONFIG_BLOCK_DEV_CACHE_ALIGN - 1);
+		if (log->mem)
+			break;
+
+		if (max == 1)
+			return ENOMEM;
+	}
+
+	log->buf = (uint8_t *)(((uintptr_t)log->mem +
+				CONFIG_BLOCK_DEV_CACHE_ALIGN - 1) &
+			       ~(uintptr_t)(CONFIG_BLOCK_DEV_CACHE_ALIGN - 1));
+	log->max = max;
+	log->first = 0;
+	log->cnt = 0;
+	return EOK;
+}
+
+/**@brief  Get a journal block through the read window. On a miss
+ *         the window is refilled from that block on, blocks adjacent
+ *         on disk are read by a single request.
+ * @param  jbd_fs jbd filesystem
+ * @param  log read window
+ * @param  iblock journal block
+ * @param  data block data
+ * @return standard error code*/
+static int jbd_log_window_read(struct jbd_fs *jbd_fs,
+			       struct jbd_log_window *log,
+			       uint32_t iblock,
+			       void **data)
 {
 	int r;
-	struct replay_arg *arg = __arg;
-	struct recover_info *info = arg->info;
-	uint32_t *this_block = arg->this_block;
-	struct revoke_entry *revoke_entry;
-	struct ext4_block journal_block, ext4_block;
-	struct ext4_fs *fs = jbd_fs->inode_ref.fs;
+	uint32_t block_size = jbd_get32(&jbd_fs->sb, blocksize);
+	uint32_t maxlen = jbd_get32(&jbd_fs->sb, maxlen);
+	uint32_t i, c, n = log->max;
+	ext4_fsblk_t fblock, next;
 
-	(*this_block)++;
-	wrap(&jbd_fs->sb, *this_block);
+	if (iblock >= log->first && iblock - log->first < log->cnt) {
+		*data = log->buf + (size_t)(iblock - log->first) * block_size;
+		return EOK;
+	}
 
-	/* We replay this block only if the current transaction id
-	 * is equal or greater than that in revoke entry.*/
-	revoke_entry = jbd_revoke_entry_lookup(info, tag_info->block);
-	if (revoke_entry &&
-	    trans_id_diff(arg->this_trans_id, revoke_entry->trans_id) <= 0)
-		return;
+	/* The log wraps at the end of the journal. */
+	if (n > maxlen - iblock)
+		n = maxlen - iblock;
 
-	ext4_dbg(DEBUG_JBD,
-		 "Replaying block in block_tag: %" PRIu64 "\n",
-		 tag_info->block);
+	log->first = iblock;
+	log->cnt = 0;
+	for (i = 0; i < n; i += c) {
+		r = jbd_inode_bmap(jbd_fs, iblock + i, &fblock);
+		if (r != EOK) {
+			/* Only the requested block has to be there. */
+			if (i)
+				break;
+
+			return r;
+		}
 
-	r = jbd_block_get(jbd_fs, &journal_block, *this_block);
+		for (c = 1; i + c < n; c++) {
+			r = jbd_inode_bmap(jbd_fs, iblock + i + c, &next);
+			if (r != EOK || next != fblock + c)
+				break;
+		}
+
+		r = ext4_blocks_get_direct(jbd_fs->bdev,
+				log->buf + (size_t)i * block_size,
+				fblock, c);
+		if (r != EOK)
+			return r;
+
+		log->cnt = i + c;
+	}
+
+	*data = log->buf;
+	return EOK;
+}
+
+/**@brief  Replay a logged block right away (through cache).
+ * @param  jbd_fs jbd filesystem
+ * @param  block block number to be replayed
+ * @param  iblock journal block holding the copy
+ * @param  is_escape the copy had its magic number escaped*/
+static void jbd_replay_block(struct jbd_fs *jbd_fs,
+			     ext4_fsblk_t block,
+			     uint32_t iblock,
+			     bool is_escape)
+{
+	int r;
+	struct ext4_block journal_block, ext4_block;
+	struct ext4_fs *fs = jbd_fs->inode_ref.fs;
+
+	r = jbd_block_get(jbd_fs, &journal_block, iblock);
 	if (r != EOK)
 		return;
 
 	/* We need special treatment for ext4 superblock. */
-	if (tag_info->block) {
-		r = ext4_block_get_noread(fs->bdev, &ext4_block, tag_info->block);
+	if (block) {
+		r = ext4_block_get_noread(fs->bdev, &ext4_block, block);
 		if (r != EOK) {
 			jbd_block_set(jbd_fs, &journal_block);
 			return;
@@ -918,7 +1113,7 @@ static void jbd_replay_block_tags(struct jbd_fs *jbd_fs,
 			journal_block.data,
 			jbd_get32(&jbd_fs->sb, blocksize));
 
-		if (tag_info->is_escape)
+		if (is_escape)
 			((struct jbd_bhdr *)ext4_block.data)->magic =
 					to_be32(JBD_MAGIC_NUMBER);
 
@@ -944,8 +1139,157 @@ static void jbd_replay_block_tags(struct jbd_fs *jbd_fs,
 	}
 
 	jbd_block_set(jbd_fs, &journal_block);
-	
-	return;
+}
+
+/**@brief  Replay a block in a transaction.
+ * @param  jbd_fs jbd filesystem
+ * @param  tag_info tag_info of the logged block.*/
+static void jbd_replay_block_tags(struct jbd_fs *jbd_fs,
+				  struct tag_info *tag_info,
+				  void *__arg)
+{
+	struct replay_arg *arg = __arg;
+	struct recover_info *info = arg->info;
+	uint32_t *this_block = arg->this_block;
+	struct revoke_entry *revoke_entry;
+	struct replay_entry *replay_entry;
+	struct replay_entry tmp = {
+		.block = tag_info->block
+	};
+
+	(*this_block)++;
+	wrap(&jbd_fs->sb, *this_block);
+
+	/* We replay this block only if the current transaction id
+	 * is equal or greater than that in revoke entry.*/
+	revoke_entry = jbd_revoke_entry_lookup(info, tag_info->block);
+	if (revoke_entry &&
+	    trans_id_diff(arg->this_trans_id, revoke_entry->trans_id) <= 0)
+		return;
+
+	ext4_dbg(DEBUG_JBD,
+		 "Replaying block in block_tag: %" PRIu64 "\n",
+		 tag_info->block);
+
+	/* Only the latest copy of a block is written, after the
+	 * whole log has been gone through. */
+	replay_entry = RB_FIND(jbd_replay, &info->replay_root, &tmp);
+	if (!replay_entry && tag_info->block) {
+		replay_entry = ext4_calloc(1, sizeof(struct replay_entry));
+		if (replay_entry) {
+			replay_entry->block = tag_info->block;
+			RB_INSERT(jbd_replay, &info->replay_root,
+				  replay_entry);
+		}
+	}
+	if (replay_entry) {
+		replay_entry->iblock = *this_block;
+		replay_entry->is_escape = tag_info->is_escape;
+		return;
+	}
+
+	/* The superblock, or no memory left to defer the block. */
+	jbd_replay_block(jbd_fs, tag_info->block, *this_block,
+			 tag_info->is_escape);
+}
+
+/**@brief  Write a run of replayed blocks with adjacent block numbers.
+ * @param  jbd_fs jbd filesystem
+ * @param  info journal replay info
+ * @param  run first entry of the run
+ * @param  cnt entries in the run
+ * @return standard error code*/
+static int jbd_replay_run(struct jbd_fs *jbd_fs,
+			  struct recover_info *info,
+			  struct replay_entry *run,
+			  uint32_t cnt)
+{
+	int r = EOK;
+	struct ext4_blockdev *bdev = jbd_fs->bdev;
+	uint32_t block_size = jbd_get32(&jbd_fs->sb, blocksize);
+	uint8_t *buf = info->log.buf;
+	struct replay_entry *entry, *first;
+	ext4_fsblk_t fblock, next;
+	uint32_t i, c;
+
+	/* The window memory holds the run now. */
+	info->log.cnt = 0;
+
+	/* Latest copies sitting next to each other in the journal are
+	 * read together. */
+	entry = run;
+	for (i = 0; i < cnt; i += c) {
+		first = entry;
+		r = jbd_inode_bmap(jbd_fs, first->iblock, &fblock);
+		if (r != EOK)
+			return r;
+
+		entry = RB_NEXT(jbd_replay, &info->replay_root, first);
+		for (c = 1; i + c < cnt; c++) {
+			if (entry->iblock != first->iblock + c)
+				break;
+
+			r = jbd_inode_bmap(jbd_fs, entry->iblock, &next);
+			if (r != EOK || next != fblock + c)
+				break;
+
+			entry = RB_NEXT(jbd_replay, &info->replay_root, entry);
+		}
+
+		r = ext4_blocks_get_direct(bdev, buf + (size_t)i * block_size,
+					   fblock, c);
+		if (r != EOK)
+			return r;
+	}
+
+	for (i = 0, entry = run; i < cnt; i++) {
+		if (entry->is_escape)
+			((struct jbd_bhdr *)(buf + (size_t)i * block_size))
+				->magic = to_be32(JBD_MAGIC_NUMBER);
+
+		entry = RB_NEXT(jbd_replay, &info->replay_root, entry);
+	}
+
+	ext4_bcache_invalidate_lba(bdev->bc, run->block, cnt);
+	return ext4_blocks_set_direct(bdev, buf, run->block, cnt);
+}
+
+/**@brief  Write the blocks collected by journal replay, in block
+ *         number order.
+ * @param  jbd_fs jbd filesystem
+ * @param  info journal replay info
+ * @return standard error code*/
+static int jbd_replay_write(struct jbd_fs *jbd_fs,
+			    struct recover_info *info)
+{
+	int r = EOK;
+	struct replay_entry *entry, *run;
+	uint32_t cnt;
+
+	entry = RB_MIN(jbd_replay, &info->replay_root);
+	while (entry && r == EOK) {
+		run = entry;
+		cnt = 0;
+		do {
+			cnt++;
+			entry = RB_NEXT(jbd_replay, &info->replay_root, entry);
+		} while (entry && cnt < info->log.max &&
+			 entry->block == run->block + cnt);
+
+		r = jbd_replay_run(jbd_fs, info, run, cnt);
+	}
+
+	return r;
+}
+
+static void jbd_destroy_replay_tree(struct recover_info *info)
+{
+	while (!RB_EMPTY(&info->replay_root)) {
+		struct replay_entry *replay_entry =
+			RB_MIN(jbd_replay, &info->replay_root);
+		RB_REMOVE(jbd_replay, &info->replay_root, replay_entry);
+		ext4_free(replay_entry);
+	}
 }
 
 /**@brief  Add block address to revoke tree, along with
@@ -1068,6 +1412,10 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 	uint32_t start_trans_id, this_trans_id;
 	uint32_t start_block, this_block;
 
+	/* The scan verifies every block up to the last valid
+	 * transaction, later passes stop there. */
+	bool verify = action == ACTION_SCAN;
+
 	/* We start iterating valid blocks in the whole journal.*/
 	start_trans_id = this_trans_id = jbd_get32(sb, sequence);
 	start_block = this_block = jbd_get32(sb, start);
@@ -1080,7 +1428,7 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 			    start_trans_id);
 
 	while (!log_end) {
-		struct ext4_block block;
+		void *data;
 		struct jbd_bhdr *header;
 		/* If we are not scanning for the last
 		 * valid transaction in the journal,
@@ -1092,15 +1440,14 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 				continue;
 			}
 
-		r = jbd_block_get(jbd_fs, &block, this_block);
+		r = jbd_log_window_read(jbd_fs, &info->log, this_block, &data);
 		if (r != EOK)
 			break;
 
-		header = (struct jbd_bhdr *)block.data;
+		header = data;
 		/* This block does not have a valid magic number,
 		 * so we have reached the end of the journal.*/
 		if (jbd_get32(header, magic) != JBD_MAGIC_NUMBER) {
-			jbd_block_set(jbd_fs, &block);
 			log_end = true;
 			continue;
 		}
@@ -1114,14 +1461,13 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 			if (action != ACTION_SCAN)
 				r = EIO;
 
-			jbd_block_set(jbd_fs, &block);
 			log_end = true;
 			continue;
 		}
 
 		switch (jbd_get32(header, blocktype)) {
 		case JBD_DESCRIPTOR_BLOCK:
-			if (!jbd_verify_meta_csum(jbd_fs, header)) {
+			if (verify && !jbd_verify_meta_csum(jbd_fs, header)) {
 				ext4_dbg(DEBUG_JBD,
 					DBG_WARN "Descriptor block checksum failed."
 						"Journal block: %" PRIu32"\n",
@@ -1146,7 +1492,8 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 
 			break;
 		case JBD_COMMIT_BLOCK:
-			if (!jbd_verify_commit_csum(jbd_fs,
+			if (verify &&
+			    !jbd_verify_commit_csum(jbd_fs,
 					(struct jbd_commit_header *)header)) {
 				ext4_dbg(DEBUG_JBD,
 					DBG_WARN "Commit block checksum failed."
@@ -1167,7 +1514,7 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 				info->trans_cnt++;
 			break;
 		case JBD_REVOKE_BLOCK:
-			if (!jbd_verify_meta_csum(jbd_fs, header)) {
+			if (verify && !jbd_verify_meta_csum(jbd_fs, header)) {
 				ext4_dbg(DEBUG_JBD,
 					DBG_WARN "Revoke block checksum failed."
 						"Journal block: %" PRIu32"\n",
@@ -1188,7 +1535,6 @@ static int jbd_iterate_log(struct jbd_fs *jbd_fs,
 			log_end = true;
 			break;
 		}
-		jbd_block_set(jbd_fs, &block);
 		this_block++;
 		wrap(sb, this_block);
 		if (this_block == start_block)
@@ -1220,16 +1566,23 @@ int jbd_recover(struct jbd_fs *jbd_fs)
 		return EOK;
 
 	RB_INIT(&info.revoke_root);
+	RB_INIT(&info.replay_root);
+	r = jbd_log_window_alloc(jbd_fs, &info.log);
+	if (r != EOK)
+		return r;
 
 	r = jbd_iterate_log(jbd_fs, &info, ACTION_SCAN);
 	if (r != EOK)
-		return r;
+		goto Finish;
 
 	r = jbd_iterate_log(jbd_fs, &info, ACTION_REVOKE);
 	if (r != EOK)
-		return r;
+		goto Finish;
 
 	r = jbd_iterate_log(jbd_fs, &info, ACTION_RECOVER);
+	if (r == EOK)
+		r = jbd_replay_write(jbd_fs, &info);
+
 	if (r == EOK) {
 		/* If we successfully replay the journal,
 		 * clear EXT4_FINCOM_RECOVER flag on the
@@ -1248,7 +1601,10 @@ int jbd_recover(struct jbd_fs *jbd_fs)
 		r = ext4_sb_write(jbd_fs->bdev,
 				  &jbd_fs->inode_ref.fs->sb);
 	}
+Finish:
+	jbd_destroy_replay_tree(&info);
 	jbd_destroy_revoke_tree(&info);
+	ext4_free(info.log.mem);
 	return r;
 }
 
@@ -1260,6 +1616,120 @@ static void jbd_journal_write_sb(struct jbd_journal *journal)
 	jbd_fs->dirty = true;
 }
 
+/**@brief  Allocate the buffer commits assemble log blocks in.
+ *         A smaller buffer is tried when memory is short.
+ * @param  journal current journal session
+ * @return standard error code*/
+static int jbd_log_stage_alloc(struct jbd_journal *journal)
+{
+	uint32_t max = CONFIG_JBD_LOG_STAGE;
+
+	/* A descriptor block and one data block at least. */
+	if (max < 2)
+		max = 2;
+
+	for (;; max /= 2) {
+		journal->stage_mem = ext4_malloc((size_t)max *
+						 journal->block_size +
+						 CONFIG_BLOCK_DEV_CACHE_ALIGN - 1);
+		journal->stage_iblock = ext4_malloc(max * sizeof(uint32_t));
+		if (journal->stage_mem && journal->stage_iblock)
+			break;
+
+		ext4_free(journal->stage_mem);
+		ext4_free(journal->stage_iblock);
+		journal->stage_mem = NULL;
+		journal->stage_iblock = NULL;
+		if (max <= 2)
+			return ENOMEM;
+	}
+
+	journal->stage = (uint8_t *)(((uintptr_t)journal->stage_mem +
+				      CONFIG_BLOCK_DEV_CACHE_ALIGN - 1) &
+				     ~(uintptr_t)(CONFIG_BLOCK_DEV_CACHE_ALIGN - 1));
+	journal->stage_max = max;
+	journal->stage_cnt = 0;
+	return EOK;
+}
+
+/**@brief  Release the log block buffer.
+ * @param  journal current journal session*/
+static void jbd_log_stage_free(struct jbd_journal *journal)
+{
+	ext4_free(journal->stage_mem);
+	ext4_free(journal->stage_iblock);
+	journal->stage_mem = NULL;
+	journal->stage = NULL;
+	journal->stage_iblock = NULL;
+	journal->stage_max = 0;
+	journal->stage_cnt = 0;
+}
+
+/**@brief  Take the next free block of the log block buffer.
+ * @param  journal current journal session
+ * @param  iblock journal block the buffer block is written to
+ * @return zeroed block sized buffer*/
+static void *jbd_log_stage_get(struct jbd_journal *journal,
+			       uint32_t iblock)
+{
+	uint8_t *data;
+
+	ext4_assert(journal->stage_cnt < journal->stage_max);
+	data = journal->stage +
+	       (size_t)journal->stage_cnt * journal->block_size;
+	journal->stage_iblock[journal->stage_cnt++] = iblock;
+	memset(data, 0, journal->block_size);
+	return data;
+}
+
+/**@brief  Write out the log block buffer. Blocks adjacent on disk
+ *         go out in a single request.
+ * @param  journal current journal session
+ * @return standard error code*/
+static int jbd_log_flush(struct jbd_journal *journal)
+{
+	int rc = EOK;
+	uint32_t i, n;
+	ext4_fsblk_t fblock, next;
+	struct jbd_fs *jbd_fs = journal->jbd_fs;
+	struct ext4_blockdev *bdev = jbd_fs->bdev;
+
+	for (i = 0; i < journal->stage_cnt; i += n) {
+		rc = jbd_inode_bmap(jbd_fs, journal->stage_iblock[i], &fblock);
+		if (rc != EOK)
+			break;
+
+		for (n = 1; i + n < journal->stage_cnt; n++) {
+			if (journal->stage_iblock[i + n] !=
+			    journal->stage_iblock[i] + n)
+				break;
+
+			rc = jbd_inode_bmap(jbd_fs,
+					    journal->stage_iblock[i + n],
+					    &next);
+			if (rc != EOK)
+				break;
+			if (next != fblock + n)
+				break;
+		}
+		if (rc != EOK)
+			break;
+
+		/* Log blocks are never cached for long, but a copy read
+		 * back by a checkpoint must not outlive its rewrite. */
+		ext4_bcache_invalidate_lba(bdev->bc, fblock, n);
+		rc = ext4_blocks_set_direct(bdev,
+				journal->stage +
+				(size_t)i * journal->block_size,
+				fblock, n);
+		if (rc != EOK)
+			break;
+	}
+
+	journal->stage_cnt = 0;
+	return rc;
+}
+
 /**@brief  Start accessing the journal.
  * @param  jbd_fs jbd filesystem
  * @param  journal current journal session
@@ -1296,10 +1766,16 @@ int jbd_journal_start(struct jbd_fs *jbd_fs,
 	TAILQ_INIT(&journal->cp_queue);
 	RB_INIT(&journal->block_rec_root);
 	journal->jbd_fs = jbd_fs;
+	r = jbd_log_stage_alloc(journal);
+	if (r != EOK)
+		return r;
+
 	jbd_journal_write_sb(journal);
 	r = jbd_write_sb(jbd_fs);
-	if (r != EOK)
+	if (r != EOK) {
+		jbd_log_stage_free(journal);
 		return r;
+	}
 
 	jbd_fs->bdev->journal = journal;
 	return EOK;
@@ -1310,6 +1786,47 @@ static void jbd_trans_end_write(struct ext4_bcache *bc __unused,
 			  int res,
 			  void *arg);
 
+/**@brief  Write back a buffer of a committed transaction. The cached
+ *         block is written when it still holds this transaction's
+ *         data, the journal copy otherwise.
+ * @param  journal current journal session
+ * @param  jbd_buf buffer to be written back
+ * @param  tmp_data block sized bounce buffer
+ * @return standard error code*/
+static int jbd_journal_flush_buf(struct jbd_journal *journal,
+				 struct jbd_buf *jbd_buf,
+				 void *tmp_data)
+{
+	int r;
+	struct ext4_fs *fs = journal->jbd_fs->inode_ref.fs;
+	struct ext4_buf *buf;
+	struct ext4_block block;
+
+	/* The buffer is not yet flushed. */
+	buf = ext4_bcache_find_get(fs->bdev->bc, &block,
+				   jbd_buf->block_rec->lba);
+	if (!(buf && ext4_bcache_test_flag(buf, BC_UPTODATE) &&
+	      jbd_buf->block_rec->trans == jbd_buf->trans)) {
+		struct ext4_block jbd_block = EXT4_BLOCK_ZERO();
+		r = jbd_block_get(journal->jbd_fs,
+					&jbd_block,
+					jbd_buf->jbd_lba);
+		ext4_assert(r == EOK);
+		memcpy(tmp_data, jbd_block.data,
+				journal->block_size);
+		ext4_block_set(fs->bdev, &jbd_block);
+		r = ext4_blocks_set_direct(fs->bdev, tmp_data,
+				jbd_buf->block_rec->lba, 1);
+		jbd_trans_end_write(fs->bdev->bc, buf, r, jbd_buf);
+	} else
+		r = ext4_block_flush_buf(fs->bdev, buf);
+
+	if (buf)
+		ext4_block_set(fs->bdev, &block);
+
+	return r;
+}
+
 /*
  * This routine is only suitable to committed transactions. */
 static void jbd_journal_flush_trans(struct jbd_trans *trans)
@@ -1317,36 +1834,19 @@ static void jbd_journal_flush_trans(struct jbd_trans *trans)
 	struct jbd_buf *jbd_buf, *tmp;
 	struct jbd_journal *journal = trans->journal;
 	struct ext4_fs *fs = journal->jbd_fs->inode_ref.fs;
+	struct ext4_bcache *bc = fs->bdev->bc;
 	void *tmp_data = ext4_malloc(journal->block_size);
+	bool dont_shake = bc->dont_shake;
 	ext4_assert(tmp_data);
 
+	/* A cache shake could write back (and release) other buffers
+	 * of this transaction while we walk its buffer list. */
+	bc->dont_shake = true;
 	TAILQ_FOREACH_SAFE(jbd_buf, &trans->buf_queue, buf_node,
-			tmp) {
-		struct ext4_buf *buf;
-		struct ext4_block block;
-		/* The buffer is not yet flushed. */
-		buf = ext4_bcache_find_get(fs->bdev->bc, &block,
-					   jbd_buf->block_rec->lba);
-		if (!(buf && ext4_bcache_test_flag(buf, BC_UPTODATE) &&
-		      jbd_buf->block_rec->trans == trans)) {
-			int r;
-			struct ext4_block jbd_block = EXT4_BLOCK_ZERO();
-			r = jbd_block_get(journal->jbd_fs,
-						&jbd_block,
-						jbd_buf->jbd_lba);
-			ext4_assert(r == EOK);
-			memcpy(tmp_data, jbd_block.data,
-					journal->block_size);
-			ext4_block_set(fs->bdev, &jbd_block);
-			r = ext4_blocks_set_direct(fs->bdev, tmp_data,
-					jbd_buf->block_rec->lba, 1);
-			jbd_trans_end_write(fs->bdev->bc, buf, r, jbd_buf);
-		} else
-			ext4_block_flush_buf(fs->bdev, buf);
+			tmp)
+		jbd_journal_flush_buf(journal, jbd_buf, tmp_data);
 
-		if (buf)
-			ext4_block_set(fs->bdev, &block);
-	}
+	bc->dont_shake = dont_shake;
 
 	ext4_free(tmp_data);
 }
@@ -1422,6 +1922,7 @@ int jbd_journal_stop(struct jbd_journal *journal)
 	/* Make sure that journalled content have reached
 	 * the disk.*/
 	jbd_journal_purge_cp_trans(journal, true, false);
+	jbd_log_stage_free(journal);
 
 	/* There should be no block record in this journal
 	 * session. */
@@ -1442,8 +1943,11 @@ int jbd_journal_stop(struct jbd_journal *journal)
 	if (r != EOK)
 		return r;
 
+	/* Log blocks of this session stay in the journal: the next one
+	 * has to go on with higher transaction ids, or its recovery may
+	 * take them for its own transactions. */
 	journal->start = 0;
-	journal->trans_id = 0;
+	journal->trans_id = journal->alloc_trans_id;
 	jbd_journal_write_sb(journal);
 	return jbd_write_sb(journal->jbd_fs);
 }
@@ -1484,6 +1988,167 @@ jbd_trans_block_rec_lookup(struct jbd_journal *journal,
 		       &tmp);
 }
 
+/**@brief  Journal blocks not taken by transactions waiting for
+ *         checkpoint.
+ * @param  journal current journal session
+ * @return free journal blocks*/
+uint32_t jbd_journal_free_blocks(struct jbd_journal *journal)
+{
+	uint32_t len = jbd_get32(&journal->jbd_fs->sb, maxlen) -
+		       journal->first;
+
+	if (journal->last >= journal->start)
+		return len - (journal->last - journal->start);
+
+	return journal->start - journal->last;
+}
+
+static int jbd_lba_cmp(const void *a, const void *b)
+{
+	ext4_fsblk_t x = *(const ext4_fsblk_t *)a;
+	ext4_fsblk_t y = *(const ext4_fsblk_t *)b;
+
+	if (x > y)
+		return 1;
+	else if (x < y)
+		return -1;
+	return 0;
+}
+
+/**@brief  Checkpoint a block logged by the selected transactions.
+ *         Only the newest selected copy is written, the older ones
+ *         are complete with it.
+ * @param  journal current journal session
+ * @param  lba block address
+ * @param  tmp_data block sized bounce buffer
+ * @return standard error code*/
+static int jbd_journal_cp_block(struct jbd_journal *journal,
+				ext4_fsblk_t lba,
+				void *tmp_data)
+{
+	int r;
+	struct ext4_bcache *bc = journal->jbd_fs->bdev->bc;
+	struct jbd_block_rec *block_rec;
+	struct jbd_buf *jbd_buf, *newest = NULL;
+
+	block_rec = jbd_trans_block_rec_lookup(journal, lba);
+	if (!block_rec)
+		return EOK;
+
+	TAILQ_FOREACH(jbd_buf, &block_rec->dirty_buf_queue, dirty_buf_node)
+		if (jbd_buf->trans->checkpoint)
+			newest = jbd_buf;
+
+	if (!newest)
+		return EOK;
+
+	r = jbd_journal_flush_buf(journal, newest, tmp_data);
+	if (r != EOK)
+		return r;
+
+	/* Completing a buffer may release transactions and their block
+	 * records, so look the block up again every time. */
+	while ((block_rec = jbd_trans_block_rec_lookup(journal, lba))) {
+		TAILQ_FOREACH(jbd_buf, &block_rec->dirty_buf_queue,
+			      dirty_buf_node)
+			if (jbd_buf->trans->checkpoint)
+				break;
+
+		if (!jbd_buf || jbd_buf == newest)
+			break;
+
+		jbd_trans_end_write(bc, NULL, EOK, jbd_buf);
+	}
+
+	return EOK;
+}
+
+/**@brief  Checkpoint the oldest committed transactions until the
+ *         journal has the requested number of free blocks. Their
+ *         blocks are written back in block number order, and the tail
+ *         of the journal is moved past them.
+ * @param  journal current journal session
+ * @param  free_blocks free journal blocks wanted
+ *         (0 - checkpoint every committed transaction)
+ * @return standard error code*/
+int jbd_journal_checkpoint(struct jbd_journal *journal,
+			   uint32_t free_blocks)
+{
+	int r = EOK;
+	struct ext4_bcache *bc = journal->jbd_fs->bdev->bc;
+	uint32_t len = jbd_get32(&journal->jbd_fs->sb, maxlen) -
+		       journal->first;
+	uint32_t avail = jbd_journal_free_blocks(journal);
+	uint32_t cnt = 0, i, j;
+	ext4_fsblk_t *lbas = NULL;
+	struct jbd_trans *trans;
+	struct jbd_buf *jbd_buf;
+	void *tmp_data;
+	bool dont_shake;
+
+	if (!free_blocks || free_blocks > len)
+		free_blocks = len;
+
+	if (avail >= free_blocks)
+		return EOK;
+
+	/* Select the oldest transactions holding enough log space. */
+	TAILQ_FOREACH(trans, &journal->cp_queue, trans_node) {
+		trans->checkpoint = true;
+		TAILQ_FOREACH(jbd_buf, &trans->buf_queue, buf_node)
+			cnt++;
+
+		avail += trans->alloc_blocks;
+		if (avail >= free_blocks)
+			break;
+	}
+
+	tmp_data = ext4_malloc(journal->block_size);
+	if (cnt)
+		lbas = ext4_malloc(cnt * sizeof(ext4_fsblk_t));
+
+	if (!tmp_data || (cnt && !lbas)) {
+		r = ENOMEM;
+		goto Finish;
+	}
+
+	i = 0;
+	TAILQ_FOREACH(trans, &journal->cp_queue, trans_node) {
+		if (!trans->checkpoint)
+			break;
+
+		TAILQ_FOREACH(jbd_buf, &trans->buf_queue, buf_node)
+			lbas[i++] = jbd_buf->block_rec->lba;
+	}
+	if (cnt > 1)
+		qsort(lbas, cnt, sizeof(ext4_fsblk_t), jbd_lba_cmp);
+
+	/* A cache shake could write back (and release) buffers of the
+	 * selected transactions behind our back. */
+	dont_shake = bc->dont_shake;
+	bc->dont_shake = true;
+	for (i = 0; i < cnt && r == EOK; i = j) {
+		for (j = i + 1; j < cnt && lbas[j] == lbas[i]; j++)
+			;
+
+		r = jbd_journal_cp_block(journal, lbas[i], tmp_data);
+	}
+	bc->dont_shake = dont_shake;
+
+Finish:
+	/* Transactions which are still there were not written back. */
+	TAILQ_FOREACH(trans, &journal->cp_queue, trans_node)
+		trans->checkpoint = false;
+
+	jbd_journal_purge_cp_trans(journal, false, false);
+	if (r == EOK)
+		r = jbd_write_sb(journal->jbd_fs);
+
+	ext4_free(lbas);
+	ext4_free(tmp_data);
+	return r;
+}
+
 static void
 jbd_trans_change_ownership(struct jbd_block_rec *block_rec,
 			   struct jbd_trans *new_trans)
@@ -1770,18 +2435,18 @@ void jbd_journal_free_trans(struct jbd_journal *journal,
 static int jbd_trans_write_commit_block(struct jbd_trans *trans)
 {
 	int rc;
-	struct ext4_block block;
 	struct jbd_commit_header *header;
 	uint32_t commit_iblock;
 	struct jbd_journal *journal = trans->journal;
 
-	commit_iblock = jbd_journal_alloc_block(journal, trans);
-
-	rc = jbd_block_get_noread(journal->jbd_fs, &block, commit_iblock);
+	/* The commit block may only reach the disk after every other
+	 * log block of the transaction did. */
+	rc = jbd_log_flush(journal);
 	if (rc != EOK)
 		return rc;
 
-	header = (struct jbd_commit_header *)block.data;
+	commit_iblock = jbd_journal_alloc_block(journal, trans);
+	header = jbd_log_stage_get(journal, commit_iblock);
 	jbd_set32(&header->header, magic, JBD_MAGIC_NUMBER);
 	jbd_set32(&header->header, blocktype, JBD_COMMIT_BLOCK);
 	jbd_set32(&header->header, sequence, trans->trans_id);
@@ -1793,10 +2458,7 @@ static int jbd_trans_write_commit_block(struct jbd_trans *trans)
 		jbd_set32(header, chksum[0], trans->data_csum);
 	}
 	jbd_commit_csum_set(journal->jbd_fs, header);
-	ext4_bcache_set_dirty(block.buf);
-	ext4_bcache_set_flag(block.buf, BC_TMP);
-	rc = jbd_block_set(journal->jbd_fs, &block);
-	return rc;
+	return jbd_log_flush(journal);
 }
 
 /**@brief  Write descriptor block for a transaction
@@ -1807,8 +2469,6 @@ static int jbd_journal_prepare(struct jbd_journal *journal,
 			       struct jbd_trans *trans)
 {
 	int rc = EOK, i = 0;
-	struct ext4_block desc_block = EXT4_BLOCK_ZERO(),
-			  data_block = EXT4_BLOCK_ZERO();
 	int32_t tag_tbl_size = 0;
 	uint32_t desc_iblock = 0;
 	uint32_t data_iblock = 0;
@@ -1897,12 +2557,15 @@ static int jbd_journal_prepare(struct jbd_journal *journal,
 
 again:
 		if (!desc_iblock) {
-			desc_iblock = jbd_journal_alloc_block(journal, trans);
-			rc = jbd_block_get_noread(journal->jbd_fs, &desc_block, desc_iblock);
-			if (rc != EOK)
-				break;
+			/* Room for the descriptor and a data block. */
+			if (journal->stage_cnt + 2 > journal->stage_max) {
+				rc = jbd_log_flush(journal);
+				if (rc != EOK)
+					break;
+			}
 
-			bhdr = (struct jbd_bhdr *)desc_block.data;
+			desc_iblock = jbd_journal_alloc_block(journal, trans);
+			bhdr = jbd_log_stage_get(journal, desc_iblock);
 			jbd_set32(bhdr, magic, JBD_MAGIC_NUMBER);
 			jbd_set32(bhdr, blocktype, JBD_DESCRIPTOR_BLOCK);
 			jbd_set32(bhdr, sequence, trans->trans_id);
@@ -1918,14 +2581,15 @@ again:
 
 			if (!trans->start_iblock)
 				trans->start_iblock = desc_iblock;
-
-			ext4_bcache_set_dirty(desc_block.buf);
-			ext4_bcache_set_flag(desc_block.buf, BC_TMP);
 		}
 		tag_info.block = jbd_buf->block.lb_id;
 		tag_info.uuid_exist = uuid_exist;
 		tag_info.is_escape = is_escape;
-		if (i == trans->data_cnt - 1)
+
+		/* A descriptor also ends where the buffer fills up,
+		 * it has to be complete before it is written out. */
+		if (i == trans->data_cnt - 1 ||
+		    journal->stage_cnt + 1 == journal->stage_max)
 			tag_info.last_tag = true;
 		else
 			tag_info.last_tag = false;
@@ -1943,50 +2607,34 @@ again:
 		if (rc != EOK) {
 			jbd_meta_csum_set(journal->jbd_fs, bhdr);
 			desc_iblock = 0;
-			rc = jbd_block_set(journal->jbd_fs, &desc_block);
-			if (rc != EOK)
-				break;
-
+			rc = EOK;
 			goto again;
 		}
 
 		data_iblock = jbd_journal_alloc_block(journal, trans);
-		rc = jbd_block_get_noread(journal->jbd_fs, &data_block, data_iblock);
-		if (rc != EOK) {
-			desc_iblock = 0;
-			ext4_bcache_clear_dirty(desc_block.buf);
-			jbd_block_set(journal->jbd_fs, &desc_block);
-			break;
-		}
-
-		data = data_block.data;
+		data = jbd_log_stage_get(journal, data_iblock);
 		memcpy(data, jbd_buf->block.data,
 			journal->block_size);
 		if (is_escape)
 			((struct jbd_bhdr *)data)->magic = 0;
 
-		ext4_bcache_set_dirty(data_block.buf);
-		ext4_bcache_set_flag(data_block.buf, BC_TMP);
-		rc = jbd_block_set(journal->jbd_fs, &data_block);
-		if (rc != EOK) {
-			desc_iblock = 0;
-			ext4_bcache_clear_dirty(desc_block.buf);
-			jbd_block_set(journal->jbd_fs, &desc_block);
-			break;
-		}
 		jbd_buf->jbd_lba = data_iblock;
 
 		tag_ptr += tag_info.tag_bytes;
 		tag_tbl_size -= tag_info.tag_bytes;
 
 		i++;
+		if (tag_info.last_tag) {
+			jbd_meta_csum_set(journal->jbd_fs, bhdr);
+			desc_iblock = 0;
+		}
 	}
-	if (rc == EOK && desc_iblock) {
+	if (rc == EOK && desc_iblock)
 		jbd_meta_csum_set(journal->jbd_fs,
 				(struct jbd_bhdr *)bhdr);
+
+	if (rc == EOK)
 		trans->data_csum = checksum;
-		rc = jbd_block_set(journal->jbd_fs, &desc_block);
-	}
 
 	return rc;
 }
@@ -2000,7 +2648,6 @@ jbd_journal_prepare_revoke(struct jbd_journal *journal,
 			   struct jbd_trans *trans)
 {
 	int rc = EOK, i = 0;
-	struct ext4_block desc_block = EXT4_BLOCK_ZERO();
 	int32_t tag_tbl_size = 0;
 	uint32_t desc_iblock = 0;
 	char *blocks_entry = NULL;
@@ -2017,13 +2664,14 @@ jbd_journal_prepare_revoke(struct jbd_journal *journal,
 			  tmp) {
 again:
 		if (!desc_iblock) {
-			desc_iblock = jbd_journal_alloc_block(journal, trans);
-			rc = jbd_block_get_noread(journal->jbd_fs, &desc_block,
-						  desc_iblock);
-			if (rc != EOK)
-				break;
+			if (journal->stage_cnt == journal->stage_max) {
+				rc = jbd_log_flush(journal);
+				if (rc != EOK)
+					break;
+			}
 
-			bhdr = (struct jbd_bhdr *)desc_block.data;
+			desc_iblock = jbd_journal_alloc_block(journal, trans);
+			bhdr = jbd_log_stage_get(journal, desc_iblock);
 			jbd_set32(bhdr, magic, JBD_MAGIC_NUMBER);
 			jbd_set32(bhdr, blocktype, JBD_REVOKE_BLOCK);
 			jbd_set32(bhdr, sequence, trans->trans_id);
@@ -2038,9 +2686,6 @@ again:
 
 			if (!trans->start_iblock)
 				trans->start_iblock = desc_iblock;
-
-			ext4_bcache_set_dirty(desc_block.buf);
-			ext4_bcache_set_flag(desc_block.buf, BC_TMP);
 		}
 
 		if (tag_tbl_size < record_len) {
@@ -2050,10 +2695,6 @@ again:
 			bhdr = NULL;
 			desc_iblock = 0;
 			header = NULL;
-			rc = jbd_block_set(journal->jbd_fs, &desc_block);
-			if (rc != EOK)
-				break;
-
 			goto again;
 		}
 		if (record_len == 8) {
@@ -2076,7 +2717,6 @@ again:
 				  journal->block_size - tag_tbl_size);
 
 		jbd_meta_csum_set(journal->jbd_fs, bhdr);
-		rc = jbd_block_set(journal->jbd_fs, &desc_block);
 	}
 
 	return rc;
@@ -2248,6 +2888,8 @@ static int __jbd_journal_commit_trans(struct jbd_journal *journal,
 			jbd_journal_cp_trans(journal, trans);
 	}
 Finish:
+	/* Drop log blocks that did not make it out. */
+	journal->stage_cnt = 0;
 	if (rc != EOK && rc != ENOSPC) {
 		journal->last = last;
 		jbd_journal_free_trans(journal, trans, true);
@@ -359,15 +359,18 @@ static int write_bgroups(struct ext4_blockdev *bd, struct fs_aux_info *aux_info,
 		uint32_t blk_off = 0;
 
 		bg_desc = (void *)(aux_info->bg_desc_blk + k * dsc_size);
-		bg_free_blk = info->blocks_per_group -
-				aux_info->inode_table_blocks;
+		bg_free_blk = info->blocks_per_group;
 
+		/* Last group may be shorter */
+		if (i == (aux_info->groups - 1))
+			bg_free_blk = (uint32_t)(aux_info->len_blocks -
+				aux_info->first_data_block -
+				(uint64_t)i * info->blocks_per_group);
+
+		bg_free_blk -= aux_info->inode_table_blocks;
 		bg_free_blk -= 2;
 		blk_off += aux_info->bg_desc_blocks;
 
-		if (i == (aux_info->groups - 1))
-			bg_free_blk -= aux_info->first_data_block;
-
 		if (has_superblock(info, i)) {
 			bg_start_block++;
 			blk_off += info->bg_desc_reserve_blocks;
@@ -397,8 +400,20 @@ static int write_bgroups(struct ext4_blockdev *bd, struct fs_aux_info *aux_info,
 				 EXT4_BLOCK_GROUP_BLOCK_UNINIT |
 				 EXT4_BLOCK_GROUP_INODE_UNINIT);
 
+		if (info->lazy_itable_init)
+			ext4_bg_set_itable_unused(bg_desc, aux_info->sb,
+						  info->inodes_per_group);
+
+		ext4_bg_set_checksum(bg_desc,
+				     ext4_fs_bg_checksum(aux_info->sb, i,
+							 bg_desc));
+
 		sb_free_blk += bg_free_blk;
 
+		/* Bitmaps of uninitialized groups are never read */
+		if (info->lazy_itable_init && i != aux_info->groups - 1)
+			goto next;
+
 		r = ext4_block_get_noread(bd, &b, bg_start_block + blk_off + 1);
 		if (r != EOK)
 			return r;
@@ -416,6 +431,7 @@ static int write_bgroups(struct ext4_blockdev *bd, struct fs_aux_info *aux_info,
 		if (r != EOK)
 			return r;
 
+	next:
 		if (++k != dsc_per_block)
 			continue;
 
@@ -513,13 +529,17 @@ static int mkfs_init(struct ext4_blockdev *bd, struct ext4_mkfs_info *info)
 	return r;
 }
 
-static int init_bgs(struct ext4_fs *fs)
+static int init_bgs(struct ext4_fs *fs, struct ext4_mkfs_info *info)
 {
 	int r = EOK;
 	struct ext4_block_group_ref ref;
 	uint32_t i;
 	uint32_t bg_count = ext4_block_group_cnt(&fs->sb);
-	for (i = 0; i < bg_count; ++i) {
+
+	/* Lazy init: other groups are set up when they are first used, only
+	 * the last one may not have an uninitialized block bitmap */
+	i = info->lazy_itable_init ? bg_count - 1 : 0;
+	for (; i < bg_count; ++i) {
 		r = ext4_fs_get_block_group_ref(fs, i, &ref);
 		if (r != EOK)
 			break;
@@ -548,7 +568,7 @@ static int alloc_inodes(struct ext4_fs *fs)
 			break;
 		}
 
-		r = ext4_fs_alloc_inode(fs, &inode_ref, filetype);
+		r = ext4_fs_alloc_inode(fs, &inode_ref, filetype, 0);
 		if (r != EOK)
 			return r;
 
@@ -668,13 +688,14 @@ static int create_journal_inode(struct ext4_fs *fs,
 		if (iblock != 0)
 			continue;
 
-		ret = ext4_block_get(fs->bdev, &blk, fblock);
+		/* Whole block is rewritten, stale content isn't needed */
+		ret = ext4_block_get_noread(fs->bdev, &blk, fblock);
 		if (ret != EOK)
 			goto Finish;
 
+		memset(blk.data, 0, info->block_size);
 
 		struct jbd_sb * jbd_sb = (struct jbd_sb * )blk.data;
-		memset(jbd_sb, 0, sizeof(struct jbd_sb));
 
 		jbd_sb->header.magic = to_be32(JBD_MAGIC_NUMBER);
 		jbd_sb->header.blocktype = to_be32(JBD_SUPERBLOCK_V2);
@@ -764,6 +785,10 @@ int ext4_mkfs(struct ext4_fs *fs, struct ext4_blockdev *bd,
 	info->feat_ro_compat &= ~EXT4_FRO_COM_EXTRA_ISIZE;
 	info->feat_ro_compat &= ~EXT4_FRO_COM_HUGE_FILE;
 
+	/* Uninitialized groups are honoured with group descriptor checksums */
+	if (info->lazy_itable_init)
+		info->feat_ro_compat |= EXT4_FRO_COM_GDT_CSUM;
+
 	if (info->journal)
 		info->feat_compat |= EXT4_FCOM_HAS_JOURNAL;
 
@@ -831,7 +856,7 @@ int ext4_mkfs(struct ext4_fs *fs, struct ext4_blockdev *bd,
 	if (r != EOK)
 		goto cache_fini;
 
-	r = init_bgs(fs);
+	r = init_bgs(fs, info);
 	if (r != EOK)
 		goto fs_fini;
 
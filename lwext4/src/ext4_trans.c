@@ -43,6 +43,11 @@
 
 #include "ext4_fs.h"
 #include "ext4_journal.h"
+#include "ext4_trans.h"
+#include "ext4_blockdev.h"
+
+#include <stdlib.h>
+#include <string.h>
 
 int ext4_trans_set_block_dirty(struct ext4_buf *buf)
 {
@@ -64,6 +69,46 @@ int ext4_trans_set_block_dirty(struct ext4_buf *buf)
 	return r;
 }
 
+/**@brief   Save a block the first time the running operation gets it.*/
+static int ext4_trans_undo_save(struct ext4_fs *fs, struct ext4_block *b)
+{
+	struct ext4_trans_undo *u = &fs->undo;
+	struct ext4_trans_undo_rec *rec;
+	uint32_t size = b->buf->bc->itemsize;
+
+	if (!u->active || b->buf->undo_seq == u->seq)
+		return EOK;
+
+	if (u->cnt == u->max) {
+		uint32_t max = u->max ? u->max * 2 : 16;
+
+		rec = ext4_realloc(u->recs, max * sizeof(*rec));
+		if (!rec)
+			return ENOMEM;
+
+		u->recs = rec;
+		u->max = max;
+	}
+
+	rec = &u->recs[u->cnt];
+	rec->lba = b->lb_id;
+	rec->data = NULL;
+
+	/*Changes of earlier operations (or committed ones, not written back
+	 * yet) are only in the cache*/
+	if (ext4_bcache_test_flag(b->buf, BC_DIRTY)) {
+		rec->data = ext4_malloc(size);
+		if (!rec->data)
+			return ENOMEM;
+
+		memcpy(rec->data, b->data, size);
+	}
+
+	u->cnt++;
+	b->buf->undo_seq = u->seq;
+	return EOK;
+}
+
 int ext4_trans_block_get_noread(struct ext4_blockdev *bdev,
 			  struct ext4_block *b,
 			  uint64_t lba)
@@ -72,6 +117,10 @@ int ext4_trans_block_get_noread(struct ext4_blockdev *bdev,
 	if (r != EOK)
 		return r;
 
+	r = ext4_trans_undo_save(bdev->fs, b);
+	if (r != EOK)
+		ext4_block_set(bdev, b);
+
 	return r;
 }
 
@@ -83,9 +132,83 @@ int ext4_trans_block_get(struct ext4_blockdev *bdev,
 	if (r != EOK)
 		return r;
 
+	r = ext4_trans_undo_save(bdev->fs, b);
+	if (r != EOK)
+		ext4_block_set(bdev, b);
+
 	return r;
 }
 
+void ext4_trans_undo_begin(struct ext4_fs *fs)
+{
+	struct ext4_trans_undo *u = &fs->undo;
+
+	if (u->active)
+		return;
+
+	/*Buffers are tagged with the operation: 0 tags none*/
+	if (!++u->seq)
+		u->seq = 1;
+
+	u->active = true;
+	u->sb = fs->sb;
+	u->pending_cnt = fs->pending.cnt;
+	u->pending_blocks = fs->pending.blocks;
+}
+
+void ext4_trans_undo_end(struct ext4_fs *fs)
+{
+	struct ext4_trans_undo *u = &fs->undo;
+	uint32_t i;
+
+	for (i = 0; i < u->cnt; i++)
+		ext4_free(u->recs[i].data);
+
+	ext4_free(u->recs);
+	u->recs = NULL;
+	u->cnt = 0;
+	u->max = 0;
+	u->active = false;
+	u->pending_cnt = 0;
+}
+
+void ext4_trans_undo_rollback(struct ext4_fs *fs)
+{
+	struct ext4_trans_undo *u = &fs->undo;
+	struct ext4_bcache *bc = fs->bdev->bc;
+	struct ext4_trans_undo_rec *rec;
+	struct ext4_block b;
+	uint32_t i;
+
+	/*Backwards: a block saved again after it was written back and
+	 * dropped from the cache ends up with its first copy*/
+	for (i = u->cnt; i-- > 0;) {
+		rec = &u->recs[i];
+		if (!ext4_bcache_find_get(bc, &b, rec->lba)) {
+			/*Written back and dropped: it was not in the running
+			 * transaction, so only a committed copy may be due*/
+			if (rec->data)
+				ext4_blocks_set_direct(fs->bdev, rec->data,
+						       rec->lba, 1);
+			continue;
+		}
+
+		if (rec->data)
+			memcpy(b.data, rec->data, bc->itemsize);
+		else if (ext4_bcache_test_flag(b.buf, BC_DIRTY))
+			ext4_blocks_get_direct(fs->bdev, b.data, rec->lba, 1);
+		else
+			ext4_bcache_clear_flag(b.buf, BC_UPTODATE);
+
+		ext4_block_set(fs->bdev, &b);
+	}
+
+	fs->sb = u->sb;
+	fs->pending.cnt = u->pending_cnt;
+	fs->pending.blocks = u->pending_blocks;
+	ext4_trans_undo_end(fs);
+}
+
 int ext4_trans_try_revoke_block(struct ext4_blockdev *bdev __unused,
 			        uint64_t lba __unused)
 {
@@ -0,0 +1,383 @@
+/*
+ * Copyright (c) 2015 Grzegorz Kostka (kostka.grzegorz@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * - Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ * - Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in the
+ *   documentation and/or other materials provided with the distribution.
+ * - The name of the author may not be used to endorse or promote products
+ *   derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Extent mapping regression tests.
+ *
+ * Each case formats a RAM disk, works on a file through the public API
+ * and checks the data read back and the free block count. Build from the
+ * lwext4 directory (src/<all>.c stands for every source in src):
+ *
+ *   cc -O2 -Iinclude -o extent_test tests/extent_test.c src/<all>.c
+ *   ./extent_test [image_dir]
+ *
+ * With image_dir, the image of every case is saved there for e2fsck.
+ */
+
+#include <ext4_config.h>
+#include <ext4.h>
+#include <ext4_mkfs.h>
+#include <ext4_blockdev.h>
+#include <ext4_errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DISK_SIZE (32u << 20)
+#define BLOCK_SIZE 4096
+#define MP "/mp/"
+
+/**********************RAM DISK************************************************/
+static uint8_t *disk;
+
+static int ramdisk_open(struct ext4_blockdev *bdev)
+{
+	(void)bdev;
+	return EOK;
+}
+
+static int ramdisk_bread(struct ext4_blockdev *bdev, void *buf,
+			 uint64_t blk_id, uint32_t blk_cnt)
+{
+	uint32_t bsize = bdev->bdif->ph_bsize;
+
+	memcpy(buf, disk + blk_id * bsize, (size_t)blk_cnt * bsize);
+	return EOK;
+}
+
+static int ramdisk_bwrite(struct ext4_blockdev *bdev, const void *buf,
+			  uint64_t blk_id, uint32_t blk_cnt)
+{
+	uint32_t bsize = bdev->bdif->ph_bsize;
+
+	memcpy(disk + blk_id * bsize, buf, (size_t)blk_cnt * bsize);
+	return EOK;
+}
+
+static int ramdisk_close(struct ext4_blockdev *bdev)
+{
+	(void)bdev;
+	return EOK;
+}
+
+static struct ext4_blockdev_iface ramdisk_iface = {
+	.open = ramdisk_open,
+	.bread = ramdisk_bread,
+	.bwrite = ramdisk_bwrite,
+	.close = ramdisk_close,
+	.ph_bsize = 512,
+	.ph_bcnt = DISK_SIZE / 512,
+};
+
+static struct ext4_blockdev ramdisk = {
+	.bdif = &ramdisk_iface,
+	.part_offset = 0,
+	.part_size = DISK_SIZE,
+};
+
+/**********************HELPERS*************************************************/
+#define CHECK(x)                                                               \
+	do {                                                                   \
+		if (!(x)) {                                                    \
+			printf("  %s:%d: %s\n", __FILE__, __LINE__, #x);       \
+			return -1;                                             \
+		}                                                              \
+	} while (0)
+
+static struct ext4_fs mkfs_fs;
+
+static int test_mount(void)
+{
+	if (ext4_device_register(&ramdisk, "ram") != EOK)
+		return -1;
+
+	return ext4_mount("ram", MP, false);
+}
+
+static int test_umount(void)
+{
+	int r = ext4_umount(MP);
+
+	ext4_device_unregister("ram");
+	return r;
+}
+
+static uint64_t free_blocks(void)
+{
+	struct ext4_mount_stats st;
+
+	if (ext4_mount_point_stats(MP, &st) != EOK)
+		return 0;
+
+	return st.free_blocks_count;
+}
+
+/**@brief   Write len bytes of c at off.*/
+static int put(const char *path, uint64_t off, size_t len, int c)
+{
+	ext4_file f;
+	size_t wcnt;
+	uint8_t *buf = malloc(len);
+	int r;
+
+	if (!buf)
+		return ENOMEM;
+
+	memset(buf, c, len);
+	r = ext4_fopen(&f, path, "r+b");
+	if (r == ENOENT)
+		r = ext4_fopen(&f, path, "wb");
+	if (r == EOK)
+		r = ext4_fseek(&f, (int64_t)off, SEEK_SET);
+	if (r == EOK)
+		r = ext4_fwrite(&f, buf, len, &wcnt);
+	if (r == EOK && wcnt != len)
+		r = EIO;
+
+	ext4_fclose(&f);
+	free(buf);
+	return r;
+}
+
+/**@brief   Punch a hole (the file size is kept).*/
+static int punch(const char *path, uint64_t off, uint64_t len)
+{
+	ext4_file f;
+	int r;
+
+	r = ext4_fopen(&f, path, "r+b");
+	if (r != EOK)
+		return r;
+
+	r = ext4_fallocate(&f, off, len,
+			   EXT4_FALLOC_FL_PUNCH_HOLE | EXT4_FALLOC_FL_KEEP_SIZE);
+	ext4_fclose(&f);
+	return r;
+}
+
+/**@brief   Read len bytes at off with one ext4_fread.*/
+static int get(const char *path, uint64_t off, uint8_t *buf, size_t len)
+{
+	ext4_file f;
+	size_t rcnt;
+	int r;
+
+	r = ext4_fopen(&f, path, "rb");
+	if (r != EOK)
+		return r;
+
+	r = ext4_fseek(&f, (int64_t)off, SEEK_SET);
+	if (r == EOK)
+		r = ext4_fread(&f, buf, len, &rcnt);
+	if (r == EOK && rcnt != len)
+		r = EIO;
+
+	ext4_fclose(&f);
+	return r;
+}
+
+/**@brief   Check that len bytes at off read back as c.*/
+static int expect(const char *path, uint64_t off, size_t len, int c)
+{
+	uint8_t *buf = malloc(len);
+	size_t i;
+	int r;
+
+	if (!buf)
+		return ENOMEM;
+
+	r = get(path, off, buf, len);
+	for (i = 0; r == EOK && i < len; i++) {
+		if (buf[i] != (uint8_t)c) {
+			printf("  byte %llu is 0x%02x, 0x%02x expected\n",
+			       (unsigned long long)(off + i), buf[i],
+			       (uint8_t)c);
+			r = EIO;
+		}
+	}
+
+	free(buf);
+	return r;
+}
+
+/**********************CASES***************************************************/
+/**@brief   A write starting in a hole in front of the first extent of a
+ *          leaf must stop at that extent.*/
+static int test_write_before_extent(void)
+{
+	const char *p = MP "sparse";
+	uint64_t before;
+
+	/*Holes at 0-1 and 4-9. The blocks freed at 0-1 go to another file,
+	 * so the new blocks can't be merged into the extent at 2-3.*/
+	CHECK(put(p, 0, 11 * BLOCK_SIZE, 'b') == EOK);
+	CHECK(punch(p, 0, 2 * BLOCK_SIZE) == EOK);
+	CHECK(put(MP "other", 0, 2 * BLOCK_SIZE, 'o') == EOK);
+	CHECK(punch(p, 4 * BLOCK_SIZE, 6 * BLOCK_SIZE) == EOK);
+
+	before = free_blocks();
+	CHECK(put(p, 0, 4 * BLOCK_SIZE, 'a') == EOK);
+
+	/*Only the hole at 0-1 gets blocks*/
+	CHECK(before - free_blocks() == 2);
+	CHECK(expect(p, 0, 4 * BLOCK_SIZE, 'a') == EOK);
+	CHECK(expect(p, 4 * BLOCK_SIZE, 6 * BLOCK_SIZE, 0) == EOK);
+	CHECK(expect(p, 10 * BLOCK_SIZE, BLOCK_SIZE, 'b') == EOK);
+	CHECK(expect(MP "other", 0, 2 * BLOCK_SIZE, 'o') == EOK);
+	return 0;
+}
+
+/**@brief   A read starting in a hole in front of the first extent of a
+ *          leaf must return the data of that extent.*/
+static int test_read_after_hole(void)
+{
+	const char *p = MP "hole";
+	static uint8_t buf[2 * BLOCK_SIZE];
+	uint32_t i;
+
+	CHECK(put(p, 0, 2 * BLOCK_SIZE, 'a') == EOK);
+	CHECK(punch(p, 0, BLOCK_SIZE) == EOK);
+
+	/*Start with an empty extent cache*/
+	CHECK(test_umount() == EOK);
+	CHECK(test_mount() == EOK);
+
+	/*One read over the hole and the data*/
+	CHECK(get(p, 0, buf, sizeof(buf)) == EOK);
+	for (i = 0; i < BLOCK_SIZE; i++)
+		CHECK(buf[i] == 0 && buf[BLOCK_SIZE + i] == 'a');
+	return 0;
+}
+
+/**@brief   A block allocated in a punched hole right in front of an
+ *          extent is merged into it. The bytes a partial write leaves
+ *          out read as zeros.*/
+static int test_punch_rewrite(void)
+{
+	const char *p = MP "punched";
+	uint64_t before;
+
+	CHECK(put(p, 0, 2 * BLOCK_SIZE, 'a') == EOK);
+	CHECK(punch(p, 0, BLOCK_SIZE) == EOK);
+
+	before = free_blocks();
+	CHECK(put(p, 100, 1, 'b') == EOK);
+
+	CHECK(before - free_blocks() == 1);
+	CHECK(expect(p, 0, 100, 0) == EOK);
+	CHECK(expect(p, 100, 1, 'b') == EOK);
+	CHECK(expect(p, 101, BLOCK_SIZE - 101, 0) == EOK);
+	CHECK(expect(p, BLOCK_SIZE, BLOCK_SIZE, 'a') == EOK);
+	return 0;
+}
+
+/**@brief   Raising the size with fallocate exposes the rest of the old
+ *          last block: it must read as zeros.*/
+static int test_fallocate_tail(void)
+{
+	const char *p = MP "tail";
+	ext4_file f;
+
+	CHECK(put(p, 0, 2 * BLOCK_SIZE, 0xaa) == EOK);
+
+	CHECK(ext4_fopen(&f, p, "r+b") == EOK);
+	CHECK(ext4_ftruncate(&f, 5000) == EOK);
+	CHECK(ext4_fallocate(&f, 0, 2 * BLOCK_SIZE, 0) == EOK);
+	CHECK(ext4_fsize(&f) == 2 * BLOCK_SIZE);
+	CHECK(ext4_fclose(&f) == EOK);
+
+	CHECK(expect(p, 0, 5000, 0xaa) == EOK);
+	CHECK(expect(p, 5000, 2 * BLOCK_SIZE - 5000, 0) == EOK);
+	return 0;
+}
+
+struct test_case {
+	const char *name;
+	int (*fn)(void);
+};
+
+static const struct test_case cases[] = {
+	{"write_before_extent", test_write_before_extent},
+	{"read_after_hole", test_read_after_hole},
+	{"punch_rewrite", test_punch_rewrite},
+	{"fallocate_tail", test_fallocate_tail},
+};
+
+static int run_case(const struct test_case *tc, const char *image_dir)
+{
+	struct ext4_mkfs_info info = {0};
+	int r;
+
+	memset(disk, 0, DISK_SIZE);
+	info.block_size = BLOCK_SIZE;
+	info.journal = true;
+	if (ext4_mkfs(&mkfs_fs, &ramdisk, &info, F_SET_EXT4) != EOK)
+		return -1;
+
+	if (test_mount() != EOK)
+		return -1;
+
+	r = tc->fn();
+	if (test_umount() != EOK)
+		r = -1;
+
+	if (image_dir) {
+		char name[256];
+		FILE *img;
+
+		snprintf(name, sizeof(name), "%s/%s.img", image_dir, tc->name);
+		img = fopen(name, "wb");
+		if (img) {
+			fwrite(disk, 1, DISK_SIZE, img);
+			fclose(img);
+		}
+	}
+
+	return r;
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	int failed = 0;
+
+	disk = malloc(DISK_SIZE);
+	if (!disk)
+		return 1;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		int r = run_case(&cases[i], argc > 1 ? argv[1] : NULL);
+
+		printf("%-24s %s\n", cases[i].name, r ? "FAIL" : "ok");
+		failed += r != 0;
+	}
+
+	free(disk);
+	return failed != 0;
+}